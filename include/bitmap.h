@@ -0,0 +1,66 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <cstdint>  // uint64_t
+#include <cstring>  // memcpy()
+#include <vector>   // std::vector
+
+namespace fs {
+
+/*******************************************************************************
+ * Word-packed bitmap. Bits are stored 64 per word, so searching for the next
+ * set bit skips 64 bits per compare and finds the exact bit with a
+ * count-trailing-zeros instruction.
+ *
+ * The bitmap keeps a running count of set bits, so count() is O(1).
+ *
+ * Used by Fat to track free blocks: a set bit marks a free block. Used by
+ * Disk to track dirty blocks: a set bit marks a block not yet flushed.
+ ******************************************************************************/
+class Bitmap {
+public:
+    enum { NPOS = -1, WORD_BITS = 64 };
+
+    Bitmap(std::size_t bits = 0);
+
+    std::size_t size() const;   // number of bits
+    std::size_t count() const;  // number of set bits
+    bool empty() const;         // no bits set
+    bool test(std::size_t i) const;
+
+    // bytes needed to store bits as packed words
+    static std::size_t bytes_for(std::size_t bits);
+    std::size_t bytes() const;
+
+    // copy packed words from src, or to dst, of bytes()
+    void load(const char* src, std::size_t bits);
+    void store(char* dst) const;
+
+    void resize(std::size_t bits);  // resize and clear all bits
+    void set(std::size_t i);
+    void reset(std::size_t i);
+    void set_all();
+    void reset_all();
+
+    // index of next set/unset bit at or after from, or NPOS
+    long find_next(std::size_t from = 0) const;
+    long find_next_unset(std::size_t from = 0) const;
+
+    // first index of a run of n set bits at or after from, or NPOS
+    long find_run(std::size_t n, std::size_t from = 0) const;
+
+    // number of consecutive set bits starting at i, up to max
+    std::size_t run_length(std::size_t i, std::size_t max) const;
+
+private:
+    std::vector<uint64_t> _words;
+    std::size_t _bits;   // number of bits
+    std::size_t _count;  // number of set bits
+
+    // mask of valid bits in the last word
+    uint64_t _tail_mask() const;
+};
+
+}  // namespace fs
+
+#endif  // BITMAP_H
@@ -0,0 +1,146 @@
+#ifndef CACHE_MODEL_H
+#define CACHE_MODEL_H
+
+#include <algorithm>      // sort(), unique(), max()
+#include <list>           // std::list
+#include <mutex>          // std::mutex
+#include <stdexcept>      // std::exception
+#include <string>         // std::string
+#include <thread>         // std::this_thread
+#include <unordered_map>  // std::unordered_map
+#include <utility>        // std::pair
+#include <vector>         // std::vector
+#include "disk.h"         // Disk class
+
+namespace fs {
+
+/*******************************************************************************
+ * Cost model of a buffer cache of filesystem blocks, a cluster of disk blocks
+ * each, between a filesystem and its Disk. Blocks are numbered from the start
+ * of the disk.
+ *
+ * The model holds no block data. It only decides which blocks a cache of its
+ * capacity would keep resident and charges the Disk's simulated time for the
+ * transfers that cache would make. The Disk's image stays the only copy of
+ * block data, and the filesystem reads and writes blocks in place there. A
+ * miss charges a Disk read of the block, and evicting a dirty block charges a
+ * Disk write of it, so resident blocks cost no device time. Its hit rates and
+ * times are simulated, not measured.
+ *
+ * With the model disabled, a FAT or directory access charges a read unless
+ * the same thread's last such access was to the same block, as a filesystem
+ * without a cache still reads each block once into a working buffer.
+ *
+ * Eviction is 2Q: blocks seen once enter the A1in FIFO, blocks seen again
+ * after leaving A1in (tracked by the A1out ghost list) enter the Am LRU. A
+ * scan of cold blocks only cycles A1in and does not flush hot blocks from Am.
+ * Pinned blocks are never evicted.
+ *
+ * Blocks accessed dirty are marked in the Disk's dirty bitmap on commit(),
+ * cache enabled or not, so the Disk flushes them to its file. Marking after
+ * the update keeps a Disk flusher from taking a block before it is written.
+ * A journal takes the FAT and directory blocks out first with
+ * take_metadata() and marks their home blocks once it has logged them.
+ *
+ * Hits and misses are counted per block class.
+ *
+ * The cache is thread safe. Blocks accessed dirty are kept per thread, so
+ * commit() and take_metadata() only take the calling thread's updates and an
+ * update in progress on another thread is not marked or logged half done.
+ ******************************************************************************/
+class CacheModel {
+public:
+    enum BlockClass { FAT, DIR, DATA, CLASSES };
+
+    CacheModel();
+
+    // cache blocks of block_size bytes of disk in mb megabytes, 0 to disable,
+    // addresses accessed are from base, the Disk's file if nullptr
+    void attach(Disk* disk, std::size_t block_size, std::size_t mb,
+                const char* base = nullptr);
+    void detach();  // write back dirty blocks and forget all blocks
+
+    bool enabled() const;
+    std::size_t capacity() const;  // blocks that fit in cache
+    std::size_t size() const;      // resident blocks
+    bool resident(long block) const;
+
+    // make block resident, reading it on a miss, return true on a hit
+    bool access(long block, int cls, bool dirty = false);
+    bool access(const char* address, int cls, bool dirty = false);
+
+    // access count blocks from block, reading each run of misses at once
+    void access_run(long block, std::size_t count, int cls,
+                    bool dirty = false);
+
+    // access block and keep it resident until unpinned
+    void pin(long block, int cls);
+    void unpin(long block);
+
+    // mark blocks accessed dirty by the calling thread in the Disk
+    void commit();
+
+    // remove FAT and directory blocks accessed dirty by the calling thread
+    // from its next commit, return them sorted and unique for a journal
+    std::vector<long> take_metadata();
+
+    void flush();   // write back dirty blocks
+    void reset();  // clear hit/miss counts
+
+    std::size_t hits(int cls) const;
+    std::size_t misses(int cls) const;
+    std::size_t writebacks() const;
+    std::string info() const;  // simulated hit rates by class
+
+private:
+    enum Queue { A1IN, AM };
+
+    struct Frame {
+        int queue;                      // A1IN or AM
+        int pins;                       // evictable when 0
+        bool dirty;                     // written since read
+        std::list<long>::iterator pos;  // position in queue
+    };
+
+    Disk* _disk;
+    const char* _base;        // address of block 0
+    std::size_t _block_size;  // bytes of a block
+    std::size_t _frames;      // capacity in blocks
+    std::size_t _in_max;      // A1in capacity
+    std::size_t _out_max;     // A1out capacity
+
+    std::unordered_map<long, Frame> _resident;
+    std::list<long> _a1in;   // front is newest
+    std::list<long> _am;     // front is most recently used
+    std::list<long> _a1out;  // ghosts, front is newest
+    std::unordered_map<long, std::list<long>::iterator> _ghosts;
+
+    std::size_t _hits[CLASSES];
+    std::size_t _misses[CLASSES];
+    std::size_t _writebacks;
+
+    // last FAT or directory block charged with the model disabled, by thread
+    std::unordered_map<std::thread::id, long> _last_read;
+
+    // blocks accessed dirty since commit, with their class, by thread
+    std::unordered_map<std::thread::id, std::vector<std::pair<long, int>>>
+        _updated;
+
+    mutable std::mutex _mutex;  // guards all members
+
+    // access, commit and flush with _mutex held
+    bool _access(long block, int cls, bool dirty);
+    void _commit(std::vector<std::pair<long, int>>& updated);
+    void _flush();
+
+    void _insert(long block, bool dirty);  // make missed block resident
+    void _evict();                         // free one frame
+
+    // disk read of count blocks, disk write of a block
+    void _read(long block, std::size_t count);
+    void _write(long block);
+};
+
+}  // namespace fs
+
+#endif  // CACHE_MODEL_H
@@ -1,15 +1,29 @@
 #ifndef DISK_H
 #define DISK_H
 
-#include <fcntl.h>      // file constants
-#include <sys/mman.h>   // mmap()
-#include <sys/stat.h>   // path stat and constants
-#include <sys/types.h>  // unix types
-#include <unistd.h>     // open(), read(), write(), usleep()
-#include <cstdio>       // remove()
-#include <cstring>      // strncpy()
-#include <stdexcept>    // std::exception
-#include <string>       // std::string
+#include <fcntl.h>             // file constants, posix_fallocate()
+#include <sys/mman.h>          // mmap(), msync()
+#include <sys/stat.h>          // path stat and constants
+#include <sys/types.h>         // unix types
+#include <sys/uio.h>           // struct iovec
+#include <unistd.h>            // open(), pwrite(), ftruncate(), usleep()
+#include <algorithm>           // min()
+#include <atomic>              // std::atomic
+#include <cerrno>              // errno
+#include <chrono>              // std::chrono
+#include <condition_variable>  // std::condition_variable
+#include <cstdint>             // uint64_t
+#include <cstdio>              // remove()
+#include <cstring>             // memcpy()
+#include <memory>              // std::unique_ptr
+#include <mutex>               // std::mutex
+#include <stdexcept>           // std::exception
+#include <string>              // std::string
+#include <thread>              // std::this_thread, std::thread
+#include <unordered_map>       // std::unordered_map
+#include <utility>             // std::pair
+#include <vector>              // std::vector
+#include "bitmap.h"            // Bitmap class
 
 namespace fs {
 
@@ -19,13 +33,103 @@ namespace fs {
  * of cylinder - 1 and sector - 1. Or a disk can return a address location at
  * block number for direct writing/reading.
  *
- * Disk reading/writing delay can be set by _track_time
+ * Disk reading/writing delay models a moving head over a spinning platter.
+ * An access costs a seek of _track_time per cylinder between the head and
+ * the block, the rotational latency until the block's sector turns under the
+ * head, then _transfer_time per block moved. The platter turns once every
+ * _rotation_time of simulated time. Simulated totals are kept in Timing.
+ *
+ * Each access advances a simulated clock by its cost, kept in total and per
+ * calling thread. By default an access also sleeps for its cost, after it
+ * moved the head and let go of it, so threads overlap their waits. With the
+ * virtual clock on it does not sleep, so runs take no wall time and the
+ * simulated clock is the only measure of time.
+ * read_blocks/write_blocks move a run of blocks to or from caller buffers in
+ * a single access.
+ *
+ * Disk file layout by version:
+ *  - v1: | cylinders | sectors | max_block | blocks...
+ *  - v2: | magic | version | cylinders | sectors | max_block | pad | blocks...
+ * Header fields are size_t. A v2 header is padded to HEADER_SZ, so blocks are
+ * page aligned, and aligned to their size for power of two sizes up to
+ * HEADER_SZ. New disks are v2, v1 disks are detected by the missing magic.
+ *
+ * The disk file is provisioned at create as a SPARSE file, where blocks are
+ * allocated by the file system on first write, or PREALLOCATE, where all
+ * blocks are reserved up front. Prefault populates the mapping at create and
+ * open so first accesses do not page fault, and loads the whole image of a
+ * buffered backend at open.
+ *
+ * Disk data lives in a memory image that data_at() points into. The backend
+ * decides how the image reaches the disk file:
+ *  - MMAP: the image is a shared mapping of the file, the kernel writes it
+ *          back and first accesses page fault
+ *  - PREAD: the image is reserved private memory, each page of it read with
+ *           pread() on its first access, dirty blocks go to the file with
+ *           pwrite(). read_blocks() of pages never loaded reads the file
+ *           into the caller's buffers with preadv()
+ *  - DIRECT: as PREAD over an O_DIRECT descriptor, moving page aligned
+ *            extents of the page aligned image, a file tail that is not a
+ *            whole page goes through the page cache
+ * A buffered image only holds the pages accessed since open, so it takes
+ * memory for those pages and not for the whole file. Pages are DIRECT_ALIGN
+ * bytes of the file. A page written whole is not read first.
+ *
+ * Blocks written through write_at/write_blocks, or marked by mark_dirty()
+ * after a change through data_at(), are tracked in a dirty bitmap. flush()
+ * writes each run of dirty blocks to the file and makes it durable, with a
+ * ranged msync() for MMAP, pwrite() and fsync() for the others, and a flush of
+ * a range of blocks writes only the dirty runs within it. Durability decides
+ * when flushes happen:
+ *  - NONE: only on flush() and sync(), MMAP is left to the kernel
+ *  - PERIODIC: a flusher thread every flush interval, or as soon as the dirty
+ *              blocks reach the dirty ratio of the disk
+ *  - SYNC: on every commit(), which a caller makes after each update
+ * sync() flushes and then makes the whole file durable. The destructor calls
+ * it unless the backend is MMAP with NONE durability.
  ******************************************************************************/
 class Disk {
 public:
     enum {
-        MAX_BLOCK = 128,  // bytes in a sector
-        TRACK_TIME = 100  // microseconds
+        MAX_BLOCK = 128,                            // bytes in a sector
+        TRACK_TIME = 10,                            // microseconds per cylinder
+        ROTATION_TIME = 200,                        // microseconds per turn
+        TRANSFER_TIME = 1,                          // microseconds per block
+        VERSION = 2,                                // current disk file version
+        HEADER_SZ = 64 * 1024,                      // bytes of a v2 header
+        DIRECT_ALIGN = 4096,                        // bytes of direct I/O unit
+        FLUSH_INTERVAL = 1000,                      // milliseconds per flush
+        DIRTY_RATIO = 10,                           // percent of dirty blocks
+        LEGACY_HEADER_SZ = 3 * sizeof(std::size_t)  // bytes of a v1 header
+    };
+
+    static const uint64_t MAGIC = 0x4b53494454414646;  // "FFATDISK"
+
+    enum Provision { SPARSE, PREALLOCATE };
+
+    enum Backend { MMAP, PREAD, DIRECT };
+
+    enum Durability { NONE, PERIODIC, SYNC };
+
+    // simulated totals of disk accesses, times in microseconds
+    struct Timing {
+        std::size_t accesses;   // number of accesses
+        std::size_t blocks;     // blocks moved
+        std::size_t cylinders;  // cylinders crossed by the head
+        std::size_t seek;       // time moving the head
+        std::size_t rotation;   // time waiting for sectors
+        std::size_t transfer;   // time moving blocks
+
+        std::size_t total() const;  // time of all accesses
+    };
+
+    // totals of flushes of dirty blocks, times in wall microseconds
+    struct Writeback {
+        std::size_t flushes;   // flushes that wrote blocks
+        std::size_t runs;      // runs of dirty blocks written
+        std::size_t bytes;     // bytes written
+        std::size_t time;      // time flushing
+        std::size_t max_time;  // time of the longest flush
     };
 
     Disk(std::string name, int cyl = 1, int sec = 32);
@@ -38,10 +142,13 @@ public:
     bool valid() const;        // check if disk is valid
     operator bool() const;
 
+    int version() const;  // disk file version
     std::size_t cylinder() const;
     std::size_t sector() const;
     std::size_t max_block() const;
     std::size_t track_time() const;
+    std::size_t rotation_time() const;
+    std::size_t transfer_time() const;
     std::size_t logical_bytes() const;
     std::size_t physical_bytes() const;
     std::string name() const;
@@ -52,15 +159,60 @@ public:
     std::size_t location(std::size_t block) const;
     std::string geometry() const;  // return a string with disk geometry
 
-    int fd() const;                  // return internal file descriptor
-    char* file() const;              // return original file ptr
-    char* data_at(int block) const;  // return pointer at specified block
+    int fd() const;      // return internal file descriptor
+    char* file() const;  // return original file ptr, pages not loaded
+
+    // return pointer at specified block, with count blocks from it loaded in
+    // a buffered image, or nullptr if out of range
+    char* data_at(long block, std::size_t count = 1) const;
+
+    void set_cylinders(int c);              // set cylinders if valid
+    void set_sectors(int s);                // set sectors per cylinder if valid
+    void set_block_size(int b);             // set sector size if valid
+    void set_track_time(std::size_t t);     // set seek delay per cylinder
+    void set_rotation_time(std::size_t t);  // set delay of a platter turn
+    void set_transfer_time(std::size_t t);  // set delay per block moved
+    bool set_name(std::string n);           // set disk name when not valid
+
+    int provision() const;          // file provisioning by Provision
+    bool prefault() const;          // populate mapping on create/open
+    void set_provision(int p);      // set provisioning when not valid
+    void set_prefault(bool is_on);  // set prefault when not valid
+
+    int backend() const;      // file access by Backend
+    void set_backend(int b);  // set backend when not valid
+    bool sync();              // flush and make whole file durable
+    static const char* backend_name(int b);
 
-    void set_cylinders(int c);           // set cylinders if valid
-    void set_sectors(int s);             // set sectors per cylinder if valid
-    void set_block_size(int b);          // set sector size if valid
-    void set_track_time(std::size_t t);  // set sector size if valid
-    bool set_name(std::string n);        // set disk name when not valid
+    int durability() const;                   // flushes by Durability
+    void set_durability(int d);               // starts or stops flusher
+    std::size_t flush_interval() const;       // flusher period in ms
+    void set_flush_interval(std::size_t ms);  // set flusher period
+    std::size_t dirty_ratio() const;          // percent that wakes flusher
+    void set_dirty_ratio(std::size_t percent);
+    static const char* durability_name(int d);
+
+    void mark_dirty(std::size_t block, std::size_t count = 1);
+    std::size_t dirty_blocks() const;  // blocks not yet flushed
+    std::size_t flush();               // write dirty blocks, return bytes
+    void commit();                     // flush if durability is SYNC
+
+    // write dirty blocks among count blocks from block, return bytes
+    std::size_t flush(std::size_t block, std::size_t count);
+
+    Writeback writeback() const;         // flush totals
+    std::string writeback_info() const;  // flush totals as text
+    void reset_writeback();              // clear flush totals
+
+    std::size_t head() const;         // cylinder of the head
+    Timing timing() const;            // simulated totals
+    std::string timing_info() const;  // simulated totals as text
+    void reset_timing();              // clear simulated totals
+
+    bool virtual_clock() const;          // accesses advance clock only
+    void set_virtual_clock(bool is_on);  // set virtual clock mode
+    std::size_t clock() const;           // simulated microseconds elapsed
+    std::size_t thread_time() const;     // simulated us of thread's accesses
 
     // read at cylinder and sector index
     std::string read_at(std::size_t cyl, std::size_t sec) const;
@@ -70,6 +222,17 @@ public:
     bool write_at(char* buf, std::size_t cyl, std::size_t sec,
                   std::size_t bufsz = MAX_BLOCK);
 
+    // read/write count blocks from block, scattered to or gathered from
+    // iovcnt buffers, return bytes moved or 0 if out of range
+    std::size_t read_blocks(std::size_t block, std::size_t count,
+                            const struct iovec* iov, int iovcnt) const;
+    std::size_t write_blocks(std::size_t block, std::size_t count,
+                             const struct iovec* iov, int iovcnt);
+
+    // pay the simulated time of moving count blocks from block, for
+    // callers that use the blocks in place in the mapped file
+    void charge(std::size_t block, std::size_t count) const;
+
 private:
     std::size_t _cylinders;       // number of cyclinders
     std::size_t _sectors;         // number of sectors per cylinder
@@ -78,15 +241,71 @@ private:
     std::size_t _logical_bytes;   // bytes of disk without geometry info
     std::size_t _physical_bytes;  // total bytes with geometry info
     std::size_t _track_time;      // microseconds to sleep during read/write
+    std::size_t _rotation_time;   // microseconds of a platter turn
+    std::size_t _transfer_time;   // microseconds to sleep per block moved
+    int _version;                 // disk file version
+    int _provision;               // file provisioning by Provision
+    bool _prefault;               // populate mapping on create/open
+    int _backend;                 // file access by Backend
 
     std::string _name;       // disk basename
     std::string _disk_name;  // full disk filename with extension
     int _fd;                 // file decriptor to physical file
+    int _direct_fd;          // O_DIRECT file descriptor of DIRECT backend
     char* _file;             // logical file where actual data starts
     char* _pfile;            // physical file, original address from mmap
 
+    // set bit marks a page of a buffered image read from the file
+    std::unique_ptr<std::atomic<uint64_t>[]> _loaded;
+    mutable std::mutex _load_mutex;  // one thread reads pages at a time
+
+    mutable std::mutex _head_mutex;  // one access at a time moves the head
+    mutable std::size_t _head;       // cylinder of the head
+    mutable Timing _timing;          // simulated totals
+    mutable std::size_t _clock;      // simulated microseconds elapsed
+    bool _virtual;                   // do not sleep for accesses
+
+    // simulated microseconds of accesses by each thread
+    mutable std::unordered_map<std::thread::id, std::size_t> _thread_times;
+
+    int _durability;              // flushes by Durability
+    std::size_t _flush_interval;  // milliseconds between periodic flushes
+    std::size_t _dirty_ratio;     // percent of dirty blocks to flush early
+    Bitmap _dirty;                // set bit marks a block not yet flushed
+    Writeback _writeback;         // flush totals
+
+    mutable std::mutex _dirty_mutex;    // guards dirty bitmap and totals
+    std::mutex _flush_mutex;            // one flush at a time
+    std::condition_variable _flush_cv;  // wakes the flusher
+    std::thread _flusher;               // periodic flusher thread
+    bool _flusher_stop;                 // flusher exits
+
     void _close_fd();    // close file descriptor
+    void _map_file();    // map virtual memory to file of physical bytes
     void _unmap_file();  // unmap virtual memory from file
+
+    void _start_flusher();     // run flusher if durability is PERIODIC
+    void _stop_flusher();      // join flusher if running
+    void _flush_loop();        // flusher thread loop
+    bool _over_ratio() const;  // dirty blocks reach ratio, _dirty_mutex held
+
+    // move physical bytes from offset between image and file by backend
+    bool _transfer(std::size_t offset, std::size_t len, bool is_write) const;
+
+    // read pages of physical bytes from offset into a buffered image if not
+    // loaded, pages the bytes fill whole are only marked when overwritten
+    bool _load(std::size_t offset, std::size_t len,
+               bool is_overwrite = false) const;
+    bool _page_loaded(std::size_t page) const;
+    bool _any_loaded(std::size_t offset, std::size_t len) const;
+
+    // write loaded pages of physical bytes from offset to the file
+    bool _write_loaded(std::size_t offset, std::size_t len) const;
+    bool _io(int fd, std::size_t offset, std::size_t len, bool is_write) const;
+
+    // move head to block, then sleep for an access moving blocks with the
+    // head unlocked
+    void _access(std::size_t block, std::size_t blocks) const;
 };
 
 }  // namespace fs
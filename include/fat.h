@@ -1,23 +1,39 @@
 #ifndef FAT_H
 #define FAT_H
 
-#include <fcntl.h>       // io macro
-#include <sys/mman.h>    // mmap()
-#include <sys/stat.h>    // fstat
-#include <sys/types.h>   // struct stat
-#include <unistd.h>      // open()
-#include <cstdio>        // remove()
-#include <cstring>       // strncpy(), memset()
-#include <ctime>         // ctime(), time_t
-#include <iomanip>       // setw()
-#include <iostream>      // stream
-#include <list>          // list
-#include <set>           // set
-#include <stdexcept>     // exception
-#include <string>        // string
-#include <tuple>         // forward_as_tuple()
-#include "ansi_style.h"  // terminaal ANSI styling in unix
-#include "disk.h"        // Disk class
+#include <fcntl.h>        // io macro
+#include <sys/mman.h>     // mmap()
+#include <sys/stat.h>     // fstat
+#include <sys/types.h>    // struct stat
+#include <unistd.h>       // open()
+#include <algorithm>      // min(), max()
+#include <atomic>         // std::atomic
+#include <cstdint>        // int64_t
+#include <cstdio>         // remove()
+#include <cstring>        // strncpy(), memset()
+#include <ctime>          // ctime(), time_t
+#include <functional>     // std::function
+#include <iomanip>        // setw()
+#include <iostream>       // stream
+#include <limits>         // numeric_limits
+#include <list>           // list
+#include <memory>         // unique_ptr
+#include <mutex>          // mutex
+#include <numeric>        // gcd()
+#include <set>            // set
+#include <stdexcept>      // exception
+#include <string>         // string
+#include <thread>         // this_thread
+#include <tuple>          // forward_as_tuple()
+#include <unordered_map>  // unordered_map
+#include <vector>         // vector
+#include "ansi_style.h"   // terminaal ANSI styling in unix
+#include "bitmap.h"       // Bitmap class
+#include "cache_model.h"  // CacheModel class
+#include "disk.h"         // Disk class
+#include "journal.h"      // Journal class
+#include "lock_table.h"   // LockTable class
+#include "session.h"      // Session class
 
 namespace fs {
 
@@ -26,8 +42,18 @@ namespace fs {
  * a disk block. A new Entry must be followed by init() to set default values.
  *
  * Structure of Entry
- * |      name     | valid | type | dot | dotdot | timestamps...
- *  char* MAX_NAME   bool    bool   int    int       time_t
+ * |      name     | type | dot | dotdot | size | timestamps...
+ *  char* MAX_NAME   bool   int    int     int      time_t
+ *
+ * Block and size fields are int, or int64_t in a wide entry. Wide entries
+ * are used by filesystems with 64-bit block numbers and sizes.
+ *
+ * Block, size, type and timestamp fields are read and written atomically, so
+ * a directory size updated by threads holding different locks stays exact.
+ *
+ * The generation is not stored on disk. FatFS stamps an entry with the
+ * generation of its block when it hands the entry out, to tell it from a
+ * later entry in the same block.
  *
  * Default values when init() with valid address:
  * name: null bytes
@@ -49,17 +75,18 @@ public:
     // compare entry just by name
     static bool cmp_entry_name(const Entry& a, const Entry& b);
 
-    Entry(char* address = nullptr);
+    Entry(char* address = nullptr, bool is_wide = false);
 
     bool has_parent() const;
     bool valid() const;
+    bool wide() const;
     operator bool() const;
 
     std::string name() const;
     bool type() const;
-    int dot() const;
-    int dotdot() const;
-    int size() const;
+    long dot() const;
+    long dotdot() const;
+    long size() const;
     time_t created() const;
     time_t* created_ptr() const;
     char* created_str() const;
@@ -69,6 +96,7 @@ public:
     time_t last_modified() const;
     time_t* last_modified_ptr() const;
     char* last_modified_str() const;
+    unsigned long generation() const;
 
     // Clear and initialize all fields to default values
     // Must init when adding a new and fresh Entry!
@@ -82,17 +110,18 @@ public:
     void set_address(char* address);
     void set_name(std::string name);
     void set_type(bool type);
-    void set_dot(int block);
-    void set_dotdot(int block);
-    void set_size(int size);
-    void inc_size(int inc);
-    void dec_size(int dec);
+    void set_dot(long block);
+    void set_dotdot(long block);
+    void set_size(long size);
+    void inc_size(long inc);
+    void dec_size(long dec);
     void set_created(time_t t);
     void update_created();
     void set_last_accessed(time_t t);
     void update_last_accessed();
     void set_last_modified(time_t t);
     void update_last_modified();
+    void set_generation(unsigned long generation);
 
     friend bool operator<(const Entry& lhs, const Entry& rhs) {
         return lhs.name() < rhs.name();
@@ -101,12 +130,22 @@ public:
 protected:
     char* _name;
     bool* _type;
-    int* _dot;
-    int* _dotdot;
-    int* _size;
+    char* _dot;
+    char* _dotdot;
+    char* _size;
     time_t* _created;
     time_t* _last_accessed;
     time_t* _last_modified;
+    bool _wide;                 // int64_t block and size fields
+    unsigned long _generation;  // generation of block, in memory only
+
+    // read/write/add to a block or size field of entry's width
+    long _get(const char* field) const;
+    void _set(char* field, long value);
+    void _add(char* field, long inc);
+
+    // bytes of a block or size field
+    std::size_t _width() const;
 
     void _reset_address(char* address);
 };
@@ -120,7 +159,7 @@ protected:
  *
  * Structure of Entry
  * |   Entry   | dir_head | file_head
- *                 int         int
+ *                 int         int        (int64_t if wide)
  *
  * Default values when constructed with valid address:
  * dir_head: Entry:ENDBLOCK, head pointer of linked list to DirEntry
@@ -128,12 +167,12 @@ protected:
  ******************************************************************************/
 class DirEntry : public Entry {
 public:
-    DirEntry(char* address = nullptr);
+    DirEntry(char* address = nullptr, bool is_wide = false);
 
     bool has_dirs() const;
     bool has_files() const;
-    int dir_head() const;
-    int file_head() const;
+    long dir_head() const;
+    long file_head() const;
 
     // Clear and initialize all fields to default values
     // Must init when adding a new and fresh Entry!
@@ -146,12 +185,12 @@ public:
     // set address if DirEntry was not created with valid address
     void set_address(char* address);
 
-    void set_dir_head(int cell);
-    void set_file_head(int cell);
+    void set_dir_head(long cell);
+    void set_file_head(long cell);
 
 protected:
-    int* _dir_head;   // dir entry head ptr
-    int* _file_head;  // file entry head ptr
+    char* _dir_head;   // dir entry head ptr
+    char* _file_head;  // file entry head ptr
 
     // set address offsets from Entry's last adddress
     void _init_dir();
@@ -164,24 +203,33 @@ protected:
  * FileEntry is an extension of the Entry class for a file. A new Entry
  * must be followed by init() to set default values.
  *
- * Additional attributes: data_head (linked list ptr to start of data blocks)
- * and data_size (the size of all data, not rounded up to data blocks).
+ * Additional attributes: data_head (linked list ptr to start of data blocks),
+ * data_size (the size of all data, not rounded up to data blocks) and
+ * data_tail (ptr to last data block, so appends skip the chain walk).
  *
  * Structure of Entry
- * |   Entry   | data_head | data_size
- *                  int         int
+ * |   Entry   | data_head | data_size | data_tail
+ *                  int         int         int       (int64_t if wide)
  *
  * Default values when constructed with valid address:
  * data_head: Entry:ENDBLOCK, head pointer linked list to DataEntry
  * data_size: bytes of all data links (does not include nul byte)
+ * data_tail: Entry:ENDBLOCK, last block of linked list to DataEntry
+ *
+ * Data blocks are filled in chain order, so the fill level of the last block
+ * follows from data_size and does not need to be stored.
  ******************************************************************************/
 class FileEntry : public Entry {
 public:
-    FileEntry(char* address = nullptr);
+    FileEntry(char* address = nullptr, bool is_wide = false);
+
+    // bytes of a file entry, the largest entry
+    static std::size_t bytes(bool is_wide);
 
     bool has_data() const;
-    int data_head() const;
-    int data_size() const;
+    long data_head() const;
+    long data_size() const;
+    long data_tail() const;
 
     // Clear and initialize all fields to default values
     // Must init when adding a new and fresh Entry!
@@ -194,14 +242,16 @@ public:
     // set address if FileEntry was not created with valid address
     void set_address(char* address);
 
-    void set_data_head(int cell);
-    void set_data_size(int size);
-    void inc_data_size(int size);
-    void dec_data_size(int size);
+    void set_data_head(long cell);
+    void set_data_tail(long cell);
+    void set_data_size(long size);
+    void inc_data_size(long size);
+    void dec_data_size(long size);
 
 protected:
-    int* _data_head;  // data block head ptr
-    int* _data_size;  // size of data (stops at nul byte)
+    char* _data_head;  // data block head ptr
+    char* _data_size;  // size of data in bytes
+    char* _data_tail;  // last data block ptr
 
     // set address offsets from Entry's last adddress
     void _init_file();
@@ -230,7 +280,7 @@ public:
     char* data();
     void clear(std::size_t size);
 
-    // read data up to Disk::MAX_BLOCK and return successful bytes read
+    // read size bytes up to limit and return successful bytes read
     std::size_t read(char* buf, std::size_t size, std::size_t limit);
 
     // write data up to Disk::MAX_BLOCK and return successful bytes read
@@ -258,7 +308,7 @@ private:
  * points nowhere.
  *
  * Structure of a cell: [ int next cell/block #]
- * Size: sizeof(int) for each fat cell
+ * Size: sizeof(int) for each fat cell, or sizeof(int64_t) if wide
  *
  * Value of cell: FREE or USED
  *  - USED state is FatCell::END or greater
@@ -268,13 +318,15 @@ struct FatCell {
     enum {
         FREE = Entry::ENDBLOCK - 1,  // indicates free cell
         END = Entry::ENDBLOCK,       // end of cell/block indicator
-        SIZE = sizeof(int)           // bytes of a FatCell
+        SIZE = sizeof(int),          // bytes of a FatCell
+        WIDE_SIZE = sizeof(int64_t)  // bytes of a wide FatCell
     };
 
-    int* _next_cell;
+    char* _next_cell;
+    bool _wide;
 
     // CONSTRUCTOR
-    FatCell(char* address = nullptr);
+    FatCell(char* address = nullptr, bool is_wide = false);
 
     bool has_next() const;
     bool free() const;
@@ -283,11 +335,11 @@ struct FatCell {
     operator bool() const;
 
     // get next cell/block
-    int next_cell() const;
+    long next_cell() const;
 
     // set cell/block from address
     void set_free();
-    void set_next_cell(int c);
+    void set_next_cell(long c);
 
     friend bool operator==(const FatCell& lhs, const FatCell& rhs) {
         return lhs.next_cell() == rhs.next_cell();
@@ -310,31 +362,124 @@ struct FatCell {
  *
  * Each cell in a FAT also represent a block in disk at _cell_offset.
  * Ex: FAT[5] = Disk block at [5 + _cell_offset];
+ *
+ * Free cells are tracked in a Bitmap, one bit per cell. Allocation functions
+ * take and return disk block indices, which include _cell_offset. The free
+ * map can be persisted to disk to skip the FAT scan on next open.
+ *
+ * The free map is split into up to SHARDS shards of whole bitmap words, each
+ * with its own mutex, so threads allocating at once take different locks.
+ * Each thread starts its searches in a home shard, given out round robin as
+ * threads first allocate, and moves on to the next shards when its home has
+ * no free cell. Runs never span shards. The free count is kept atomic over
+ * all shards, so size() and full() take no lock. Allocation and free map
+ * functions are thread safe, cells themselves are guarded by the caller.
+ *
+ * Runs of contiguous blocks are reserved by allocation policy:
+ *  - SINGLE: one block at a time, lowest free block first
+ *  - FIRST_FIT: lowest run that fits
+ *  - NEXT_FIT: first run that fits after the last reserved run
+ *  - BEST_FIT: smallest run that fits
+ * When no run fits, the largest free run is reserved instead.
+ *
+ * With a CacheModel set, cells are accessed through it as FAT blocks.
  ******************************************************************************/
 class Fat {
 public:
-    Fat(char* address = nullptr, int cells = -1, int cell_offset = -1);
+    enum Policy { SINGLE, FIRST_FIT, NEXT_FIT, BEST_FIT };
+
+    enum { SHARDS = 16 };  // most free map shards
+
+    Fat(char* address = nullptr, long cells = -1, long cell_offset = -1,
+        bool is_wide = false);
+    Fat(Fat&& other);
+    Fat& operator=(Fat&& other);
     ~Fat();
 
     bool create();  // create FAT table on disk
     bool open();    // load existing FAT table in disk
     void remove();  // clear
 
+    // load existing FAT table with a persisted free map, no FAT scan
+    bool open(const char* free_map, std::size_t free_count);
+    void store(char* free_map) const;  // persist free map to address
+
+    static std::size_t map_size(long cells);  // bytes of persisted free map
+
     bool valid() const;     // check if this FAT table is valid
     operator bool() const;  // explicit bool conv
     std::size_t size() const;
     std::size_t full() const;
 
-    // return FatCell to read/write data to
-    FatCell get_cell(int index) const;
+    // return FatCell to read/write data to, dirty if it will be written
+    FatCell get_cell(long index, bool dirty = false) const;
+
+    void set_cache(CacheModel* cache);  // cache of cell blocks, or nullptr
+
+    // FREE BLOCK ALLOCATION
+    // return FatCell::END when no free block is found
+    bool is_free(long block) const;
+    long next_free(long from = 0) const;         // next free block from index
+    long free_run(long n, long from = 0) const;  // start of n free blocks
+    long allocate();                             // take lowest free block
+    void take(long block);                       // mark block as not free
+    void release(long block);                    // mark block as free
 
-    std::set<int>& free_blocks() { return _free; }
+    // take a run of up to n contiguous blocks by policy, or extending from
+    // hint block if it is free; taken is set to number of blocks in run
+    // return first block of run
+    long allocate_run(long n, long& taken, long hint = FatCell::END);
+
+    int policy() const;
+    void set_policy(int policy);
+
+    std::size_t free_extents() const;         // number of free runs
+    std::size_t largest_free_extent() const;  // blocks in largest free run
+
+    std::size_t shards() const;  // number of free map shards
 
 private:
-    char* _file;       // mmap of file
-    int _cells;        // number of cells
-    int _cell_offset;  // starting cell index
-    std::set<int> _free;
+    // free cells of a range of the FAT, indexed from its first cell
+    struct Shard {
+        std::mutex mutex;  // guards free and next_fit
+        Bitmap free;       // free cells of shard
+        long first;        // first cell of shard
+        long next_fit;     // shard cell to start next fit search
+    };
+
+    char* _file;         // mmap of file
+    long _cells;         // number of cells
+    long _cell_offset;   // starting cell index
+    bool _wide;          // wide FatCells
+    int _policy;         // allocation policy for runs
+    CacheModel* _cache;  // cache of cell blocks
+
+    std::unique_ptr<Shard[]> _shards;
+    std::size_t _shard_count;       // shards in use
+    long _shard_cells;              // cells of a shard, whole bitmap words
+    std::atomic<long> _free_count;  // free cells of all shards
+
+    // split cells into shards, all cells not free
+    void _init_shards();
+
+    // shard of a cell and first shard of calling thread
+    Shard& _shard_of(long cell) const;
+    std::size_t _home() const;
+
+    // take up to n free cells from start of shard, return cells taken
+    long _take_run(Shard& shard, long start, long n);
+
+    // find run of n cells in shard by policy, or Bitmap::NPOS
+    long _fit_run(Shard& shard, long n) const;
+
+    // call f(start, length) for each free run of the FAT in cell order,
+    // runs at shard edges merged, with all shards locked
+    void _for_each_run(const std::function<void(long, long)>& f) const;
+
+    // find smallest free run of at least n cells and largest free run in a
+    // bitmap
+    static void _find_runs(const Bitmap& free, std::size_t n, long& best,
+                           long& largest);
 };
 
 /*******************************************************************************
@@ -342,23 +487,101 @@ private:
  * file and directory structures. The FAT table near the begining of a disk.
  *
  * Structure of formatted disk:
- * | META DATA | FAT TABLE | LOGICAL DISK BLOCKS START HERE
+ * | META DATA | FAT TABLE | FREE MAP | JOURNAL | LOGICAL DISK BLOCKS START HERE
  *
  * Meta data
  * ---------
+ * Fields are int, or int64_t on a wide disk.
  * int fat_offset: offset from disk where FAT table starts
  * int _block_offset: disk block index offset to start data blocks
  * int logical_blocks: the number of actual data blocks for in disk
+ * int version: filesystem format version
+ * int free_count: number of free blocks at last unmount
+ * int clean: 1 if disk was cleanly unmounted, 0 while mounted
+ * int free_map_offset: offset from disk where free map starts
+ * int block_size: bytes of a filesystem block, a cluster of disk blocks
+ * int journal_offset: block index where the journal starts
+ * int journal_blocks: blocks of the journal, 0 for none
+ *
+ * Unversioned disks only have the first 3 fields (fat_offset is
+ * LEGACY_META_SZ) and no free map. They are scanned on every open.
+ * Disks before TAIL_VERSION have no valid FileEntry data_tail, so the data
+ * chain is walked to find the last block. Disks before BLOCK_SIZE_VERSION
+ * have no block_size and use a block size of one disk block. Disks before
+ * JOURNAL_VERSION have no journal.
+ *
+ * From ALIGN_VERSION the FAT table, free map and data blocks each start on
+ * a PAGE_SZ boundary, and the data blocks on a multiple of block_size, so
+ * on a page aligned disk each block is aligned to its size. Older layouts
+ * and disks smaller than ALIGN_MIN_SZ pack the regions, offsets are read
+ * from the metadata on open either way.
+ *
+ * Wide disks use int64_t fields, wide FatCells and wide entries for 64-bit
+ * block numbers and sizes. A disk is formatted wide when asked to or when
+ * its size does not fit in an int. Other disks keep the int layout. A wide
+ * disk is detected by the high half of its fat_offset being 0, where a
+ * narrow disk has its non zero block offset.
  *
  * FAT TABLE
  * ---------
  * Fat table start at disk address + fat_offset
- * Size is logical_blocks * FatCell::SIZE
+ * Size is total disk blocks * FatCell::SIZE (or FatCell::WIDE_SIZE)
+ *
+ * FREE MAP
+ * --------
+ * Free map starts at disk address + free_map_offset, a copy of the Fat's free
+ * block bitmap written at unmount. A clean disk loads the free map instead of
+ * scanning the FAT table. A disk that was not cleanly unmounted is scanned.
+ *
+ * JOURNAL
+ * -------
+ * Journal starts at block journal_offset and ends at _block_offset. While
+ * mounted, metadata, the FAT, free map and directory entry blocks, is read
+ * and written in the Journal's shadow of it. Every update logs the byte
+ * ranges it changed before they are copied to their home blocks, so
+ * open_disk() replays updates a crash cut short and the FAT and directories
+ * are consistent again. Home blocks only hold logged bytes, so the journal
+ * holds on every backend and durability mode. Data blocks are not logged.
+ * close_disk() checkpoints and empties the journal. Disks too small for
+ * Journal::MIN_BLOCKS are formatted without one and change metadata in
+ * place.
  *
  * DATA BLOCKS
  * -----------
  * Data blocks start at _block_offset
  *
+ * CONCURRENCY
+ * -----------
+ * One FatFS may be used by many threads at once. Every directory and file
+ * entry has a reader-writer lock in a LockTable, by entry block, taken
+ * top-down in tree order so lock holders never wait on each other in a
+ * cycle:
+ *  - path walks crab down with shared locks, holding a directory until its
+ *    child is locked, and lock the last directory exclusive to change it
+ *  - ".." lets go of the directory before locking its parent, which is then
+ *    checked to still be the same directory
+ *  - file data is read under the file's shared lock and written under its
+ *    exclusive lock, a FileEntry is checked once locked to still be the file
+ *    it was found as, not a file added later in its block
+ *  - deleting a directory locks its whole subtree exclusive first
+ * The Fat allocator is sharded, the cache model, journal and disk lock
+ * themselves, and in-memory caches each have a mutex. Directory sizes are
+ * updated atomically up to root. Mounting, formatting, closing and settings
+ * must not run with other calls. The journal logs only the bytes each
+ * update wrote, never another thread's update in progress, and a freed
+ * block joins the free map only once its update is logged. Reads under a
+ * shared lock do not update last_accessed.
+ *
+ * SESSIONS
+ * --------
+ * Relative paths start at the working directory of a Session, passed to
+ * path calls by each client sharing the filesystem. Calls without a session
+ * use the filesystem's own, whose change_dir() is seen by every such
+ * caller. A session is tied to a mount by a count bumped on every mount,
+ * format and remove, so a block it kept from an earlier mount is never
+ * read as a directory. Its directory is not locked between calls, a path
+ * call checks it is still the directory the session changed into.
+ *
  * NOTE
  * ----
  * One-to-one relationship of FatCell index to Data blocks
@@ -377,14 +600,47 @@ public:
     typedef std::set<DirEntry, bool (*)(const Entry&, const Entry&)> DirSet;
     typedef std::set<FileEntry, bool (*)(const Entry&, const Entry&)> FileSet;
 
-    enum { META_SZ = 3 * sizeof(int) };  // filesystem metadata at start of disk
+    // filesystem metadata fields at start of disk, one int (or int64_t) each
+    enum MetaField {
+        META_FAT_OFFSET,
+        META_BLOCK_OFFSET,
+        META_LOGICAL_BLOCKS,
+        META_VERSION,
+        META_FREE_COUNT,
+        META_CLEAN,
+        META_FREE_MAP_OFFSET,
+        META_BLOCK_SIZE,
+        META_JOURNAL_OFFSET,
+        META_JOURNAL_BLOCKS,
+        META_FIELDS
+    };
+
+    enum {
+        META_SZ = META_FIELDS * sizeof(int),  // filesystem metadata size
+        LEGACY_META_SZ = 3 * sizeof(int),     // unversioned metadata size
+        TAIL_VERSION = 2,                     // first version with data_tail
+        BLOCK_SIZE_VERSION = 3,               // first version with block_size
+        ALIGN_VERSION = 4,                    // first page aligned version
+        JOURNAL_VERSION = 5,                  // first version with journal
+        VERSION = 5,                          // current format version
+        JOURNAL_MAX_SZ = 4 * 1024 * 1024,     // largest journal
+        MIN_BLOCK_SIZE = 512,                 // smallest cluster size
+        MAX_BLOCK_SIZE = 64 * 1024,           // largest block size
+        PAGE_SZ = 4096,                       // region alignment
+        ALIGN_MIN_SZ = 64 * PAGE_SZ,          // smallest page aligned disk
+
+        // wide filesystem metadata size
+        WIDE_META_SZ = META_FIELDS * sizeof(int64_t)
+    };
 
     FatFS(Disk* disk = nullptr);
+    ~FatFS();
 
     // FILE SYSTEM INITIALIZATIONS!!!
     bool set_disk(Disk* disk);  // set disk for file system to use
     bool open_disk();           // open formatted disk, false if not formatted
-    bool format();              // format disk
+    void close_disk();          // persist free map and mark disk clean
+    bool format(bool is_wide = false);  // format disk, wide if is_wide
     bool valid() const;         // check if FatFS instance is valid
     void remove();              // WARNING Will delete disk in system!
 
@@ -395,6 +651,8 @@ public:
     std::string name() const;        // name of the file system
     std::string info() const;        // return string filesystem info
     std::string size_info() const;   // return string only size info
+    std::string frag_info() const;   // return string free space extents
+    std::string cache_info() const;  // return string cache counters
     std::string pwd() const;         // print working directory
     DirEntry current() const;        // return current directory entry
 
@@ -414,7 +672,24 @@ public:
     bool change_dir(std::string path);            // change to path if valid
     FileEntry find_file(std::string path) const;  // find last entry in path
 
-    // read file data into data buffer of size
+    // Path calls of a session, relative paths from its working directory.
+    // The calls above use the filesystem's own session.
+    std::string pwd(const Session& session) const;
+    DirEntry current(const Session& session) const;
+    void print_dirs(const Session& session, std::ostream& outs,
+                    std::string path = ".", bool is_details = false) const;
+    void print_files(const Session& session, std::ostream& outs,
+                     std::string path = ".", bool is_details = false) const;
+    void print_all(const Session& session, std::ostream& outs,
+                   std::string path = ".", bool is_details = false) const;
+    DirEntry add_dir(const Session& session, std::string path);
+    FileEntry add_file(const Session& session, std::string path);
+    bool delete_dir(const Session& session, std::string path);
+    bool delete_file(const Session& session, std::string path);
+    bool change_dir(Session& session, std::string path);
+    FileEntry find_file(const Session& session, std::string path) const;
+
+    // read file data into data buffer of size, up to file's data size
     // returns successful bytes read
     std::size_t read_file_data(FileEntry& file, char* data,
                                std::size_t size) const;
@@ -427,18 +702,188 @@ public:
     std::size_t append_file_data(FileEntry& file, const char* data,
                                  std::size_t size);
 
+    // read file data from offset into data buffer of size
+    // returns successful bytes read
+    std::size_t read_file_at(FileEntry& file, std::size_t offset, char* data,
+                             std::size_t size) const;
+
+    // write data buffer to file entry from offset, extending file if needed
+    // offset can not be past end of file data
+    std::size_t write_file_at(FileEntry& file, std::size_t offset,
+                              const char* data, std::size_t size);
+
     // remove all data blocks for this file entry
     void remove_file_data(FileEntry& file);
 
+    // Data writes of a session, throwing for a READ_ONLY session. The calls
+    // above use the filesystem's own session.
+    std::size_t write_file_data(const Session& session, FileEntry& file,
+                                const char* data, std::size_t size);
+    std::size_t append_file_data(const Session& session, FileEntry& file,
+                                 const char* data, std::size_t size);
+    std::size_t write_file_at(const Session& session, FileEntry& file,
+                              std::size_t offset, const char* data,
+                              std::size_t size);
+    void remove_file_data(const Session& session, FileEntry& file);
+
+    // number of contiguous block runs in file's data chain
+    std::size_t file_extents(FileEntry& file) const;
+
+    std::size_t free_extents() const;         // number of free block runs
+    std::size_t largest_free_extent() const;  // blocks in largest free run
+
+    // dentry cache lookups answered from cache, and walked in directory
+    std::size_t dentry_hits() const;
+    std::size_t dentry_misses() const;
+
+    // Lazy sizes: parent directory size updates go to an in-memory delta
+    // table, folded into directory sizes on size queries, detailed listings,
+    // flush_sizes(), every FOLD_UPDATES updates and close_disk().
+    bool lazy_sizes() const;
+    void set_lazy_sizes(bool is_lazy);
+    void flush_sizes();  // fold pending size deltas into directory sizes
+
+    // Block size is the bytes of a filesystem block, a cluster of disk
+    // blocks. It is set for the next format(), 0 for one disk block, and is
+    // read from disk on open_disk(). A cluster is MIN_BLOCK_SIZE to
+    // MAX_BLOCK_SIZE bytes and a multiple of the disk block size, others
+    // throw.
+    std::size_t block_size() const;
+    void set_block_size(std::size_t size);
+
+    // set allocation policy for data blocks, by Fat::Policy
+    int alloc_policy() const;
+    void set_alloc_policy(int policy);
+
+    // Cache model of FAT, directory entry and data blocks in megabytes, 0
+    // to disable. It holds no data, misses and write backs of dirty blocks
+    // charge simulated disk time, the root directory block stays pinned
+    // while mounted. Dirty blocks are charged on close_disk().
+    std::size_t cache_size() const;
+    void set_cache_size(std::size_t mb);
+    const CacheModel& cache_model() const;
+
+    // metadata journal of mounted disk, disabled if disk has none
+    const Journal& journal() const;
+    std::string journal_info() const;  // return string journal counters
+
+    // entry locks of directories and files in use
+    const LockTable& locks() const;
+
 private:
-    std::string _name;  // name of filesystem
-    Disk* _disk;        // physical disk
-    Fat _fat;           // FAT table
-    DirEntry _root;     // root directory entry
-    DirEntry _current;  // current directory entry
+    std::string _name;     // name of filesystem
+    Disk* _disk;           // physical disk
+    Fat _fat;              // FAT table
+    DirEntry _root;        // root directory entry
+    Session _session;      // session of calls without one
+    unsigned long _mount;  // count of mounts, formats and removes
+
+    mutable LockTable _locks;           // entry locks, by entry block
+    mutable std::mutex _session_mutex;  // guards _session
+
+    long _logical_blocks;  // number of available blocks in disk after format
+    long _block_offset;    // block offset after format
+    int _version;          // format version, 0 if unversioned
+    bool _wide;            // 64-bit metadata, FatCells and entries
+
+    std::size_t _block_size;         // bytes of a block, a disk block cluster
+    std::size_t _format_block_size;  // block size for next format, or 0
+
+    mutable CacheModel _cache;  // modeled resident blocks of mounted disk
+    std::size_t _cache_mb;      // cache model size in megabytes
+    mutable Journal _journal;   // log and shadow of metadata
+
+    // pending directory size deltas, by DirEntry block
+    enum { FOLD_UPDATES = 4096 };
+    bool _lazy_sizes;  // defer parent size updates
+    mutable std::unordered_map<long, std::size_t> _size_deltas;
+    mutable std::size_t _size_updates;  // updates since last fold
+    mutable std::mutex _size_mutex;     // guards size deltas
+
+    // Hash index of a directory's entries, built from the directory's
+    // dir_head and file_head chains on first lookup and kept in step with
+    // them on add and delete. An index is read and changed under its
+    // directory's lock, the map of indices under _index_mutex.
+    struct DirIndex {
+        std::unordered_map<std::string, long> blocks;  // name to entry block
+        std::unordered_map<long, long> prev;  // entry block to previous
+        long dir_tail;                        // last block in dir_head chain
+        long file_tail;                       // last block in file_head chain
+    };
 
-    int _logical_blocks;  // number of available blocks in disk after format
-    int _block_offset;    // block offset after format
+    // cache of data chain block numbers in chain order, by FileEntry block
+    mutable std::unordered_map<long, std::vector<long>> _chains;
+    mutable std::mutex _chain_mutex;  // guards _chains and chain walks
+
+    // directory indices, by DirEntry block
+    mutable std::unordered_map<long, DirIndex> _dir_index;
+    mutable std::mutex _index_mutex;  // guards _dir_index
+
+    // Dentry cache of path components, by parent DirEntry block then name,
+    // to child DirEntry block. FatCell::END is a negative entry for a name
+    // that is not a directory in parent.
+    enum { MAX_DENTRIES = 4096 };
+    mutable std::unordered_map<long, std::unordered_map<std::string, long>>
+        _dentries;
+    mutable std::size_t _dentry_count;   // number of cached dentries
+    mutable std::size_t _dentry_hits;    // lookups found in cache
+    mutable std::size_t _dentry_misses;  // lookups walked in directory
+    mutable std::mutex _dentry_mutex;    // guards dentries and counts
+
+    // Generation of entry blocks, by entry block. A block takes a new
+    // generation when an entry is added or deleted in it, so an entry handed
+    // out before does not match the block's next entry. Blocks not changed
+    // since mount are generation 0.
+    std::unordered_map<long, unsigned long> _generations;
+    unsigned long _last_generation;        // last generation stamped
+    mutable std::mutex _generation_mutex;  // guards generations
+
+    // blocks freed by each thread's update in progress, by thread
+    std::unordered_map<std::thread::id, std::vector<long>> _released;
+    std::mutex _release_mutex;  // guards _released
+
+    // read/write metadata field at start of disk
+    long _meta(int field) const;
+    void _set_meta(int field, long value);
+
+    // start of disk with metadata, FAT and free map loaded, the journal's
+    // shadow image of them if the disk has a journal
+    char* _metadata() const;
+
+    // address of block, a cluster of disk blocks, accessed through the block
+    // cache as class cls, dirty if it will be written
+    char* _data_at(long block, int cls = CacheModel::DATA,
+                   bool dirty = false) const;
+
+    // mark directory entry block as written in cache model
+    void _dirty(long block) const;
+
+    // end of an update: log the FAT and directory ranges written, mark
+    // written blocks dirty in disk and let the disk flush them by its
+    // durability, then free the cells the update released
+    void _commit();
+
+    // attach cache model to the mounted disk and pin the root block
+    void _attach_cache();
+
+    // read size bytes, after skip bytes, of contiguous blocks from block in
+    // one disk access, return bytes read
+    std::size_t _read_run(long block, std::size_t skip, char* data,
+                          std::size_t size) const;
+
+    // number of blocks in disk
+    long _total_blocks() const;
+
+    // bytes rounded up to a multiple of align
+    static std::size_t _align(std::size_t bytes, std::size_t align);
+
+    // entries at disk block, of filesystem's width
+    Entry _entry_at(long block) const;
+    DirEntry _dir_at(long block) const;
+    FileEntry _file_at(long block) const;
+
+    // clear in-memory caches of disk structures
+    void _clear_caches();
 
     // create a root DirEntry at begining of logical blocks
     void _init_root();
@@ -456,9 +901,14 @@ private:
     DirEntry _find_dir_at(DirEntry& dir, std::string name) const;
     FileEntry _find_file_at(DirEntry& dir, std::string name) const;
 
-    // find an entry by name at given directory or return last entry
-    DirEntry _find_dir_orlast_at(DirEntry& dir, std::string name) const;
-    FileEntry _find_file_orlast_at(DirEntry& dir, std::string name) const;
+    // find block of dir or file entry by name or return FatCell::END
+    long _find_block_at(DirEntry& dir, const std::string& name) const;
+
+    // get directory index, build it if not cached
+    DirIndex& _index_of(DirEntry& dir) const;
+
+    // unlink entry block of type from directory's dir or file chain
+    void _unlink_at(DirEntry& dir, long block, bool type);
 
     // delete directory of a specificed name
     bool _delete_dir_at(DirEntry& dir, std::string name);
@@ -471,25 +921,89 @@ private:
     // free all data blocks in file entry
     void _free_data_at(FileEntry& file);
 
-    // mark given FatCell as free and push to free list
-    void _free_cell(FatCell& cell, int cell_index);
+    // free all data blocks after last block, which becomes file's data tail
+    void _truncate_data_at(FileEntry& file, long last_block);
+
+    // link new data blocks after last block, or as file's data head when
+    // last block is FatCell::END, and write data to them
+    // return number of blocks added
+    long _alloc_data_at(FileEntry& file, long last_block, const char* data,
+                        std::size_t size);
+
+    // mark given FatCell as free, the free map takes it at _commit() so no
+    // update reuses the block before its release is logged
+    void _free_cell(FatCell& cell, long cell_index);
 
     // update all parents size, up to root directory
+    // deferred to size delta table when lazy sizes is set
     void _update_parents_size(DirEntry dir, std::size_t size);
 
-    // get last cell from entry
-    FatCell _last_dircell_from(DirEntry& dir) const;
-    FatCell _last_filecell_from(DirEntry& dir) const;
-    FatCell _last_datacell_from(FileEntry& file) const;
-    FatCell _last_cell_from(int cell_offset) const;
-    FatCell _sec_last_cell_from(int cell_offset) const;
+    // fold size delta table into directory sizes, up to root directory,
+    // return true if any size was written
+    bool _fold_sizes() const;
+
+    // fold outside an update and log the sizes written
+    void _flush_sizes() const;
+
+    // recompute directory sizes from entries, return size of dir
+    std::size_t _rebuild_sizes_at(DirEntry& dir);
+
+    // get last block index in a chain of cells
+    long _last_block_from(long start_cell) const;
+
+    // get last data block of file, from data_tail if disk version has it
+    long _last_datablock_from(FileEntry& file) const;
+
+    // copy blocks first to last of file's data chain into blocks, from the
+    // cached chain walked from FAT up to last
+    void _chain_of(FileEntry& file, std::size_t first, std::size_t last,
+                   std::vector<long>& blocks) const;
 
     // tokenize a path string and return a list of name entries
     void _tokenize_path(std::string path,
                         std::list<std::string>& entries) const;
 
-    // parse a path of string named entries; return a valid DirEntry if found
-    DirEntry _parse_dir_entries(std::list<std::string>& entries) const;
+    // parse a path of string named entries from session's directory; return
+    // a valid DirEntry if found with lock holding it in mode, else an
+    // invalid one and no lock
+    DirEntry _parse_dir_entries(const Session& session,
+                                std::list<std::string>& entries,
+                                LockTable::Guard& lock,
+                                int mode = LockTable::SHARED) const;
+
+    // directory of session with the generation it was found at, root if
+    // session is of another mount
+    DirEntry _cwd_of(const Session& session) const;
+
+    // path of directory, walked up to root
+    std::string _path_of(DirEntry dir) const;
+
+    // copy of filesystem's own session
+    Session _own_session() const;
+
+    // lock entry at block in mode
+    LockTable::Guard _lock(long block, int mode) const;
+
+    // lock file in mode, no lock if file was deleted since it was found,
+    // even if its block holds a new file
+    LockTable::Guard _lock_file(FileEntry& file, int mode) const;
+
+    // entry at block is allocated and of type
+    bool _live(long block, bool type) const;
+
+    // give entry block a new generation, read generation of entry block
+    void _stamp(long block);
+    unsigned long _generation_of(long block) const;
+
+    // lock directory at block and all entries under it exclusive
+    void _lock_subtree(long block, std::vector<LockTable::Guard>& locks) const;
+
+    // find directory by name at given directory through dentry cache
+    DirEntry _lookup_dir_at(DirEntry& dir, const std::string& name) const;
+
+    // drop dentry of name in parent, or all dentries in parent
+    void _forget_dentry(long parent, const std::string& name) const;
+    void _forget_dentries(long parent) const;
 
     // find max name length and size length
     void _find_entries_len_details(EntrySet& entries_set, std::size_t& name_len,
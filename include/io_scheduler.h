@@ -0,0 +1,84 @@
+#ifndef IO_SCHEDULER_H
+#define IO_SCHEDULER_H
+
+#include <condition_variable>  // std::condition_variable
+#include <future>              // std::future, std::promise
+#include <list>                // std::list
+#include <mutex>               // std::mutex
+#include <string>              // std::string
+#include <thread>              // std::thread
+#include "disk.h"              // Disk class
+
+namespace fs {
+
+/*******************************************************************************
+ * Request queue in front of a Disk. Callers submit reads and writes by
+ * cylinder and sector and get a future of the result. A dispatcher thread
+ * takes pending requests one at a time, in the order of the policy:
+ *  - FCFS: arrival order
+ *  - SSTF: shortest seek from the head first
+ *  - SCAN: elevator, nearest in the head's direction, reversing at the last
+ *          pending request as the head only moves to serve a request
+ *  - CLOOK: nearest at or above the head, wrapping to the lowest cylinder
+ * Ties on a cylinder go in arrival order. SSTF may starve far requests.
+ *
+ * Futures hold the same results as Disk::read_at and Disk::write_at. Pending
+ * requests are served before the scheduler is destroyed.
+ ******************************************************************************/
+class IOScheduler {
+public:
+    enum Policy { FCFS, SSTF, SCAN, CLOOK };
+
+    IOScheduler(Disk* disk, int policy = CLOOK);
+    ~IOScheduler();
+
+    IOScheduler(const IOScheduler&) = delete;
+    IOScheduler& operator=(const IOScheduler&) = delete;
+
+    // queue a read or write at cylinder and sector index
+    std::future<std::string> read(std::size_t cyl, std::size_t sec);
+    std::future<bool> write(std::size_t cyl, std::size_t sec,
+                            const std::string& data);
+
+    int policy() const;
+    void set_policy(int p);       // order of requests after this call
+    std::size_t pending() const;  // requests waiting to dispatch
+    std::size_t served() const;   // requests dispatched
+    void drain();                 // wait until all requests are served
+
+    static const char* policy_name(int p);
+
+private:
+    enum Op { READ, WRITE };
+
+    struct Request {
+        int op;
+        std::size_t cyl;
+        std::size_t sec;
+        std::string data;                // bytes to write
+        std::promise<std::string> read;  // result of a read
+        std::promise<bool> write;        // result of a write
+    };
+
+    Disk* _disk;
+    int _policy;
+    bool _up;       // SCAN head direction, toward higher cylinders
+    bool _busy;     // dispatcher is serving a request
+    bool _stop;     // dispatcher exits once queue is empty
+    std::size_t _served;
+    std::list<Request> _queue;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _queued;  // request added or stopping
+    std::condition_variable _idle;    // request served
+    std::thread _dispatcher;
+
+    void _dispatch();  // dispatcher thread loop
+
+    // next request by policy from head cylinder, queue is not empty
+    std::list<Request>::iterator _next(std::size_t head);
+};
+
+}  // namespace fs
+
+#endif  // IO_SCHEDULER_H
@@ -0,0 +1,168 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <algorithm>           // sort(), min(), max()
+#include <atomic>              // std::atomic
+#include <condition_variable>  // std::condition_variable
+#include <cstdint>             // uint64_t
+#include <cstring>             // memcpy()
+#include <map>                 // std::map
+#include <memory>              // std::unique_ptr
+#include <mutex>               // std::mutex
+#include <string>              // std::string
+#include <unordered_map>       // std::unordered_map
+#include <utility>             // std::pair
+#include <vector>              // std::vector
+#include "disk.h"              // Disk class
+
+namespace fs {
+
+/*******************************************************************************
+ * Redo journal of filesystem metadata, kept in a region of blocks of the
+ * disk. Blocks are numbered from the start of the disk, a cluster of disk
+ * blocks each.
+ *
+ * The journal keeps a shadow of the metadata: image() holds every block
+ * before the journal region (header, FAT and free map) and stage() holds a
+ * copy of each directory block, read from home when first staged. The
+ * filesystem changes metadata only in the shadow and reports each byte range
+ * it writes with record(). Home blocks in the Disk only ever get bytes that
+ * were logged, so a backend writing them back at any time (an MMAP mapping,
+ * a PERIODIC flusher or a DIRECT flush of a whole page) never makes an
+ * unlogged update durable.
+ *
+ * A commit logs the ranges the calling thread recorded since its last
+ * commit, not whole blocks, so a block shared with another thread's update
+ * in progress is logged without that update. Once the log is durable with a
+ * ranged Disk flush, the ranges are copied home and marked dirty for the
+ * Disk to write by its durability. Commits from concurrent callers join an
+ * open batch: one caller writes the whole batch and flushes once while the
+ * others wait, so the flush is shared by the batch.
+ *
+ * Journal layout:
+ * | superblock | record | data... | record | data... | ...
+ * The superblock holds the magic and the sequence of the first record. Each
+ * record block holds its sequence, number of ranges, a last flag, a checksum
+ * and the home block and offset << 32 | length of each range. The bytes of
+ * its ranges follow it packed into whole blocks. A batch too large for one
+ * record spans several, the last one flagged. Records are appended until
+ * the journal is full, then a checkpoint flushes all home blocks and starts
+ * the journal over with the next sequence.
+ *
+ * replay() applies every batch whose records are complete and valid, in
+ * sequence order, and stops at the first that is not. Applying a batch twice
+ * gives the same blocks, so a replay interrupted by a crash is replayed
+ * again on the next open.
+ ******************************************************************************/
+class Journal {
+public:
+    enum {
+        HEADER_FIELDS = 5,  // magic, sequence, ranges, last, checksum
+        RANGE_FIELDS = 2,   // home block, offset << 32 | length
+        MIN_BLOCKS = 8      // smallest journal region
+    };
+
+    static const uint64_t MAGIC = 0x4c4e524a54414646;         // "FFATJRNL"
+    static const uint64_t RECORD_MAGIC = 0x474e524a54414646;  // "FFATJRNG"
+
+    Journal();
+
+    // journal blocks from start of disk, in blocks of block_size bytes
+    void attach(Disk* disk, std::size_t block_size, long start,
+                std::size_t blocks);
+    void detach();
+
+    bool enabled() const;
+    long start() const;          // first block of journal region
+    std::size_t blocks() const;  // blocks of journal region
+
+    // write an empty journal, or replay and return batches applied, then
+    // read the shadow image from home
+    void format();
+    std::size_t replay();
+
+    // shadow of blocks before the journal, and of a directory block
+    char* image();
+    char* stage(long block);
+
+    // record len bytes written at address by the calling thread, ranges
+    // outside a shadow are dropped by its commit
+    static void record(const void* address, std::size_t len);
+
+    void commit();  // log and copy home the calling thread's ranges
+
+    // copy image home, flush home blocks and empty journal, with no update
+    // in progress
+    void checkpoint();
+
+    std::size_t commits() const;      // commits logged
+    std::size_t batches() const;      // batches written, one flush each
+    std::size_t logged() const;       // ranges written
+    std::size_t checkpoints() const;  // times the journal was emptied
+    std::size_t replayed() const;     // batches applied by replay
+    std::string info() const;
+
+private:
+    // bytes of a home block, stored at byte at of a batch's data
+    struct Range {
+        long block;
+        std::size_t offset;
+        std::size_t len;
+        std::size_t at;
+    };
+
+    struct Batch {
+        std::vector<Range> ranges;
+        std::vector<char> data;
+    };
+
+    Disk* _disk;
+    std::size_t _block_size;   // bytes of a block
+    std::size_t _disk_blocks;  // disk blocks of a block
+    long _start;               // first block of journal region
+    std::size_t _blocks;       // blocks of journal region
+    std::size_t _head;         // next journal block to write
+    uint64_t _sequence;        // sequence of next record
+
+    std::vector<char> _image;  // shadow of blocks before the journal
+    std::unordered_map<long, std::unique_ptr<char[]>> _staged;
+    std::map<const char*, long> _staged_at;  // staged block by address
+    mutable std::mutex _stage_mutex;         // guards staged blocks
+
+    Batch _pending;           // ranges of open batch
+    std::size_t _open_batch;  // batch taking commits
+    std::size_t _done_batch;  // last batch written
+    bool _writing;            // a caller writes a batch
+
+    std::size_t _commits;
+    std::size_t _batches;
+    std::size_t _logged;
+    std::size_t _checkpoints;
+    std::size_t _replayed;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _written;  // batch written or writer done
+
+    // ranges recorded by each thread since its commit
+    static thread_local std::vector<std::pair<const char*, std::size_t>>
+        _records;
+    static std::atomic<int> _shadows;  // journals holding a shadow
+
+    // copy the shadow bytes of recorded ranges to the pending batch
+    void _capture(std::vector<std::pair<const char*, std::size_t>>& records);
+
+    // log batch and copy its ranges home, caller is the only writer
+    void _write(const Batch& batch);
+    void _home(const Batch& batch);  // copy ranges home and mark dirty
+    void _load_image();              // read image from home
+    void _reset();  // empty journal, home blocks must be durable
+    void _flush(std::size_t block, std::size_t count);  // journal blocks
+
+    std::size_t _per_record() const;  // ranges a record block can list
+    static uint64_t _checksum(uint64_t hash, const char* data,
+                              std::size_t len);
+};
+
+}  // namespace fs
+
+#endif  // JOURNAL_H
@@ -0,0 +1,70 @@
+#ifndef LOCK_TABLE_H
+#define LOCK_TABLE_H
+
+#include <mutex>          // std::mutex
+#include <shared_mutex>   // std::shared_mutex
+#include <unordered_map>  // std::unordered_map
+
+namespace fs {
+
+/*******************************************************************************
+ * Table of reader-writer locks by key, a FatFS entry block. A lock exists
+ * only while it is held or waited on, so a filesystem with millions of
+ * entries keeps a lock per entry in use and not per entry on disk.
+ *
+ * Each key has its own lock, keys never share one, so holders of different
+ * keys never wait on each other and lock order is up to the caller alone.
+ * FatFS locks entries top-down in tree order: a directory before its
+ * subdirectories and files.
+ *
+ * A Guard holds one lock and releases it when destroyed or unlocked.
+ * Locks that had to wait for another holder are counted.
+ ******************************************************************************/
+class LockTable {
+public:
+    enum Mode { SHARED, EXCLUSIVE };
+
+    // lock of key in mode, held until unlock() or destruction
+    class Guard {
+    public:
+        Guard();
+        Guard(LockTable* table, long key, int mode);
+        Guard(Guard&& other);
+        Guard& operator=(Guard&& other);
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+        ~Guard();
+
+        bool owns() const;
+        long key() const;
+        int mode() const;
+        void unlock();
+
+    private:
+        LockTable* _table;  // nullptr when nothing is held
+        long _key;
+        int _mode;
+    };
+
+    LockTable();
+
+    void lock(long key, int mode);
+    void unlock(long key, int mode);
+
+    std::size_t size() const;       // keys held or waited on
+    std::size_t contended() const;  // locks that waited for a holder
+
+private:
+    struct Node {
+        std::shared_mutex lock;
+        std::size_t refs;  // holders and waiters, node freed at 0
+    };
+
+    std::unordered_map<long, Node> _nodes;
+    std::size_t _contended;
+    mutable std::mutex _mutex;  // guards _nodes, refs and _contended
+};
+
+}  // namespace fs
+
+#endif  // LOCK_TABLE_H
@@ -0,0 +1,71 @@
+#ifndef MOUNT_H
+#define MOUNT_H
+
+#include <memory>         // std::unique_ptr
+#include <mutex>          // std::mutex
+#include <shared_mutex>   // std::shared_mutex
+#include <stdexcept>      // std::exception
+#include <string>         // std::string
+#include <unordered_map>  // std::unordered_map
+#include "disk.h"         // Disk class
+#include "fat.h"          // FatFS class
+
+namespace fs {
+
+// Disk and filesystem of a mounted image, shared by every connection to it
+struct Mount {
+    Mount(std::string name, int cylinders, int sectors);
+
+    std::string name;         // image name, without .disk
+    Disk disk;                // declared first so it outlives fatfs
+    FatFS fatfs;              // filesystem of disk, invalid until formatted
+    std::shared_mutex mutex;  // shared to use fatfs, exclusive to change it
+    std::size_t refs;         // connections holding the mount
+    bool is_opened;           // open of an existing image was tried
+    std::string error;        // why the existing image did not open
+};
+
+/*******************************************************************************
+ * Process-wide table of mounted disk images, one Mount per image name.
+ *
+ * acquire() returns the Mount of an image and counts a reference. The first
+ * acquire builds the Disk with the table's options and opens the image and
+ * its FatFS if the file exists, later ones only count, so connecting does not
+ * map the file or scan the FAT again. release() drops a reference and the
+ * last one closes the filesystem, persisting its free map, and frees the
+ * Mount.
+ *
+ * FatFS locks its own entries, so connections hold the Mount's mutex shared
+ * while using fatfs and run at once, each with its own Session for its
+ * working directory. Formatting, removing or mounting the filesystem holds
+ * it exclusive.
+ ******************************************************************************/
+class MountTable {
+public:
+    // disk and filesystem settings of a new Mount
+    struct Options {
+        int cylinders;
+        int sectors;
+        std::size_t track_time;  // microseconds per cylinder
+        std::size_t cache_mb;    // cache model megabytes, 0 disabled
+        int backend;             // Disk::Backend
+        int durability;          // Disk::Durability
+    };
+
+    MountTable(const Options& options);
+    ~MountTable();
+
+    Mount* acquire(const std::string& name);  // mount of image, counted
+    void release(Mount* mount);               // unmount after last release
+
+    std::size_t size() const;  // mounted images
+
+private:
+    Options _options;
+    std::unordered_map<std::string, std::unique_ptr<Mount>> _mounts;
+    mutable std::mutex _mutex;  // guards _mounts and refs
+};
+
+}  // namespace fs
+
+#endif  // MOUNT_H
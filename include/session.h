@@ -0,0 +1,57 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <string>  // std::string
+
+namespace fs {
+
+/*******************************************************************************
+ * Working directory and access of one client of a FatFS. Path-taking FatFS
+ * calls resolve relative paths from the session's directory, so any number
+ * of clients share one mounted filesystem and its caches, each in its own
+ * directory, without changing the filesystem.
+ *
+ * A session keeps the block of its directory and its path, cached on
+ * change_dir() so pwd() reads no blocks. It holds no lock on the directory.
+ * It belongs to the mount it changed directory in: after the filesystem is
+ * formatted, removed or mounted again the session is back at root. A
+ * directory deleted under a session fails its relative paths until it
+ * changes directory, even once its block holds a new directory, by the
+ * generation of the block kept with it.
+ *
+ * Access is the session's permission on the filesystem: a READ_ONLY session
+ * can find, list, read and change directory, but not add or delete entries
+ * or write file data.
+ *
+ * FatFS updates a session only in change_dir(), so a session used by one
+ * thread at a time needs no lock.
+ ******************************************************************************/
+class Session {
+public:
+    enum Access { READ_WRITE, READ_ONLY };
+
+    Session(int access = READ_WRITE);
+
+    long cwd() const;                 // directory block, -1 for root
+    const std::string& path() const;  // cached path of directory
+    unsigned long mount() const;      // mount of directory block
+
+    int access() const;
+    void set_access(int access);
+    bool read_only() const;
+
+    void reset();  // back to root
+
+private:
+    friend class FatFS;
+
+    long _cwd;                  // DirEntry block, -1 for root
+    std::string _path;          // path of _cwd
+    unsigned long _mount;       // FatFS mount _cwd was found in
+    unsigned long _generation;  // generation of _cwd block when found
+    int _access;                // Access
+};
+
+}  // namespace fs
+
+#endif  // SESSION_H
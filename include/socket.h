@@ -6,6 +6,7 @@
 #include <sys/socket.h>  // socket()
 #include <unistd.h>      // close()
 
+#include <algorithm>  // std::min()
 #include <cstring>    // memset
 #include <stdexcept>  // std::exception
 #include <string>     // std::string
@@ -1,13 +1,22 @@
-#include <pthread.h>            // POSIX threads
-#include <iostream>             // std::stream
-#include "../include/disk.h"    // Disk class
-#include "../include/parser.h"  // Parser, get cli tokens with grammar
-#include "../include/socket.h"  // Socket class
+#include <pthread.h>                  // POSIX threads
+#include <iostream>                   // std::stream
+#include <shared_mutex>               // std::shared_mutex
+#include "../include/disk.h"          // Disk class
+#include "../include/io_scheduler.h"  // IOScheduler class
+#include "../include/parser.h"        // Parser, get cli tokens with grammar
+#include "../include/socket.h"        // Socket class
 
 // GLOBALS
-int TRACK_TIME = 10;  // in microseconds
-int CYLINDERS = 5;    // default cylinders
-int SECTORS = 10;     // default sectors per cylinders
+int TRACK_TIME = 10;                   // in microseconds
+int CYLINDERS = 5;                     // default cylinders
+int SECTORS = 10;                      // default sectors per cylinders
+int POLICY = fs::IOScheduler::CLOOK;   // order of disk requests
+bool VIRTUAL_CLOCK = false;            // simulate access time, no sleep
+int BACKEND = fs::Disk::MMAP;          // disk file access
+int DURABILITY = fs::Disk::NONE;       // flushes of written blocks
+fs::Disk *DISK = nullptr;              // disk shared by all clients
+fs::IOScheduler *SCHEDULER = nullptr;  // request queue of DISK
+std::shared_mutex DISK_LOCK;           // unique to create/delete DISK
 
 void *connection_handler(void *socketfd);
 
@@ -22,11 +31,37 @@ int main(int argc, char *argv[]) {
     if(argc > 2) TRACK_TIME = atoi(argv[2]);
     if(argc > 3) CYLINDERS = atoi(argv[3]);
     if(argc > 4) SECTORS = atoi(argv[4]);
+    if(argc > 5) POLICY = atoi(argv[5]);
+    if(argc > 6) VIRTUAL_CLOCK = atoi(argv[6]);
+    if(argc > 7) BACKEND = atoi(argv[7]);
+    if(argc > 8) DURABILITY = atoi(argv[8]);
+
+    // create disk with default settings, clients queue requests to it
+    fs::Disk disk("client-disk", CYLINDERS, SECTORS);
+    disk.set_track_time(TRACK_TIME);
+    disk.set_virtual_clock(VIRTUAL_CLOCK);
+
+    try {
+        disk.set_backend(BACKEND);
+        disk.set_durability(DURABILITY);
+        disk.open(disk.name());
+    } catch(const std::exception &e) {
+        std::cerr << "ERROR Initializating existing disk: " << e.what()
+                  << std::endl;
+    }
+
+    fs::IOScheduler scheduler(&disk, POLICY);
+    DISK = &disk;
+    SCHEDULER = &scheduler;
 
     try {
         server.set_port(port);
         server.start();
-        std::cout << "Server started on port " << port << std::endl;
+        std::cout << "Server started on port " << port << " with "
+                  << fs::IOScheduler::policy_name(POLICY) << " scheduling, "
+                  << fs::Disk::backend_name(disk.backend()) << " backend, "
+                  << fs::Disk::durability_name(disk.durability())
+                  << " durability" << std::endl;
 
         // set pthread attributes to detach
         pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
@@ -64,11 +99,7 @@ void *connection_handler(void *socketfd) {
     std::string client_msg;
     Parser parser;
     std::vector<std::string> tokens;
-    std::string diskname = "client-disk";
-
-    // create disk with default settings
-    fs::Disk disk(diskname, CYLINDERS, SECTORS);
-    disk.set_track_time(TRACK_TIME);
+    fs::Disk &disk = *DISK;
 
     // static messages
     std::string welcome =
@@ -78,6 +109,7 @@ void *connection_handler(void *socketfd) {
         "[D]elete - Delete current disk\n"
         "[I]nfo - Get disk geometry information\n"
         "[R]ead - Read from disk. 'R [CYL] [SEC]'\n"
+        "[T]iming - Get simulated disk access time totals\n"
         "[W]rite - Write to disk. 'W [CYL] [SEC] [DATA]'\n\n";
     std::string need_create =
         "Please initialize disk with CREATE command: 'C [CYL] [SEC]'";
@@ -86,15 +118,14 @@ void *connection_handler(void *socketfd) {
 
     std::cout << "Serving client" << std::endl;
 
-    // try to open disk if disk file exists
-    try {
-        if(disk.open(diskname))
+    // use disk if disk file exists
+    {
+        std::shared_lock<std::shared_mutex> lock(DISK_LOCK);
+
+        if(disk.valid())
             welcome += "Disk exists in system. Using existing disk\n";
         else
             welcome += need_create;
-    } catch(const std::exception &e) {
-        welcome +=
-            "ERROR Initializating existing disk: " + std::string(e.what());
     }
 
     try {
@@ -127,6 +158,8 @@ void *connection_handler(void *socketfd) {
                         sock::send_msg(sockfd,
                                        "ERROR Insufficient arguments for C.");
                     else {
+                        std::unique_lock<std::shared_mutex> lock(DISK_LOCK);
+
                         try {
                             if(!disk.valid()) {
                                 int cyl = std::stoi(tokens[1]);
@@ -151,6 +184,8 @@ void *connection_handler(void *socketfd) {
                 }
                 // Remove disk
                 else if(tokens[0] == "D") {
+                    std::unique_lock<std::shared_mutex> lock(DISK_LOCK);
+
                     if(disk.remove())
                         sock::send_msg(sockfd, "1");
                     else
@@ -158,22 +193,38 @@ void *connection_handler(void *socketfd) {
                 }
                 // Get geometry information
                 else if(tokens[0] == "I") {
+                    std::shared_lock<std::shared_mutex> lock(DISK_LOCK);
+
                     if(disk.valid())
                         sock::send_msg(sockfd, disk.geometry());
                     else
                         sock::send_msg(sockfd, "0 0\n" + need_create);
                 }
+                // Get simulated access time totals
+                else if(tokens[0] == "T") {
+                    std::shared_lock<std::shared_mutex> lock(DISK_LOCK);
+
+                    if(disk.valid())
+                        sock::send_msg(sockfd, disk.timing_info() + '\n' +
+                                                   disk.writeback_info());
+                    else
+                        sock::send_msg(sockfd,
+                                       "ERROR No disk.\n" + need_create);
+                }
                 // Read disk
                 else if(tokens[0] == "R") {
                     if(tokens.size() < 3)
                         sock::send_msg(sockfd,
                                        "ERROR Insufficient arguments for R");
                     else {
+                        std::shared_lock<std::shared_mutex> lock(DISK_LOCK);
+
                         if(disk.valid()) {
                             int cyl = std::stoi(tokens[1]);
                             int sec = std::stoi(tokens[2]);
 
-                            std::string data = disk.read_at(cyl, sec);
+                            std::string data =
+                                SCHEDULER->read(cyl, sec).get();
                             sock::send_msg(sockfd, data);
 
                         } else
@@ -187,13 +238,16 @@ void *connection_handler(void *socketfd) {
                         sock::send_msg(sockfd,
                                        "ERROR Insufficient arguments for W");
                     else {
+                        std::shared_lock<std::shared_mutex> lock(DISK_LOCK);
+
                         if(disk.valid()) {
                             bool success = false;
                             int cyl = std::stoi(tokens[1]);
                             int sec = std::stoi(tokens[2]);
 
-                            success = disk.write_at(tokens[3].c_str(), cyl, sec,
-                                                    tokens[3].size());
+                            success =
+                                SCHEDULER->write(cyl, sec, tokens[3]).get();
+                            if(success) disk.commit();
 
                             if(success)
                                 sock::send_msg(sockfd, "1");
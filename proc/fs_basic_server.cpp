@@ -2,13 +2,18 @@
 #include <iostream>             // std::stream
 #include "../include/disk.h"    // Disk class
 #include "../include/fat.h"     // Disk class
+#include "../include/mount.h"   // MountTable class
 #include "../include/parser.h"  // Parser, get cli tokens with grammar
 #include "../include/socket.h"  // Socket class
 
 // GLOBALS
-int TRACK_TIME = 10;  // in microseconds
-int CYLINDERS = 5;    // default cylinders
-int SECTORS = 10;     // default sectors per cylinders
+int TRACK_TIME = 10;               // in microseconds
+int CYLINDERS = 5;                 // default cylinders
+int SECTORS = 10;                  // default sectors per cylinders
+int CACHE_MB = 0;                  // cache model megabytes, 0 disabled
+int BACKEND = fs::Disk::MMAP;      // disk file access
+int DURABILITY = fs::Disk::NONE;   // flushes of written blocks
+fs::MountTable *MOUNTS = nullptr;  // images shared by connections
 
 void *connection_handler(void *socketfd);
 
@@ -23,8 +28,20 @@ int main(int argc, char *argv[]) {
     if(argc > 2) TRACK_TIME = atoi(argv[2]);
     if(argc > 3) CYLINDERS = atoi(argv[3]);
     if(argc > 4) SECTORS = atoi(argv[4]);
+    if(argc > 5) CACHE_MB = atoi(argv[5]);
+    if(argc > 6) BACKEND = atoi(argv[6]);
+    if(argc > 7) DURABILITY = atoi(argv[7]);
 
     try {
+        if(BACKEND < fs::Disk::MMAP || BACKEND > fs::Disk::DIRECT)
+            throw std::out_of_range("ERROR Invalid backend");
+        if(DURABILITY < fs::Disk::NONE || DURABILITY > fs::Disk::SYNC)
+            throw std::out_of_range("ERROR Invalid durability");
+
+        fs::MountTable mounts({CYLINDERS, SECTORS, std::size_t(TRACK_TIME),
+                               std::size_t(CACHE_MB), BACKEND, DURABILITY});
+        MOUNTS = &mounts;
+
         server.set_port(port);
         server.start();
         std::cout << "Server started on port " << port << std::endl;
@@ -67,10 +84,10 @@ void *connection_handler(void *socketfd) {
     std::vector<std::string> tokens;
     std::string diskname = "client-fs-basic";
 
-    // create disk with default settings
-    fs::FatFS fatfs;
-    fs::Disk disk(diskname, CYLINDERS, SECTORS);
-    disk.set_track_time(TRACK_TIME);
+    // disk and filesystem are shared with every connection to the image
+    fs::Mount *mount = MOUNTS->acquire(diskname);
+    fs::Disk &disk = mount->disk;
+    fs::FatFS &fatfs = mount->fatfs;
 
     // static messages
     std::string welcome =
@@ -90,18 +107,18 @@ void *connection_handler(void *socketfd) {
 
     std::cout << "Serving client" << std::endl;
 
-    // try to open disk if disk file exists
-    try {
-        if(disk.open(diskname)) {
-            fatfs.set_disk(&disk);
-            fatfs.open_disk();
+    // existing disk file was opened by the first connection to it
+    {
+        std::shared_lock<std::shared_mutex> lock(mount->mutex);
+
+        if(fatfs.valid())
             welcome +=
                 "Filessytem exists in server. Using existing file system\n";
-        } else
+        else if(mount->error.size())
+            welcome += "ERROR Initializating existing disk/filesystem: " +
+                       mount->error;
+        else
             welcome += need_create;
-    } catch(const std::exception &e) {
-        welcome += "ERROR Initializating existing disk/filesystem: " +
-                   std::string(e.what());
     }
 
     try {
@@ -121,6 +138,19 @@ void *connection_handler(void *socketfd) {
                     continue;
                 }
 
+                // format and remove change the filesystem under every
+                // connection, other commands run at once under its entry
+                // locks, always in its root directory
+                std::shared_lock<std::shared_mutex> shared(mount->mutex,
+                                                           std::defer_lock);
+                std::unique_lock<std::shared_mutex> exclusive(mount->mutex,
+                                                              std::defer_lock);
+
+                if(tokens[0] == "F" || tokens[0] == "U")
+                    exclusive.lock();
+                else
+                    shared.lock();
+
                 // Exit
                 if(tokens[0] == "exit") {
                     std::cout << "Client requested exit" << std::endl;
@@ -202,15 +232,15 @@ void *connection_handler(void *socketfd) {
                             if(!file)
                                 sock::send_msg(sockfd, "1 No file exists");
                             else {
-                                int bytes = 0;
+                                std::size_t bytes = 0;
                                 char *data = new char[file.data_size() + 1];
-                                bytes = fatfs.read_file_data(file, data,
-                                                             file.size());
-                                data[bytes] = '\0';
+                                bytes = fatfs.read_file_data(
+                                    file, data, file.data_size());
 
-                                sock::send_msg(
-                                    sockfd,
-                                    "0 " + std::to_string(bytes) + " " + data);
+                                sock::send_msg(sockfd,
+                                               "0 " + std::to_string(bytes) +
+                                                   " " +
+                                                   std::string(data, bytes));
 
                                 delete[] data;
                             }
@@ -254,6 +284,9 @@ void *connection_handler(void *socketfd) {
         std::cout << "Client error. " << e.what() << std::endl;
     }
 
+    // last connection to the image unmounts it
+    MOUNTS->release(mount);
+
     close(sockfd);
 
     return 0;
@@ -4,15 +4,21 @@
 #include <iostream>  // std::stream
 #include <sstream>   // ostringstream
 
-#include "../include/disk.h"    // Disk class
-#include "../include/fat.h"     // Disk class
-#include "../include/parser.h"  // Parser, get cli tokens with grammar
-#include "../include/socket.h"  // socket Server class
+#include "../include/disk.h"     // Disk class
+#include "../include/fat.h"      // Disk class
+#include "../include/mount.h"    // MountTable class
+#include "../include/parser.h"   // Parser, get cli tokens with grammar
+#include "../include/session.h"  // Session class
+#include "../include/socket.h"   // socket Server class
 
 // GLOBALS
-int TRACK_TIME = 10;  // in microseconds
-int CYLINDERS = 5;    // default cylinders
-int SECTORS = 10;     // default sectors per cylinders
+int TRACK_TIME = 10;               // in microseconds
+int CYLINDERS = 5;                 // default cylinders
+int SECTORS = 10;                  // default sectors per cylinders
+int CACHE_MB = 0;                  // cache model megabytes, 0 disabled
+int BACKEND = fs::Disk::MMAP;      // disk file access
+int DURABILITY = fs::Disk::NONE;   // flushes of written blocks
+fs::MountTable *MOUNTS = nullptr;  // images shared by connections
 
 // Structure for connection handler argument
 struct connection_info {
@@ -34,34 +40,43 @@ void mkfs(int sockfd, std::vector<std::string> &tokens, fs::Disk &disk,
 void rmfs(int sockfd, fs::FatFS &fatfs);
 
 // make a directory
-void mkdir(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs);
+void mkdir(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+           fs::Session &session);
 
 // remove a directory
-void rmdir(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs);
+void rmdir(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+           fs::Session &session);
 
 // make a file
-void mk(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs);
+void mk(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+        fs::Session &session);
 
 // remove a file
-void rm(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs);
+void rm(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+        fs::Session &session);
 
 // read data from file
-void read(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs);
+void read(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+          fs::Session &session);
 
 // write data to file
-void write(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs);
+void write(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+           fs::Session &session);
 
 // append data to file
-void append(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs);
+void append(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+            fs::Session &session);
 
 // change to path
-void cd(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs);
+void cd(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+        fs::Session &session);
 
 // list path contents
-void ls(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs);
+void ls(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+        fs::Session &session);
 
 // print working directory
-void pwd(int sockfd, fs::FatFS &fatfs);
+void pwd(int sockfd, fs::FatFS &fatfs, fs::Session &session);
 
 }  // namespace fs
 
@@ -77,8 +92,20 @@ int main(int argc, char *argv[]) {
     if(argc > 2) TRACK_TIME = atoi(argv[2]);
     if(argc > 3) CYLINDERS = atoi(argv[3]);
     if(argc > 4) SECTORS = atoi(argv[4]);
+    if(argc > 5) CACHE_MB = atoi(argv[5]);
+    if(argc > 6) BACKEND = atoi(argv[6]);
+    if(argc > 7) DURABILITY = atoi(argv[7]);
 
     try {
+        if(BACKEND < fs::Disk::MMAP || BACKEND > fs::Disk::DIRECT)
+            throw std::out_of_range("ERROR Invalid backend");
+        if(DURABILITY < fs::Disk::NONE || DURABILITY > fs::Disk::SYNC)
+            throw std::out_of_range("ERROR Invalid durability");
+
+        fs::MountTable mounts({CYLINDERS, SECTORS, std::size_t(TRACK_TIME),
+                               std::size_t(CACHE_MB), BACKEND, DURABILITY});
+        MOUNTS = &mounts;
+
         server.set_port(port);
         server.start();
         std::cout << "Server started on port " << port << std::endl;
@@ -139,11 +166,12 @@ void *connection_handler(void *con_info) {
     Parser parser;
     std::vector<std::string> tokens;
     std::string diskname = "client-fs-full";
+    fs::Session session;  // working directory of this connection
 
-    // create disk with default settings
-    fs::FatFS fatfs;
-    fs::Disk disk(diskname, CYLINDERS, SECTORS);
-    disk.set_track_time(TRACK_TIME);
+    // disk and filesystem are shared with every connection to the image
+    fs::Mount *mount = MOUNTS->acquire(diskname);
+    fs::Disk &disk = mount->disk;
+    fs::FatFS &fatfs = mount->fatfs;
 
     // static messages
     std::string unknown_cmd = "Command not found";
@@ -151,8 +179,8 @@ void *connection_handler(void *con_info) {
         "WELCOME TO FILESYSTEM SERVER\n\n"
         "FILE SYSTEM COMMANDS:\n"
         "---------------------\n"
-        "mkfs [CYLINDER] [SECTOR]\tCreate filesystem size of cylinder x "
-        "sector\n"
+        "mkfs [CYLINDER] [SECTOR] [BLOCK]\tCreate filesystem size of "
+        "cylinder x sector, optional block size 512 to 65536 bytes\n"
         "rmfs\t\t\t\tRemove filesystem\n"
         "mkdir [NAME]\t\t\tCreate a directory entry\n"
         "rmdir [NAME]\t\t\tRemove a directory\n"
@@ -171,18 +199,18 @@ void *connection_handler(void *con_info) {
 
     std::cout << "Serving client@" << ipv4 << ":" << port << std::endl;
 
-    // try to open disk if disk file exists
-    try {
-        if(disk.open(diskname)) {
-            fatfs.set_disk(&disk);
-            fatfs.open_disk();
+    // existing disk file was opened by the first connection to it
+    {
+        std::shared_lock<std::shared_mutex> lock(mount->mutex);
+
+        if(fatfs.valid())
             welcome +=
                 "Filessytem exists in server. Using existing file system\n";
-        } else
+        else if(mount->error.size())
+            welcome += "ERROR Initializating existing disk/filesystem: " +
+                       mount->error;
+        else
             welcome += need_create;
-    } catch(const std::exception &e) {
-        welcome += "ERROR Initializating existing disk/filesystem: " +
-                   std::string(e.what());
     }
 
     try {
@@ -203,6 +231,20 @@ void *connection_handler(void *con_info) {
                     continue;
                 }
 
+                // format and remove change the filesystem under every
+                // connection, other commands run at once under its entry
+                // locks, each in the session's working directory
+                std::shared_lock<std::shared_mutex> shared(mount->mutex,
+                                                           std::defer_lock);
+                std::unique_lock<std::shared_mutex> exclusive(mount->mutex,
+                                                              std::defer_lock);
+
+                if(tokens[0] == "mkfs" || tokens[0] == "F" ||
+                   tokens[0] == "rmfs" || tokens[0] == "U")
+                    exclusive.lock();
+                else
+                    shared.lock();
+
                 // Exit
                 if(tokens[0] == "exit") {
                     std::cout << "Client requested exit" << std::endl;
@@ -220,25 +262,25 @@ void *connection_handler(void *con_info) {
                 else if(tokens[0] == "rmfs" || tokens[0] == "U")
                     fs::rmfs(sockfd, fatfs);
                 else if(tokens[0] == "mkdir")
-                    fs::mkdir(sockfd, tokens, fatfs);
+                    fs::mkdir(sockfd, tokens, fatfs, session);
                 else if(tokens[0] == "rmdir")
-                    fs::rmdir(sockfd, tokens, fatfs);
+                    fs::rmdir(sockfd, tokens, fatfs, session);
                 else if(tokens[0] == "mk" || tokens[0] == "C")
-                    fs::mk(sockfd, tokens, fatfs);
+                    fs::mk(sockfd, tokens, fatfs, session);
                 else if(tokens[0] == "rm" || tokens[0] == "D")
-                    fs::rm(sockfd, tokens, fatfs);
+                    fs::rm(sockfd, tokens, fatfs, session);
                 else if(tokens[0] == "read" || tokens[0] == "R")
-                    fs::read(sockfd, tokens, fatfs);
+                    fs::read(sockfd, tokens, fatfs, session);
                 else if(tokens[0] == "write" || tokens[0] == "W")
-                    fs::write(sockfd, tokens, fatfs);
+                    fs::write(sockfd, tokens, fatfs, session);
                 else if(tokens[0] == "append" || tokens[0] == "A")
-                    fs::append(sockfd, tokens, fatfs);
+                    fs::append(sockfd, tokens, fatfs, session);
                 else if(tokens[0] == "cd")
-                    fs::cd(sockfd, tokens, fatfs);
+                    fs::cd(sockfd, tokens, fatfs, session);
                 else if(tokens[0] == "ls" || tokens[0] == "L")
-                    fs::ls(sockfd, tokens, fatfs);
+                    fs::ls(sockfd, tokens, fatfs, session);
                 else if(tokens[0] == "pwd")
-                    fs::pwd(sockfd, fatfs);
+                    fs::pwd(sockfd, fatfs, session);
                 else if(tokens[0] == "info" || tokens[0] == "I")
                     sock::send_msg(sockfd, fatfs.info());
                 // Unknown commands
@@ -251,6 +293,9 @@ void *connection_handler(void *con_info) {
         std::cout << "Client error. " << e.what() << std::endl;
     }
 
+    // last connection to the image unmounts it
+    MOUNTS->release(mount);
+
     close(sockfd);
 
     return 0;
@@ -265,12 +310,23 @@ void mkfs(int sockfd, std::vector<std::string> &tokens, fs::Disk &disk,
     else if(fatfs.valid())
         sock::send_msg(sockfd, "ERROR Filesystem exists.");
     else {
+        // optional filesystem block size, a cluster of disk blocks, is
+        // checked before a disk is created
+        try {
+            fatfs.set_block_size(tokens.size() > 3 ? std::stoul(tokens[3])
+                                                   : 0);
+        } catch(const std::exception &e) {
+            sock::send_msg(sockfd, "1 ERROR " + std::string(e.what()));
+            return;
+        }
+
         try {
             int cylinders = std::stoi(tokens[1]);
             int sectors = std::stoi(tokens[2]);
 
             disk.set_cylinders(cylinders);
             disk.set_sectors(sectors);
+
             disk.create();
 
             fatfs.set_disk(&disk);
@@ -290,12 +346,13 @@ void rmfs(int sockfd, fs::FatFS &fatfs) {
     sock::send_msg(sockfd, "File system and disk removed");
 }
 
-void mkdir(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
+void mkdir(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+           fs::Session &session) {
     if(tokens.size() < 2)
         sock::send_msg(sockfd, "ERROR Insufficient arguments for mkdir");
     else {
         try {
-            fatfs.add_dir(tokens[1]);
+            fatfs.add_dir(session, tokens[1]);
             sock::send_msg(sockfd, "0 Created");
 
         } catch(const std::invalid_argument &e) {
@@ -306,23 +363,25 @@ void mkdir(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
     }
 }
 
-void rmdir(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
+void rmdir(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+           fs::Session &session) {
     if(tokens.size() < 2)
         sock::send_msg(sockfd, "ERROR Insufficient arguments for rmdir");
     else {
-        if(fatfs.delete_dir(tokens[1]))
+        if(fatfs.delete_dir(session, tokens[1]))
             sock::send_msg(sockfd, "0 Deleted");
         else
             sock::send_msg(sockfd, "1 No such file or directory");
     }
 }
 
-void mk(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
+void mk(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+        fs::Session &session) {
     if(tokens.size() < 2)
         sock::send_msg(sockfd, "ERROR Insufficient arguments for mkfile");
     else {
         try {
-            fatfs.add_file(tokens[1]);
+            fatfs.add_file(session, tokens[1]);
             sock::send_msg(sockfd, "0 Created");
 
         } catch(const std::invalid_argument &e) {
@@ -333,34 +392,35 @@ void mk(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
     }
 }
 
-void rm(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
+void rm(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+        fs::Session &session) {
     if(tokens.size() < 2)
         sock::send_msg(sockfd, "ERROR Insufficient arguments for rm");
     else {
-        if(fatfs.delete_file(tokens[1]))
+        if(fatfs.delete_file(session, tokens[1]))
             sock::send_msg(sockfd, "0 Deleted");
         else
             sock::send_msg(sockfd, "1 No such file or directory");
     }
 }
 
-void read(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
+void read(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+          fs::Session &session) {
     if(tokens.size() < 2)
         sock::send_msg(sockfd, "ERROR Insufficient arguments for read");
     else {
         try {
-            fs::FileEntry file = fatfs.find_file(tokens[1]);
+            fs::FileEntry file = fatfs.find_file(session, tokens[1]);
 
             if(!file)
                 sock::send_msg(sockfd, "1 No file exists");
             else {
-                int bytes = 0;
+                std::size_t bytes = 0;
                 char *data = new char[file.data_size() + 1];
-                bytes = fatfs.read_file_data(file, data, file.size());
-                data[bytes] = '\0';
+                bytes = fatfs.read_file_data(file, data, file.data_size());
 
-                sock::send_msg(sockfd,
-                               "0 " + std::to_string(bytes) + " " + data);
+                sock::send_msg(sockfd, "0 " + std::to_string(bytes) + " " +
+                                           std::string(data, bytes));
 
                 delete[] data;
             }
@@ -370,17 +430,18 @@ void read(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
     }
 }
 
-void write(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
+void write(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+           fs::Session &session) {
     if(tokens.size() < 3)
         sock::send_msg(sockfd, "ERROR Insufficient arguments for write");
     else {
         try {
-            fs::FileEntry file = fatfs.find_file(tokens[1]);
+            fs::FileEntry file = fatfs.find_file(session, tokens[1]);
 
             if(!file)
                 sock::send_msg(sockfd, "1 No file exists");
             else {
-                fatfs.write_file_data(file, tokens[2].c_str(),
+                fatfs.write_file_data(session, file, tokens[2].c_str(),
                                       tokens[2].size());
 
                 sock::send_msg(sockfd, "0");
@@ -391,17 +452,18 @@ void write(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
     }
 }
 
-void append(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
+void append(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+            fs::Session &session) {
     if(tokens.size() < 3)
         sock::send_msg(sockfd, "ERROR Insufficient arguments for write");
     else {
         try {
-            fs::FileEntry file = fatfs.find_file(tokens[1]);
+            fs::FileEntry file = fatfs.find_file(session, tokens[1]);
 
             if(!file)
                 sock::send_msg(sockfd, "1 No file exists");
             else {
-                fatfs.append_file_data(file, tokens[2].c_str(),
+                fatfs.append_file_data(session, file, tokens[2].c_str(),
                                        tokens[2].size());
 
                 sock::send_msg(sockfd, "0");
@@ -412,13 +474,14 @@ void append(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
     }
 }
 
-void cd(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
+void cd(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+        fs::Session &session) {
     // TODO PARSE PATH AND CHANGE TO FULL PATH
     if(tokens.size() < 2)
         sock::send_msg(sockfd, "ERROR Insufficient arguments for cd");
     else {
         if(fatfs.valid()) {
-            if(fatfs.change_dir(tokens[1]))
+            if(fatfs.change_dir(session, tokens[1]))
                 sock::send_msg(sockfd, "");
             else
                 sock::send_msg(sockfd, "1 No such directory");
@@ -427,7 +490,8 @@ void cd(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
     }
 }
 
-void ls(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
+void ls(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs,
+        fs::Session &session) {
     bool is_details = false;
     char opts[] = "1l";
     char **argv = nullptr;
@@ -469,13 +533,13 @@ void ls(int sockfd, std::vector<std::string> &tokens, fs::FatFS &fatfs) {
         }
 
     // print path to ostringstream and then pass oss to socket
-    fatfs.print_all(oss, *path, is_details);
+    fatfs.print_all(session, oss, *path, is_details);
     sock::send_msg(sockfd, oss.str());
 }
 
-void pwd(int sockfd, fs::FatFS &fatfs) {
+void pwd(int sockfd, fs::FatFS &fatfs, fs::Session &session) {
     if(fatfs.valid())
-        sock::send_msg(sockfd, fatfs.pwd());
+        sock::send_msg(sockfd, fatfs.pwd(session));
     else
         sock::send_msg(sockfd, "No filesystem");
 }
@@ -0,0 +1,147 @@
+#include "../include/bitmap.h"
+
+namespace fs {
+
+Bitmap::Bitmap(std::size_t bits) : _bits(0), _count(0) { resize(bits); }
+
+std::size_t Bitmap::size() const { return _bits; }
+
+std::size_t Bitmap::count() const { return _count; }
+
+bool Bitmap::empty() const { return _count == 0; }
+
+bool Bitmap::test(std::size_t i) const {
+    return i < _bits && (_words[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+}
+
+std::size_t Bitmap::bytes_for(std::size_t bits) {
+    return (bits + WORD_BITS - 1) / WORD_BITS * sizeof(uint64_t);
+}
+
+std::size_t Bitmap::bytes() const { return _words.size() * sizeof(uint64_t); }
+
+void Bitmap::load(const char *src, std::size_t bits) {
+    resize(bits);
+
+    if(_words.empty()) return;
+
+    memcpy(_words.data(), src, bytes());
+    _words.back() &= _tail_mask();
+
+    // recount set bits
+    for(uint64_t word : _words) _count += __builtin_popcountll(word);
+}
+
+void Bitmap::store(char *dst) const {
+    if(!_words.empty()) memcpy(dst, _words.data(), bytes());
+}
+
+void Bitmap::resize(std::size_t bits) {
+    _bits = bits;
+    _count = 0;
+    _words.assign((bits + WORD_BITS - 1) / WORD_BITS, 0);
+}
+
+void Bitmap::set(std::size_t i) {
+    uint64_t mask = uint64_t(1) << (i % WORD_BITS);
+    uint64_t &word = _words[i / WORD_BITS];
+
+    if(!(word & mask)) {
+        word |= mask;
+        ++_count;
+    }
+}
+
+void Bitmap::reset(std::size_t i) {
+    uint64_t mask = uint64_t(1) << (i % WORD_BITS);
+    uint64_t &word = _words[i / WORD_BITS];
+
+    if(word & mask) {
+        word &= ~mask;
+        --_count;
+    }
+}
+
+void Bitmap::set_all() {
+    if(_words.empty()) return;
+
+    for(uint64_t &word : _words) word = ~uint64_t(0);
+    _words.back() = _tail_mask();
+    _count = _bits;
+}
+
+void Bitmap::reset_all() {
+    for(uint64_t &word : _words) word = 0;
+    _count = 0;
+}
+
+long Bitmap::find_next(std::size_t from) const {
+    if(from >= _bits) return NPOS;
+
+    std::size_t w = from / WORD_BITS;
+
+    // mask off bits before from in the first word
+    uint64_t word = _words[w] & (~uint64_t(0) << (from % WORD_BITS));
+
+    // skip empty words
+    while(!word) {
+        if(++w == _words.size()) return NPOS;
+        word = _words[w];
+    }
+
+    return w * WORD_BITS + __builtin_ctzll(word);
+}
+
+long Bitmap::find_next_unset(std::size_t from) const {
+    if(from >= _bits) return NPOS;
+
+    std::size_t w = from / WORD_BITS;
+    std::size_t i;
+
+    // invert word to search for unset bits
+    uint64_t word = ~_words[w] & (~uint64_t(0) << (from % WORD_BITS));
+
+    // skip full words
+    while(!word) {
+        if(++w == _words.size()) return NPOS;
+        word = ~_words[w];
+    }
+
+    i = w * WORD_BITS + __builtin_ctzll(word);
+
+    return i < _bits ? long(i) : long(NPOS);
+}
+
+long Bitmap::find_run(std::size_t n, std::size_t from) const {
+    long start = NPOS, end = NPOS;
+
+    if(n == 0) return NPOS;
+
+    while((start = find_next(from)) != NPOS) {
+        // end of this run of set bits
+        end = find_next_unset(start);
+        if(end == NPOS) end = _bits;
+
+        if(std::size_t(end - start) >= n) return start;
+
+        from = end;
+    }
+    return NPOS;
+}
+
+std::size_t Bitmap::run_length(std::size_t i, std::size_t max) const {
+    if(!test(i)) return 0;
+
+    long end = find_next_unset(i);
+    std::size_t len = (end == NPOS ? _bits : end) - i;
+
+    return len < max ? len : max;
+}
+
+uint64_t Bitmap::_tail_mask() const {
+    std::size_t bits = _bits % WORD_BITS;
+
+    return bits ? (uint64_t(1) << bits) - 1 : ~uint64_t(0);
+}
+
+}  // namespace fs
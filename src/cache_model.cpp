@@ -0,0 +1,344 @@
+#include "../include/cache_model.h"
+
+namespace fs {
+
+CacheModel::CacheModel()
+    : _disk(nullptr),
+      _base(nullptr),
+      _block_size(0),
+      _frames(0),
+      _in_max(0),
+      _out_max(0),
+      _hits(),
+      _misses(),
+      _writebacks(0) {}
+
+void CacheModel::attach(Disk *disk, std::size_t block_size, std::size_t mb,
+                        const char *base) {
+    detach();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _disk = disk;
+    _base = base || !disk ? base : disk->file();
+    _block_size = block_size;
+    _frames = disk && block_size ? (mb << 20) / block_size : 0;
+
+    // 2Q sizes: A1in a quarter of the cache, A1out remembers half of it
+    _in_max = std::max<std::size_t>(_frames / 4, 1);
+    _out_max = std::max<std::size_t>(_frames / 2, 1);
+
+    for(int cls = 0; cls < CLASSES; ++cls) _hits[cls] = _misses[cls] = 0;
+    _writebacks = 0;
+}
+
+void CacheModel::detach() {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    // every thread's updates are marked before blocks are forgotten
+    for(auto &updated : _updated) _commit(updated.second);
+    _updated.clear();
+    _last_read.clear();
+    if(_frames > 0) _flush();
+
+    _resident.clear();
+    _a1in.clear();
+    _am.clear();
+    _a1out.clear();
+    _ghosts.clear();
+    _frames = 0;
+}
+
+bool CacheModel::enabled() const { return _frames > 0; }
+
+std::size_t CacheModel::capacity() const { return _frames; }
+
+std::size_t CacheModel::size() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _resident.size();
+}
+
+bool CacheModel::resident(long block) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _resident.find(block) != _resident.end();
+}
+
+bool CacheModel::access(long block, int cls, bool dirty) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    bool is_hit = _access(block, cls, dirty);
+
+    // without a cache a FAT or directory block is read once into the
+    // thread's working buffer, charged outside the lock so threads wait on
+    // the disk only; data blocks pay their own reads and flushes
+    if(_disk && !enabled() && cls != DATA) {
+        auto last = _last_read.emplace(std::this_thread::get_id(), -1).first;
+
+        if(last->second != block) {
+            last->second = block;
+            lock.unlock();
+            _read(block, 1);
+        }
+    }
+
+    return is_hit;
+}
+
+bool CacheModel::_access(long block, int cls, bool dirty) {
+    if(!_disk) return false;
+
+    // changed in place, the disk flushes it on commit, cached or not
+    if(dirty)
+        _updated[std::this_thread::get_id()].emplace_back(block, cls);
+
+    if(!enabled()) return false;
+
+    auto it = _resident.find(block);
+
+    if(it != _resident.end()) {
+        Frame &frame = it->second;
+
+        // A1in keeps arrival order, Am moves to most recently used
+        if(frame.queue == AM) _am.splice(_am.begin(), _am, frame.pos);
+        frame.dirty = frame.dirty || dirty;
+        ++_hits[cls];
+
+        return true;
+    }
+
+    ++_misses[cls];
+    _read(block, 1);
+    _insert(block, dirty);
+
+    return false;
+}
+
+bool CacheModel::access(const char *address, int cls, bool dirty) {
+    if(!_disk || !address) return false;
+
+    return access(long((address - _base) / _block_size), cls, dirty);
+}
+
+void CacheModel::access_run(long block, std::size_t count, int cls,
+                            bool dirty) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::size_t i = 0, n = 0;
+
+    if(!enabled()) return;
+
+    while(i < count) {
+        if(_resident.count(block + i)) {
+            _access(block + i, cls, dirty);
+            ++i;
+            continue;
+        }
+
+        // misses up to the next resident block are one disk read
+        n = 1;
+        while(i + n < count && !_resident.count(block + i + n)) ++n;
+        _read(block + i, n);
+
+        for(; n > 0; --n, ++i) {
+            ++_misses[cls];
+            _insert(block + i, dirty);
+        }
+    }
+}
+
+void CacheModel::_insert(long block, bool dirty) {
+    if(_resident.size() >= _frames) _evict();
+
+    Frame frame = {A1IN, 0, dirty, std::list<long>::iterator()};
+    auto ghost = _ghosts.find(block);
+
+    // seen again after leaving A1in, block is hot
+    if(ghost != _ghosts.end()) {
+        _a1out.erase(ghost->second);
+        _ghosts.erase(ghost);
+        _am.push_front(block);
+        frame.queue = AM;
+        frame.pos = _am.begin();
+    } else {
+        _a1in.push_front(block);
+        frame.pos = _a1in.begin();
+    }
+    _resident[block] = frame;
+}
+
+void CacheModel::pin(long block, int cls) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if(!enabled()) return;
+
+    _access(block, cls, false);
+    ++_resident[block].pins;
+}
+
+void CacheModel::unpin(long block) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _resident.find(block);
+
+    if(it != _resident.end() && it->second.pins > 0) --it->second.pins;
+}
+
+void CacheModel::commit() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _updated.find(std::this_thread::get_id());
+
+    if(it == _updated.end()) return;
+
+    _commit(it->second);
+    _updated.erase(it);
+}
+
+void CacheModel::_commit(std::vector<std::pair<long, int>> &updated) {
+    std::size_t disk_blocks = _disk ? _block_size / _disk->max_block() : 0;
+
+    for(const auto &update : updated)
+        _disk->mark_dirty(update.first * disk_blocks, disk_blocks);
+    updated.clear();
+}
+
+std::vector<long> CacheModel::take_metadata() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<long> blocks;
+    std::size_t kept = 0;
+    auto it = _updated.find(std::this_thread::get_id());
+
+    if(it == _updated.end()) return blocks;
+
+    std::vector<std::pair<long, int>> &updated = it->second;
+
+    // FAT and directory blocks leave the queue, data blocks stay in order
+    for(const auto &update : updated) {
+        if(update.second == DATA)
+            updated[kept++] = update;
+        else
+            blocks.push_back(update.first);
+    }
+    updated.resize(kept);
+
+    std::sort(blocks.begin(), blocks.end());
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+    return blocks;
+}
+
+void CacheModel::flush() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _flush();
+}
+
+void CacheModel::_flush() {
+    std::vector<long> dirty;
+
+    for(auto &resident : _resident)
+        if(resident.second.dirty) dirty.push_back(resident.first);
+
+    // write back in block order to sweep the disk once
+    std::sort(dirty.begin(), dirty.end());
+    for(long block : dirty) {
+        _write(block);
+        _resident[block].dirty = false;
+        ++_writebacks;
+    }
+}
+
+void CacheModel::reset() {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    for(int cls = 0; cls < CLASSES; ++cls) _hits[cls] = _misses[cls] = 0;
+    _writebacks = 0;
+}
+
+std::size_t CacheModel::hits(int cls) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _hits[cls];
+}
+
+std::size_t CacheModel::misses(int cls) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _misses[cls];
+}
+
+std::size_t CacheModel::writebacks() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _writebacks;
+}
+
+std::string CacheModel::info() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const char *names[] = {"FAT", "Directory", "Data"};
+    std::string info = "Cache model blocks (simulated): " +
+                       std::to_string(_resident.size()) + "/" +
+                       std::to_string(_frames);
+
+    for(int cls = 0; cls < CLASSES; ++cls) {
+        std::size_t total = _hits[cls] + _misses[cls];
+
+        info += '\n' + std::string(names[cls]) +
+                " hits: " + std::to_string(_hits[cls]) +
+                " misses: " + std::to_string(_misses[cls]) + " hit rate: " +
+                std::to_string(total ? 100 * _hits[cls] / total : 0) + "%";
+    }
+
+    return info + "\nCache model writebacks: " + std::to_string(_writebacks);
+}
+
+void CacheModel::_evict() {
+    std::list<long> *queues[] = {&_a1in, &_am};
+    long victim = -1;
+
+    // take from A1in while it holds more than its share, else from Am
+    if(_a1in.size() <= _in_max) std::swap(queues[0], queues[1]);
+
+    for(std::list<long> *queue : queues) {
+        for(auto it = queue->rbegin(); it != queue->rend(); ++it)
+            if(_resident[*it].pins == 0) {
+                victim = *it;
+                break;
+            }
+        if(victim > -1) break;
+    }
+
+    if(victim < 0)
+        throw std::runtime_error("Cache model full of pinned blocks");
+
+    Frame &frame = _resident[victim];
+
+    if(frame.dirty) {
+        _write(victim);
+        ++_writebacks;
+    }
+
+    // blocks leaving A1in are remembered in A1out
+    if(frame.queue == A1IN) {
+        _a1in.erase(frame.pos);
+        _a1out.push_front(victim);
+        _ghosts[victim] = _a1out.begin();
+
+        if(_a1out.size() > _out_max) {
+            _ghosts.erase(_a1out.back());
+            _a1out.pop_back();
+        }
+    } else
+        _am.erase(frame.pos);
+
+    _resident.erase(victim);
+}
+
+void CacheModel::_read(long block, std::size_t count) {
+    std::size_t disk_blocks = _block_size / _disk->max_block();
+
+    // data stays in place in the mapped disk, only the transfer is paid
+    _disk->charge(block * disk_blocks, count * disk_blocks);
+}
+
+void CacheModel::_write(long block) {
+    std::size_t disk_blocks = _block_size / _disk->max_block();
+
+    // cost-only writeback, the block was written in place and is marked
+    // dirty in the Disk by commit() for its flush
+    _disk->charge(block * disk_blocks, disk_blocks);
+}
+
+}  // namespace fs
@@ -6,20 +6,39 @@ Disk::Disk(std::string name, int cyl, int sec)
     : _cylinders(cyl),
       _sectors(sec),
       _max_block(MAX_BLOCK),
-      _offset(sizeof(_cylinders) + sizeof(_sectors) + sizeof(_max_block)),
+      _offset(HEADER_SZ),
       _logical_bytes(_cylinders * _sectors * _max_block),
       _physical_bytes(_logical_bytes + _offset),
       _track_time(TRACK_TIME),
+      _rotation_time(ROTATION_TIME),
+      _transfer_time(TRANSFER_TIME),
+      _version(VERSION),
+      _provision(SPARSE),
+      _prefault(false),
+      _backend(MMAP),
       _name(name),
       _disk_name(name + ".disk"),
       _fd(-1),
+      _direct_fd(-1),
       _file(nullptr),
-      _pfile(nullptr) {
+      _pfile(nullptr),
+      _head(0),
+      _timing(),
+      _clock(0),
+      _virtual(false),
+      _durability(NONE),
+      _flush_interval(FLUSH_INTERVAL),
+      _dirty_ratio(DIRTY_RATIO),
+      _writeback(),
+      _flusher_stop(false) {
     if(cyl < 1 || sec < 1)
         throw std::out_of_range("ERROR Invalid cylinder or sector");
 }
 
 Disk::~Disk() {
+    // buffered image is the only copy of unflushed blocks
+    if(_backend != MMAP || _durability != NONE) sync();
+
     _unmap_file();  // unmap virtual memory from file
     _close_fd();    // close file descriptor
 }
@@ -37,29 +56,45 @@ bool Disk::create() {
             throw std::runtime_error("Error creating Disk file: create");
 
         // update private vairables
+        _version = VERSION;
+        _offset = HEADER_SZ;
         _logical_bytes = _cylinders * _sectors * _max_block;
         _physical_bytes = _logical_bytes + _offset;
 
-        // zero fill file of size bytes
-        for(std::size_t i = 0; i < _physical_bytes; ++i) write(_fd, "\0", 1);
-
-        // write geometry info at start of physical disk
-        lseek(_fd, 0, SEEK_SET);
-        write(_fd, (char *)&_cylinders, sizeof(_cylinders));
-        write(_fd, (char *)&_sectors, sizeof(_sectors));
-        write(_fd, (char *)&_max_block, sizeof(_max_block));
+        // zero filled file of size bytes, reserve blocks if preallocated
+        if(_provision == PREALLOCATE) {
+            if(posix_fallocate(_fd, 0, _physical_bytes) != 0) {
+                _close_fd();
+                ::remove(_disk_name.c_str());
+                throw std::runtime_error("Error allocating Disk file: create");
+            }
+        } else if(ftruncate(_fd, _physical_bytes) == -1) {
+            _close_fd();
+            ::remove(_disk_name.c_str());
+            throw std::runtime_error("Error sizing Disk file: create");
+        }
+
+        // write versioned geometry info at start of physical disk
+        std::size_t header[] = {MAGIC, VERSION, _cylinders, _sectors,
+                                _max_block};
+        if(pwrite(_fd, (char *)header, sizeof(header), 0) !=
+           (ssize_t)sizeof(header)) {
+            _close_fd();
+            ::remove(_disk_name.c_str());
+            throw std::runtime_error("Error writing Disk header: create");
+        }
 
         // check if file stats is consisent
-        if(fstat(_fd, &sb) == 0 && sb.st_size != (int)_physical_bytes)
+        if(fstat(_fd, &sb) == 0 && sb.st_size != (off_t)_physical_bytes) {
+            _close_fd();
+            ::remove(_disk_name.c_str());
             throw std::runtime_error(
                 "Error checking Disk file descriptor: create");
+        }
 
-        // map physical file to memory
-        _pfile = (char *)mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE,
-                              MAP_SHARED, _fd, 0);
-
-        // offset starting file address by eometry info size
-        _file = _pfile + _offset;
+        // map physical file to memory, an image loads pages on access
+        _map_file();
+        _start_flusher();
 
         is_created = true;
     }
@@ -83,27 +118,63 @@ bool Disk::open(std::string n) {
         if(_fd == -1) throw std::runtime_error("Error opening Disk file: open");
 
         // check if file stats is consisent
-        if(fstat(_fd, &sb) == -1)
+        if(fstat(_fd, &sb) == -1) {
+            _close_fd();
             throw std::runtime_error(
                 "Error checking Disk file descriptor: open");
-
-        // map phyhsical file to memory
-        _pfile = (char *)mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE,
-                              MAP_SHARED, _fd, 0);
-
-        // offset starting file address by eometry info size
-        _file = _pfile + _offset;
-
-        // update geometry info
-        read(_fd, (char *)&_cylinders, sizeof(_cylinders));
-        read(_fd, (char *)&_sectors, sizeof(_sectors));
-        read(_fd, (char *)&_max_block, sizeof(_max_block));
-
+        }
+
+        // geometry info, v1 has no magic and starts with geometry
+        std::size_t header[5] = {0};
+        int version = 1;
+        std::size_t offset = LEGACY_HEADER_SZ;
+        std::size_t *geometry = header;
+        std::size_t file_bytes = sb.st_size;
+
+        if(pread(_fd, (char *)header, sizeof(header), 0) <
+           (ssize_t)LEGACY_HEADER_SZ) {
+            _close_fd();
+            throw std::runtime_error("Error reading Disk header: open");
+        }
+
+        if(header[0] == MAGIC) {
+            if(header[1] > VERSION) {
+                _close_fd();
+                return false;
+            }
+            version = header[1];
+            offset = HEADER_SZ;
+            geometry = header + 2;
+        }
+
+        // a truncated or foreign file is smaller than its geometry
+        if(geometry[0] == 0 || geometry[1] == 0 || geometry[2] == 0 ||
+           file_bytes < offset ||
+           geometry[0] > (file_bytes - offset) / geometry[2] / geometry[1]) {
+            _close_fd();
+            throw std::runtime_error("Error Disk file smaller than geometry");
+        }
+
+        _version = version;
+        _offset = offset;
+        _cylinders = geometry[0];
+        _sectors = geometry[1];
+        _max_block = geometry[2];
         _physical_bytes = sb.st_size;
-        _logical_bytes = _physical_bytes - _offset;
         _name = n;
         _disk_name = diskname;
 
+        // map phyhsical file to memory, an image loads pages on access or
+        // all at once if prefaulted
+        _map_file();
+        if(_prefault && !_load(0, _physical_bytes)) {
+            _unmap_file();
+            _close_fd();
+            throw std::runtime_error("Error reading Disk file: open");
+        }
+        _logical_bytes = _physical_bytes - _offset;
+        _start_flusher();
+
         is_opened = true;
     }
 
@@ -125,6 +196,8 @@ bool Disk::valid() const { return _pfile != nullptr; }
 
 Disk::operator bool() const { return _pfile != nullptr; }
 
+int Disk::version() const { return _version; }
+
 std::size_t Disk::cylinder() const { return _cylinders; }
 
 std::size_t Disk::sector() const { return _sectors; }
@@ -133,6 +206,10 @@ std::size_t Disk::max_block() const { return _max_block; }
 
 std::size_t Disk::track_time() const { return _track_time; }
 
+std::size_t Disk::rotation_time() const { return _rotation_time; }
+
+std::size_t Disk::transfer_time() const { return _transfer_time; }
+
 std::size_t Disk::logical_bytes() const { return _logical_bytes; }
 
 std::size_t Disk::physical_bytes() const { return _physical_bytes; }
@@ -164,11 +241,14 @@ int Disk::fd() const { return _fd; }
 
 char *Disk::file() const { return _file; }
 
-char *Disk::data_at(int block) const {
-    if(block > -1 && block < int(_cylinders * _sectors))
-        return _file + (block * _max_block);
-    else
-        return nullptr;
+char *Disk::data_at(long block, std::size_t count) const {
+    if(block < 0 || block >= long(total_blocks())) return nullptr;
+
+    count = std::min(std::max<std::size_t>(count, 1), total_blocks() - block);
+    if(!_load(_offset + location(block), count * _max_block))
+        throw std::runtime_error("Error reading Disk file");
+
+    return _file + (block * _max_block);
 }
 
 void Disk::set_cylinders(int c) {
@@ -198,13 +278,256 @@ bool Disk::set_name(std::string n) {
 
 void Disk::set_track_time(std::size_t t) { _track_time = t; }
 
+void Disk::set_rotation_time(std::size_t t) { _rotation_time = t; }
+
+void Disk::set_transfer_time(std::size_t t) { _transfer_time = t; }
+
+std::size_t Disk::Timing::total() const { return seek + rotation + transfer; }
+
+std::size_t Disk::head() const {
+    std::lock_guard<std::mutex> lock(_head_mutex);
+    return _head;
+}
+
+Disk::Timing Disk::timing() const {
+    std::lock_guard<std::mutex> lock(_head_mutex);
+    return _timing;
+}
+
+std::string Disk::timing_info() const {
+    Timing t = timing();
+
+    return "Accesses: " + std::to_string(t.accesses) +
+           "\nBlocks: " + std::to_string(t.blocks) +
+           "\nSeek distance (cylinders): " + std::to_string(t.cylinders) +
+           "\nSeek time (us): " + std::to_string(t.seek) +
+           "\nRotation time (us): " + std::to_string(t.rotation) +
+           "\nTransfer time (us): " + std::to_string(t.transfer) +
+           "\nTotal time (us): " + std::to_string(t.total()) +
+           "\nClock (us): " + std::to_string(clock()) +
+           "\nVirtual clock: " + std::to_string(virtual_clock());
+}
+
+void Disk::reset_timing() {
+    std::lock_guard<std::mutex> lock(_head_mutex);
+    _timing = Timing();
+    _thread_times.clear();
+}
+
+bool Disk::virtual_clock() const {
+    std::lock_guard<std::mutex> lock(_head_mutex);
+    return _virtual;
+}
+
+void Disk::set_virtual_clock(bool is_on) {
+    std::lock_guard<std::mutex> lock(_head_mutex);
+    _virtual = is_on;
+}
+
+std::size_t Disk::clock() const {
+    std::lock_guard<std::mutex> lock(_head_mutex);
+    return _clock;
+}
+
+std::size_t Disk::thread_time() const {
+    std::lock_guard<std::mutex> lock(_head_mutex);
+    auto it = _thread_times.find(std::this_thread::get_id());
+
+    return it == _thread_times.end() ? 0 : it->second;
+}
+
+int Disk::provision() const { return _provision; }
+
+bool Disk::prefault() const { return _prefault; }
+
+void Disk::set_provision(int p) {
+    if(p < SPARSE || p > PREALLOCATE)
+        throw std::out_of_range("ERROR Invalid provision");
+    if(!valid()) _provision = p;
+}
+
+void Disk::set_prefault(bool is_on) {
+    if(!valid()) _prefault = is_on;
+}
+
+int Disk::backend() const { return _backend; }
+
+void Disk::set_backend(int b) {
+    if(b < MMAP || b > DIRECT) throw std::out_of_range("ERROR Invalid backend");
+    if(!valid()) _backend = b;
+}
+
+bool Disk::sync() {
+    if(!valid()) return false;
+
+    flush();
+
+    if(_backend == MMAP) return msync(_pfile, _physical_bytes, MS_SYNC) == 0;
+
+    return fsync(_fd) == 0;
+}
+
+const char *Disk::backend_name(int b) {
+    static const char *names[] = {"MMAP", "PREAD", "DIRECT"};
+
+    return b < MMAP || b > DIRECT ? "UNKNOWN" : names[b];
+}
+
+int Disk::durability() const { return _durability; }
+
+void Disk::set_durability(int d) {
+    if(d < NONE || d > SYNC)
+        throw std::out_of_range("ERROR Invalid durability");
+
+    _stop_flusher();
+    _durability = d;
+    if(valid()) _start_flusher();
+}
+
+std::size_t Disk::flush_interval() const { return _flush_interval; }
+
+void Disk::set_flush_interval(std::size_t ms) {
+    if(ms < 1) throw std::out_of_range("ERROR Invalid flush interval");
+
+    std::lock_guard<std::mutex> lock(_dirty_mutex);
+    _flush_interval = ms;
+}
+
+std::size_t Disk::dirty_ratio() const { return _dirty_ratio; }
+
+void Disk::set_dirty_ratio(std::size_t percent) {
+    if(percent > 100) throw std::out_of_range("ERROR Invalid dirty ratio");
+
+    std::lock_guard<std::mutex> lock(_dirty_mutex);
+    _dirty_ratio = percent;
+}
+
+const char *Disk::durability_name(int d) {
+    static const char *names[] = {"NONE", "PERIODIC", "SYNC"};
+
+    return d < NONE || d > SYNC ? "UNKNOWN" : names[d];
+}
+
+void Disk::mark_dirty(std::size_t block, std::size_t count) {
+    std::lock_guard<std::mutex> lock(_dirty_mutex);
+
+    if(block >= _dirty.size()) return;
+
+    count = std::min(count, _dirty.size() - block);
+    for(std::size_t i = block; i < block + count; ++i) _dirty.set(i);
+
+    // wake the flusher early once too much of the disk is dirty
+    if(_durability == PERIODIC && _over_ratio())
+        _flush_cv.notify_one();
+}
+
+std::size_t Disk::dirty_blocks() const {
+    std::lock_guard<std::mutex> lock(_dirty_mutex);
+    return _dirty.count();
+}
+
+std::size_t Disk::flush() { return flush(0, _dirty.size()); }
+
+std::size_t Disk::flush(std::size_t first, std::size_t count) {
+    std::lock_guard<std::mutex> flushing(_flush_mutex);
+    std::vector<std::pair<std::size_t, std::size_t>> runs;
+    std::size_t bytes = 0, page = sysconf(_SC_PAGESIZE);
+    auto start = std::chrono::steady_clock::now();
+    bool is_flushed = true;
+
+    if(!valid()) return 0;
+
+    // take the dirty runs, blocks dirtied while writing wait for next flush
+    {
+        std::lock_guard<std::mutex> lock(_dirty_mutex);
+        std::size_t end = std::min(first, _dirty.size());
+        long block = Bitmap::NPOS;
+
+        end += std::min(count, _dirty.size() - end);
+        if(first < end) block = _dirty.find_next(first);
+
+        while(block != Bitmap::NPOS && std::size_t(block) < end) {
+            std::size_t len = _dirty.run_length(block, end - block);
+
+            runs.emplace_back(block, len);
+            for(std::size_t i = block; i < block + len; ++i) _dirty.reset(i);
+            block = _dirty.find_next(block + len);
+        }
+    }
+
+    if(runs.empty()) return 0;
+
+    for(const auto &run : runs) {
+        std::size_t offset = _offset + location(run.first);
+        std::size_t len = run.second * _max_block;
+
+        // msync needs a page aligned start
+        if(_backend == MMAP)
+            is_flushed = msync(_pfile + offset / page * page,
+                               offset % page + len, MS_SYNC) == 0 &&
+                         is_flushed;
+        else
+            is_flushed = _write_loaded(offset, len) && is_flushed;
+        bytes += len;
+    }
+    if(_backend != MMAP) is_flushed = fsync(_fd) == 0 && is_flushed;
+
+    std::size_t time = std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+
+    std::lock_guard<std::mutex> lock(_dirty_mutex);
+
+    // failed runs stay dirty for the next flush
+    if(!is_flushed) {
+        for(const auto &run : runs)
+            for(std::size_t i = 0; i < run.second; ++i)
+                _dirty.set(run.first + i);
+        return 0;
+    }
+
+    _writeback.flushes += 1;
+    _writeback.runs += runs.size();
+    _writeback.bytes += bytes;
+    _writeback.time += time;
+    _writeback.max_time = std::max(_writeback.max_time, time);
+
+    return bytes;
+}
+
+void Disk::commit() {
+    if(_durability == SYNC) flush();
+}
+
+Disk::Writeback Disk::writeback() const {
+    std::lock_guard<std::mutex> lock(_dirty_mutex);
+    return _writeback;
+}
+
+std::string Disk::writeback_info() const {
+    Writeback w = writeback();
+
+    return "Durability: " + std::string(durability_name(_durability)) +
+           "\nDirty blocks: " + std::to_string(dirty_blocks()) +
+           "\nFlushes: " + std::to_string(w.flushes) +
+           "\nFlushed runs: " + std::to_string(w.runs) +
+           "\nFlushed bytes: " + std::to_string(w.bytes) +
+           "\nFlush time (us): " + std::to_string(w.time) +
+           "\nMax flush time (us): " + std::to_string(w.max_time);
+}
+
+void Disk::reset_writeback() {
+    std::lock_guard<std::mutex> lock(_dirty_mutex);
+    _writeback = Writeback();
+}
+
 std::string Disk::read_at(std::size_t cyl, std::size_t sec) const {
     if(cyl > _cylinders - 1 || sec > _sectors - 1)
         return "0";
     else {
-        usleep(_track_time);
+        _access(block(cyl, sec), 1);
 
-        return "1" + std::string(_file + location(cyl, sec), _max_block);
+        return "1" + std::string(data_at(block(cyl, sec)), _max_block);
     }
 }
 
@@ -213,9 +536,10 @@ bool Disk::write_at(const char *buf, std::size_t cyl, std::size_t sec,
     if(cyl > _cylinders - 1 || sec > _sectors - 1 || bufsz > _max_block)
         return false;
     else {
-        usleep(_track_time);
+        _access(block(cyl, sec), 1);
 
-        strncpy(_file + location(cyl, sec), buf, bufsz);
+        memcpy(data_at(block(cyl, sec)), buf, bufsz);
+        mark_dirty(block(cyl, sec));
         return true;
     }
 }
@@ -225,25 +549,357 @@ bool Disk::write_at(char *buf, std::size_t cyl, std::size_t sec,
     if(cyl > _cylinders - 1 || sec > _sectors - 1 || bufsz > _max_block)
         return false;
     else {
-        usleep(_track_time);
+        _access(block(cyl, sec), 1);
 
-        strncpy(_file + location(cyl, sec), buf, bufsz);
+        memcpy(data_at(block(cyl, sec)), buf, bufsz);
+        mark_dirty(block(cyl, sec));
         return true;
     }
 }
 
+std::size_t Disk::read_blocks(std::size_t block, std::size_t count,
+                              const struct iovec *iov, int iovcnt) const {
+    std::size_t bytes = 0, len = 0, max_bytes = count * _max_block;
+    const char *src = nullptr;
+
+    if(count == 0 || block + count > total_blocks()) return 0;
+
+    _access(block, count);
+
+    // pages never loaded are current in the file, read straight into the
+    // buffers without filling the image
+    if(_backend == PREAD &&
+       !_any_loaded(_offset + location(block), max_bytes)) {
+        std::vector<struct iovec> parts;
+        ssize_t n = -1;
+
+        for(int i = 0; i < iovcnt && len < max_bytes; ++i) {
+            parts.push_back(
+                {iov[i].iov_base, std::min(iov[i].iov_len, max_bytes - len)});
+            len += parts.back().iov_len;
+        }
+
+        while(n == -1) {
+            n = preadv(_fd, parts.data(), parts.size(),
+                       _offset + location(block));
+            if(n == -1 && errno != EINTR) return 0;
+        }
+        return n;
+    }
+
+    if(!_load(_offset + location(block), max_bytes)) return 0;
+    src = _file + location(block);
+
+    // scatter blocks across buffers until blocks or buffers run out
+    for(int i = 0; i < iovcnt && bytes < max_bytes; ++i) {
+        len = std::min(iov[i].iov_len, max_bytes - bytes);
+        memcpy(iov[i].iov_base, src + bytes, len);
+        bytes += len;
+    }
+    return bytes;
+}
+
+std::size_t Disk::write_blocks(std::size_t block, std::size_t count,
+                               const struct iovec *iov, int iovcnt) {
+    std::size_t bytes = 0, len = 0, max_bytes = count * _max_block;
+    char *dst = nullptr;
+
+    if(count == 0 || block + count > total_blocks()) return 0;
+
+    _access(block, count);
+
+    // pages the buffers fill whole are not read first
+    for(int i = 0; i < iovcnt && len < max_bytes; ++i)
+        len = std::min(len + iov[i].iov_len, max_bytes);
+    if(!_load(_offset + location(block), len, true)) return 0;
+    dst = _file + location(block);
+
+    // gather buffers into blocks until buffers or blocks run out
+    for(int i = 0; i < iovcnt && bytes < max_bytes; ++i) {
+        len = std::min(iov[i].iov_len, max_bytes - bytes);
+        memcpy(dst + bytes, iov[i].iov_base, len);
+        bytes += len;
+    }
+    mark_dirty(block, count);
+    return bytes;
+}
+
+void Disk::charge(std::size_t block, std::size_t count) const {
+    if(count == 0 || block + count > total_blocks()) return;
+
+    _access(block, count);
+}
+
+void Disk::_access(std::size_t block, std::size_t blocks) const {
+    std::unique_lock<std::mutex> lock(_head_mutex);
+    std::size_t cyl = block / _sectors, sec = block % _sectors;
+    std::size_t distance = cyl > _head ? cyl - _head : _head - cyl;
+    std::size_t seek = distance * _track_time, rotation = 0;
+    std::size_t transfer = blocks * _transfer_time;
+
+    // platter turns with simulated time, wait for sector after the seek
+    if(_rotation_time > 0) {
+        std::size_t angle = (_clock + seek) % _rotation_time;
+        std::size_t target = sec * _rotation_time / _sectors;
+
+        rotation = (target + _rotation_time - angle) % _rotation_time;
+    }
+
+    // head rests over the last block moved
+    _head = (block + blocks - 1) / _sectors;
+
+    _timing.accesses += 1;
+    _timing.blocks += blocks;
+    _timing.cylinders += distance;
+    _timing.seek += seek;
+    _timing.rotation += rotation;
+    _timing.transfer += transfer;
+
+    // advance simulated time, sleep unless time is only virtual
+    std::size_t delay = seek + rotation + transfer;
+    bool is_virtual = _virtual;
+
+    _clock += delay;
+    _thread_times[std::this_thread::get_id()] += delay;
+
+    // the head is already moved, other threads queue their accesses while
+    // this one waits out its delay
+    lock.unlock();
+    if(!is_virtual) usleep(delay);
+}
+
 void Disk::_close_fd() {
     if(_fd > -1) {
         close(_fd);
         _fd = -1;
     }
+    if(_direct_fd > -1) {
+        close(_direct_fd);
+        _direct_fd = -1;
+    }
+}
+
+void Disk::_map_file() {
+    int flags = MAP_SHARED, fd = _fd;
+
+    // buffered backends keep a private image, page aligned for O_DIRECT,
+    // only reserved so memory is taken by the pages loaded
+    if(_backend != MMAP) {
+        flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+        fd = -1;
+    }
+
+    if(_backend == DIRECT) {
+#ifdef O_DIRECT
+        _direct_fd = ::open(_disk_name.c_str(), O_RDWR | O_DIRECT);
+#endif
+        if(_direct_fd == -1)
+            throw std::runtime_error("Error opening Disk file for direct I/O");
+    }
+
+#ifdef MAP_POPULATE
+    if(_prefault && _backend == MMAP) flags |= MAP_POPULATE;
+#endif
+
+    _pfile = (char *)mmap(NULL, _physical_bytes, PROT_READ | PROT_WRITE, flags,
+                          fd, 0);
+
+    if(_pfile == MAP_FAILED) {
+        _pfile = _file = nullptr;
+        throw std::runtime_error("Error mapping Disk file");
+    }
+
+    // offset starting file address by geometry info size
+    _file = _pfile + _offset;
+
+    // no page of a buffered image is loaded yet
+    if(_backend != MMAP) {
+        std::size_t words = (_physical_bytes / DIRECT_ALIGN + 64) / 64;
+
+        _loaded.reset(new std::atomic<uint64_t>[words]);
+        for(std::size_t i = 0; i < words; ++i) _loaded[i] = 0;
+    }
+
+    std::lock_guard<std::mutex> lock(_dirty_mutex);
+    _dirty.resize(total_blocks());
 }
 
 void Disk::_unmap_file() {
+    _stop_flusher();
+
     if(_pfile) {
         munmap(_pfile, _physical_bytes);
         _pfile = _file = nullptr;
     }
+    _loaded.reset();
+
+    std::lock_guard<std::mutex> lock(_dirty_mutex);
+    _dirty.resize(0);
+}
+
+void Disk::_start_flusher() {
+    if(_durability != PERIODIC || _flusher.joinable()) return;
+
+    _flusher_stop = false;
+    _flusher = std::thread(&Disk::_flush_loop, this);
+}
+
+void Disk::_stop_flusher() {
+    if(!_flusher.joinable()) return;
+
+    {
+        std::lock_guard<std::mutex> lock(_dirty_mutex);
+        _flusher_stop = true;
+    }
+    _flush_cv.notify_one();
+    _flusher.join();
+}
+
+void Disk::_flush_loop() {
+    std::unique_lock<std::mutex> lock(_dirty_mutex);
+
+    while(!_flusher_stop) {
+        // sleep an interval, or until the dirty ratio is reached
+        _flush_cv.wait_for(
+            lock, std::chrono::milliseconds(_flush_interval), [this] {
+                return _flusher_stop || _over_ratio();
+            });
+        if(_flusher_stop) break;
+
+        lock.unlock();
+        flush();
+        lock.lock();
+    }
+}
+
+bool Disk::_over_ratio() const {
+    return _dirty.count() > 0 &&
+           _dirty.count() * 100 >= _dirty_ratio * _dirty.size();
+}
+
+bool Disk::_transfer(std::size_t offset, std::size_t len,
+                     bool is_write) const {
+    std::size_t end = offset + len, done = offset;
+
+    if(_backend == MMAP || len == 0) return true;
+
+    // whole pages of the file go direct, the partial last page buffered
+    if(_backend == DIRECT) {
+        std::size_t first = offset / DIRECT_ALIGN * DIRECT_ALIGN;
+        std::size_t last = std::min(
+            (end + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN,
+            _physical_bytes / DIRECT_ALIGN * DIRECT_ALIGN);
+
+        if(last > first) {
+            if(!_io(_direct_fd, first, last - first, is_write)) return false;
+            done = last;
+        }
+    }
+
+    return end <= done || _io(_fd, done, end - done, is_write);
+}
+
+bool Disk::_load(std::size_t offset, std::size_t len,
+                 bool is_overwrite) const {
+    std::size_t end = std::min(offset + len, _physical_bytes);
+    std::size_t first = offset / DIRECT_ALIGN, page = first, run = 0;
+
+    if(_backend == MMAP || offset >= end) return true;
+
+    std::size_t last = (end - 1) / DIRECT_ALIGN;
+
+    // loaded pages are never read again, most accesses stop here
+    while(page <= last && _page_loaded(page)) ++page;
+    if(page > last) return true;
+
+    std::lock_guard<std::mutex> lock(_load_mutex);
+
+    // read each run of pages not loaded, skipping pages the caller fills
+    for(page = first; page <= last + 1; ++page) {
+        std::size_t start = page * DIRECT_ALIGN;
+        bool is_whole = is_overwrite && start >= offset &&
+                        std::min(start + DIRECT_ALIGN, _physical_bytes) <= end;
+        bool is_needed = page <= last && !_page_loaded(page) && !is_whole;
+
+        if(is_needed) {
+            ++run;
+            continue;
+        }
+
+        if(run > 0) {
+            std::size_t from = (page - run) * DIRECT_ALIGN;
+
+            if(!_transfer(from, std::min(start, _physical_bytes) - from,
+                          false))
+                return false;
+        }
+
+        // a page is marked once read, or before its caller fills it
+        for(std::size_t p = page - run; p < page; ++p)
+            _loaded[p / 64].fetch_or(uint64_t(1) << (p % 64),
+                                     std::memory_order_release);
+        if(page <= last && is_whole)
+            _loaded[page / 64].fetch_or(uint64_t(1) << (page % 64),
+                                        std::memory_order_release);
+        run = 0;
+    }
+    return true;
+}
+
+bool Disk::_page_loaded(std::size_t page) const {
+    return (_loaded[page / 64].load(std::memory_order_acquire) >>
+            (page % 64)) &
+           1;
+}
+
+bool Disk::_any_loaded(std::size_t offset, std::size_t len) const {
+    std::size_t end = std::min(offset + len, _physical_bytes);
+
+    if(_backend == MMAP) return true;
+
+    for(std::size_t page = offset / DIRECT_ALIGN;
+        page * DIRECT_ALIGN < end; ++page)
+        if(_page_loaded(page)) return true;
+    return false;
+}
+
+bool Disk::_write_loaded(std::size_t offset, std::size_t len) const {
+    std::size_t end = std::min(offset + len, _physical_bytes), from = offset;
+
+    // pages never loaded hold no change, the file has their bytes
+    while(from < end) {
+        std::size_t page = from / DIRECT_ALIGN, to = from;
+
+        if(!_page_loaded(page)) {
+            from = std::min((page + 1) * DIRECT_ALIGN, end);
+            continue;
+        }
+        while(to < end && _page_loaded(to / DIRECT_ALIGN))
+            to = std::min((to / DIRECT_ALIGN + 1) * DIRECT_ALIGN, end);
+
+        if(!_transfer(from, to - from, true)) return false;
+        from = to;
+    }
+    return true;
+}
+
+bool Disk::_io(int fd, std::size_t offset, std::size_t len,
+               bool is_write) const {
+    ssize_t n = 0;
+
+    while(len > 0) {
+        if(is_write)
+            n = pwrite(fd, _pfile + offset, len, offset);
+        else
+            n = pread(fd, _pfile + offset, len, offset);
+
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) return n == 0 && !is_write;  // end of file on read
+
+        offset += n;
+        len -= n;
+    }
+    return true;
 }
 
 }  // namespace fs
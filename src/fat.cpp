@@ -12,44 +12,57 @@ bool Entry::cmp_entry_name(const Entry &a, const Entry &b) {
     return a.name() < b.name();
 }
 
-Entry::Entry(char *address) { _reset_address(address); }
+Entry::Entry(char *address, bool is_wide) : _wide(is_wide), _generation(0) {
+    _reset_address(address);
+}
 
 bool Entry::has_parent() const { return dotdot() != Entry::ENDBLOCK; }
 
 bool Entry::valid() const { return _name != nullptr; }
 
+bool Entry::wide() const { return _wide; }
+
 Entry::operator bool() const { return _name != nullptr; }
 
 std::string Entry::name() const { return std::string(_name); }
 
-bool Entry::type() const { return *_type; }
+bool Entry::type() const { return __atomic_load_n(_type, __ATOMIC_RELAXED); }
 
-int Entry::dot() const { return *_dot; }
+long Entry::dot() const { return _get(_dot); }
 
-int Entry::dotdot() const { return *_dotdot; }
+long Entry::dotdot() const { return _get(_dotdot); }
 
-int Entry::size() const { return *_size; }
+long Entry::size() const { return _get(_size); }
 
-time_t Entry::created() const { return *_created; }
+time_t Entry::created() const {
+    return __atomic_load_n(_created, __ATOMIC_RELAXED);
+}
 
 time_t *Entry::created_ptr() const { return _created; }
 
 char *Entry::created_str() const { return std::ctime(_created); }
 
-time_t Entry::last_accessed() const { return *_last_accessed; }
+time_t Entry::last_accessed() const {
+    return __atomic_load_n(_last_accessed, __ATOMIC_RELAXED);
+}
 
 time_t *Entry::last_accessed_ptr() const { return _created; }
 
 char *Entry::last_accessed_str() const { return std::ctime(_last_accessed); }
 
-time_t Entry::last_modified() const { return *_last_modified; }
+time_t Entry::last_modified() const {
+    return __atomic_load_n(_last_modified, __ATOMIC_RELAXED);
+}
 
 time_t *Entry::last_modified_ptr() const { return _created; }
 
 char *Entry::last_modified_str() const { return std::ctime(_last_modified); }
 
+unsigned long Entry::generation() const { return _generation; }
+
 void Entry::init() {
     memset(_name, 0, Entry::MAX_NAME);
+    Journal::record(_name, Entry::MAX_NAME);
     set_type(Entry::DIR);
     set_dot(Entry::ENDBLOCK);
     set_dotdot(Entry::ENDBLOCK);
@@ -70,56 +83,99 @@ void Entry::set_name(std::string name) {
         strncpy(_name, name.c_str(), Entry::MAX_NAME - 1);
     else
         strncpy(_name, name.c_str(), name.size());
+    Journal::record(_name, Entry::MAX_NAME);
+}
+
+void Entry::set_type(bool type) {
+    __atomic_store_n(_type, type, __ATOMIC_RELAXED);
+    Journal::record(_type, sizeof(bool));
 }
 
-void Entry::set_type(bool type) { *_type = type; }
+void Entry::set_dot(long block) { _set(_dot, block); }
 
-void Entry::set_dot(int block) { *_dot = block; }
+void Entry::set_dotdot(long block) { _set(_dotdot, block); }
 
-void Entry::set_dotdot(int block) { *_dotdot = block; }
+void Entry::set_size(long size) { _set(_size, size); }
 
-void Entry::set_size(int size) { *_size = size; }
+void Entry::inc_size(long inc) { _add(_size, inc); }
 
-void Entry::inc_size(int inc) { *_size += inc; }
+void Entry::dec_size(long dec) { _add(_size, -dec); }
+
+void Entry::set_created(time_t t) {
+    __atomic_store_n(_created, t, __ATOMIC_RELAXED);
+    Journal::record(_created, sizeof(time_t));
+}
+
+void Entry::update_created() { set_created(std::time(nullptr)); }
+
+void Entry::set_last_accessed(time_t t) {
+    __atomic_store_n(_last_accessed, t, __ATOMIC_RELAXED);
+    Journal::record(_last_accessed, sizeof(time_t));
+}
+
+void Entry::update_last_accessed() { set_last_accessed(std::time(nullptr)); }
+
+void Entry::set_last_modified(time_t t) {
+    __atomic_store_n(_last_modified, t, __ATOMIC_RELAXED);
+    Journal::record(_last_modified, sizeof(time_t));
+}
 
-void Entry::dec_size(int dec) { *_size -= dec; }
+void Entry::update_last_modified() { set_last_modified(std::time(nullptr)); }
 
-void Entry::set_created(time_t t) { *_created = t; }
+void Entry::set_generation(unsigned long generation) {
+    _generation = generation;
+}
 
-void Entry::update_created() { *_created = std::time(_created); }
+// fields are read and written whole, so threads updating an entry's size or
+// timestamps under different locks never see a torn value
+long Entry::_get(const char *field) const {
+    if(_wide) return long(__atomic_load_n((int64_t *)field, __ATOMIC_RELAXED));
 
-void Entry::set_last_accessed(time_t t) { *_last_accessed = t; }
+    return long(__atomic_load_n((int *)field, __ATOMIC_RELAXED));
+}
 
-void Entry::update_last_accessed() {
-    *_last_accessed = std::time(_last_accessed);
+void Entry::_set(char *field, long value) {
+    if(_wide)
+        __atomic_store_n((int64_t *)field, value, __ATOMIC_RELAXED);
+    else
+        __atomic_store_n((int *)field, int(value), __ATOMIC_RELAXED);
+    Journal::record(field, _width());
 }
 
-void Entry::set_last_modified(time_t t) { *_last_modified = t; }
+void Entry::_add(char *field, long inc) {
+    if(_wide)
+        __atomic_fetch_add((int64_t *)field, inc, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add((int *)field, int(inc), __ATOMIC_RELAXED);
+    Journal::record(field, _width());
+}
 
-void Entry::update_last_modified() {
-    *_last_modified = std::time(_last_modified);
+std::size_t Entry::_width() const {
+    return _wide ? sizeof(int64_t) : sizeof(int);
 }
 
 void Entry::_reset_address(char *address) {
     _name = address;
     _type = (bool *)(_name + Entry::MAX_NAME);
-    _dot = (int *)(_type + 1);
-    _dotdot = _dot + 1;
-    _size = _dotdot + 1;
-    _created = (time_t *)(_size + 1);
+    _dot = (char *)(_type + 1);
+    _dotdot = _dot + _width();
+    _size = _dotdot + _width();
+    _created = (time_t *)(_size + _width());
     _last_accessed = _created + 1;
     _last_modified = _last_accessed + 1;
 }
 
-DirEntry::DirEntry(char *address) : Entry(address) { _init_dir(); }
+DirEntry::DirEntry(char *address, bool is_wide) : Entry(address, is_wide) {
+    _init_dir();
+}
 
 bool DirEntry::has_dirs() const { return dir_head() > Entry::ENDBLOCK; }
 
 bool DirEntry::has_files() const { return file_head() > Entry::ENDBLOCK; }
 
-int DirEntry::dir_head() const { return *_dir_head; }
+long DirEntry::dir_head() const { return _get(_dir_head); }
 
-int DirEntry::file_head() const { return *_file_head; }
+long DirEntry::file_head() const { return _get(_file_head); }
 
 void DirEntry::init() {
     Entry::init();
@@ -132,14 +188,14 @@ void DirEntry::clear() { DirEntry::_reset_address(nullptr); }
 
 void DirEntry::set_address(char *address) { DirEntry::_reset_address(address); }
 
-void DirEntry::set_dir_head(int cell) { *_dir_head = cell; }
+void DirEntry::set_dir_head(long cell) { _set(_dir_head, cell); }
 
-void DirEntry::set_file_head(int cell) { *_file_head = cell; }
+void DirEntry::set_file_head(long cell) { _set(_file_head, cell); }
 
 // set address offsets from Entry's last adddress
 void DirEntry::_init_dir() {
-    _dir_head = (int *)(_last_modified + 1);
-    _file_head = _dir_head + 1;
+    _dir_head = (char *)(_last_modified + 1);
+    _file_head = _dir_head + _width();
 }
 
 // reset all attribute addresses
@@ -148,18 +204,30 @@ void DirEntry::_reset_address(char *address) {
     _init_dir();
 }
 
-FileEntry::FileEntry(char *address) : Entry(address) { _init_file(); }
+FileEntry::FileEntry(char *address, bool is_wide) : Entry(address, is_wide) {
+    _init_file();
+}
+
+std::size_t FileEntry::bytes(bool is_wide) {
+    std::size_t width = is_wide ? sizeof(int64_t) : sizeof(int);
+
+    // name, type, 3 entry fields, 3 timestamps, 3 file fields
+    return Entry::MAX_NAME + sizeof(bool) + 6 * width + 3 * sizeof(time_t);
+}
 
 bool FileEntry::has_data() const { return data_head() > Entry::ENDBLOCK; }
 
-int FileEntry::data_head() const { return *_data_head; }
+long FileEntry::data_head() const { return _get(_data_head); }
 
-int FileEntry::data_size() const { return *_data_size; }
+long FileEntry::data_size() const { return _get(_data_size); }
+
+long FileEntry::data_tail() const { return _get(_data_tail); }
 
 void FileEntry::init() {
     Entry::init();
     set_type(Entry::FILE);
     set_data_head(Entry::ENDBLOCK);
+    set_data_tail(Entry::ENDBLOCK);
     set_data_size(0);
 }
 
@@ -169,17 +237,24 @@ void FileEntry::set_address(char *address) {
     FileEntry::_reset_address(address);
 }
 
-void FileEntry::set_data_head(int cell) { *_data_head = cell; }
+void FileEntry::set_data_head(long cell) { _set(_data_head, cell); }
+
+void FileEntry::set_data_tail(long cell) { _set(_data_tail, cell); }
 
-void FileEntry::set_data_size(int size) { *_data_size = size; }
+void FileEntry::set_data_size(long size) { _set(_data_size, size); }
 
-void FileEntry::inc_data_size(int size) { *_data_size += size; }
+void FileEntry::inc_data_size(long size) {
+    _set(_data_size, data_size() + size);
+}
 
-void FileEntry::dec_data_size(int size) { *_data_size -= size; }
+void FileEntry::dec_data_size(long size) {
+    _set(_data_size, data_size() - size);
+}
 
 void FileEntry::_init_file() {
-    _data_head = (int *)(_last_modified + 1);
-    _data_size = _data_head + 1;
+    _data_head = (char *)(_last_modified + 1);
+    _data_size = _data_head + _width();
+    _data_tail = _data_size + _width();
 }
 
 void FileEntry::_reset_address(char *address) {
@@ -198,13 +273,9 @@ char *DataEntry::data() { return _data; }
 void DataEntry::clear(std::size_t size) { memset(_data, 0, size); }
 
 std::size_t DataEntry::read(char *buf, std::size_t size, std::size_t limit) {
-    std::size_t bytes = 0;
-
-    while(bytes < limit && _data[bytes] != '\0' && bytes < size) {
-        buf[bytes] = _data[bytes];
-        ++bytes;
-    }
+    std::size_t bytes = size < limit ? size : limit;
 
+    memcpy(buf, _data, bytes);
     return bytes;
 }
 
@@ -250,8 +321,7 @@ std::size_t DataEntry::append(const char *src, std::size_t size,
     } else {
         memcpy(data, src, size);
 
-        if(is_nullfill)
-            while(size < limit) data[size++] = '\0';
+        if(is_nullfill) memset(data + size, 0, avail - size);
 
         return size;
     }
@@ -259,59 +329,95 @@ std::size_t DataEntry::append(const char *src, std::size_t size,
 
 std::size_t DataEntry::append(char *src, std::size_t size, std::size_t offset,
                               std::size_t limit, bool is_nullfill) {
-    std::size_t avail = limit - offset;
-
-    if(size > avail) {
-        memcpy(_data + offset, src, avail);
-        return avail;
-    } else {
-        memcpy(_data + offset, src, avail);
-
-        if(is_nullfill)
-            while(size < limit) _data[size++] = '\0';
-
-        return size;
-    }
+    return append((const char *)src, size, offset, limit, is_nullfill);
 }
 
-FatCell::FatCell(char *address) : _next_cell((int *)(address)) {}
+FatCell::FatCell(char *address, bool is_wide)
+    : _next_cell(address), _wide(is_wide) {}
 
 bool FatCell::has_next() const {
-    return _next_cell != nullptr && *_next_cell > END;
+    return _next_cell != nullptr && next_cell() > END;
 }
 
-bool FatCell::free() const { return *_next_cell <= FREE; }
+bool FatCell::free() const { return next_cell() <= FREE; }
 
-bool FatCell::used() const { return *_next_cell > FREE; }
+bool FatCell::used() const { return next_cell() > FREE; }
 
 bool FatCell::valid() const { return _next_cell != nullptr; }
 
 FatCell::operator bool() const { return _next_cell != nullptr; }
 
-int FatCell::next_cell() const { return *_next_cell; }
+long FatCell::next_cell() const {
+    if(_wide)
+        return long(__atomic_load_n((int64_t *)_next_cell, __ATOMIC_RELAXED));
 
-void FatCell::set_free() { *_next_cell = FREE; }
+    return long(__atomic_load_n((int *)_next_cell, __ATOMIC_RELAXED));
+}
 
-void FatCell::set_next_cell(int c) { *_next_cell = c; }
+void FatCell::set_free() { set_next_cell(FREE); }
 
-Fat::Fat(char *address, int cells, int cell_offset)
-    : _file(address), _cells(cells), _cell_offset(cell_offset) {}
+void FatCell::set_next_cell(long c) {
+    if(_wide)
+        __atomic_store_n((int64_t *)_next_cell, c, __ATOMIC_RELAXED);
+    else
+        __atomic_store_n((int *)_next_cell, int(c), __ATOMIC_RELAXED);
+    Journal::record(_next_cell, _wide ? WIDE_SIZE : SIZE);
+}
+
+Fat::Fat(char *address, long cells, long cell_offset, bool is_wide)
+    : _file(address),
+      _cells(cells),
+      _cell_offset(cell_offset),
+      _wide(is_wide),
+      _policy(Fat::FIRST_FIT),
+      _cache(nullptr),
+      _shard_count(0),
+      _shard_cells(0),
+      _free_count(0) {}
+
+Fat::Fat(Fat &&other) : Fat() { *this = std::move(other); }
+
+Fat &Fat::operator=(Fat &&other) {
+    if(this != &other) {
+        _file = other._file;
+        _cells = other._cells;
+        _cell_offset = other._cell_offset;
+        _wide = other._wide;
+        _policy = other._policy;
+        _cache = other._cache;
+        _shards = std::move(other._shards);
+        _shard_count = other._shard_count;
+        _shard_cells = other._shard_cells;
+        _free_count = other._free_count.load();
+
+        other._shard_count = 0;
+        other._free_count = 0;
+    }
+    return *this;
+}
 
 Fat::~Fat() {}
 
 bool Fat::create() {
     if(_file) {
-        char *file = _file;
-        FatCell cell;
-
-        for(int i = 0; i < _cells; ++i) {
-            cell = FatCell(file);
-            cell.set_free();
-            file += FatCell::SIZE;
-
-            _free.emplace(_cell_offset + i);  // populate free cell list
+        int64_t wide_free = FatCell::FREE;
+        int narrow_free = FatCell::FREE;
+
+        // written whole by the filesystem's format, not recorded by cell
+        for(long i = 0; i < _cells; ++i) {
+            if(_wide)
+                memcpy(_file + i * FatCell::WIDE_SIZE, &wide_free,
+                       FatCell::WIDE_SIZE);
+            else
+                memcpy(_file + i * FatCell::SIZE, &narrow_free,
+                       FatCell::SIZE);
         }
 
+        // populate free cell map
+        _init_shards();
+        for(std::size_t i = 0; i < _shard_count; ++i) _shards[i].free.set_all();
+        _free_count = _cells;
+
         return true;
     } else
         return false;
@@ -321,41 +427,412 @@ bool Fat::open() {
     if(_file) {
         FatCell cell;
         char *file = _file;
+        std::size_t cell_size = _wide ? FatCell::WIDE_SIZE : FatCell::SIZE;
+        long free_count = 0;
+
+        _init_shards();
+
+        for(long i = 0; i < _cells; ++i) {
+            cell = FatCell(file, _wide);
+            file += cell_size;
+
+            // populate free cell map
+            if(cell.free()) {
+                Shard &shard = _shard_of(i);
+
+                shard.free.set(i - shard.first);
+                ++free_count;
+            }
+        }
+        _free_count = free_count;
+
+        return true;
+    } else
+        return false;
+}
 
-        for(int i = 0; i < _cells; ++i) {
-            cell = FatCell(file);
-            file += FatCell::SIZE;
+bool Fat::open(const char *free_map, std::size_t free_count) {
+    if(_file && free_map) {
+        std::size_t count = 0;
 
-            // populate free cell list
-            if(cell.free()) _free.emplace(i + _cell_offset);
+        // shards start on bitmap words, so each loads its words of the map
+        _init_shards();
+        for(std::size_t i = 0; i < _shard_count; ++i) {
+            Shard &shard = _shards[i];
+
+            shard.free.load(free_map + shard.first / 8, shard.free.size());
+            count += shard.free.count();
         }
+        _free_count = count;
+
+        // persisted map does not agree with its summary, so rescan
+        if(count != free_count) return open();
+
         return true;
     } else
         return false;
 }
 
+void Fat::store(char *free_map) const {
+    for(std::size_t i = 0; i < _shard_count; ++i) {
+        std::lock_guard<std::mutex> lock(_shards[i].mutex);
+
+        _shards[i].free.store(free_map + _shards[i].first / 8);
+    }
+}
+
+std::size_t Fat::map_size(long cells) { return Bitmap::bytes_for(cells); }
+
 void Fat::remove() {
     _file = nullptr;
     _cells = _cell_offset = 0;
-    _free.clear();
+    _shards.reset();
+    _shard_count = 0;
+    _free_count = 0;
 }
 
 bool Fat::valid() const { return _file != nullptr; }
 
 Fat::operator bool() const { return _file != nullptr; }
 
-std::size_t Fat::size() const { return _free.size(); }
+std::size_t Fat::size() const { return _free_count; }
 
-std::size_t Fat::full() const { return _free.size() == 0; }
+std::size_t Fat::full() const { return _free_count == 0; }
 
-FatCell Fat::get_cell(int index) const {
-    if((index - _cell_offset) > -1 && (index - _cell_offset) < _cells)
-        return FatCell(_file + (index - _cell_offset) * FatCell::SIZE);
-    else
+FatCell Fat::get_cell(long index, bool dirty) const {
+    std::size_t cell_size = _wide ? FatCell::WIDE_SIZE : FatCell::SIZE;
+    char *address = nullptr;
+
+    if((index - _cell_offset) > -1 && (index - _cell_offset) < _cells) {
+        address = _file + (index - _cell_offset) * cell_size;
+        if(_cache) _cache->access(address, CacheModel::FAT, dirty);
+
+        return FatCell(address, _wide);
+    } else
         return FatCell(nullptr);
 }
 
-FatFS::FatFS(Disk *disk) : _disk(disk) {}
+void Fat::set_cache(CacheModel *cache) { _cache = cache; }
+
+bool Fat::is_free(long block) const {
+    long cell = block - _cell_offset;
+
+    if(cell < 0 || cell >= _cells) return false;
+
+    Shard &shard = _shard_of(cell);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    return shard.free.test(cell - shard.first);
+}
+
+long Fat::next_free(long from) const {
+    long cell = from > _cell_offset ? from - _cell_offset : 0;
+
+    if(cell >= _cells) return FatCell::END;
+
+    for(std::size_t i = cell / _shard_cells; i < _shard_count; ++i) {
+        Shard &shard = _shards[i];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        long found =
+            shard.free.find_next(cell > shard.first ? cell - shard.first : 0);
+
+        if(found != Bitmap::NPOS) return shard.first + found + _cell_offset;
+    }
+    return FatCell::END;
+}
+
+long Fat::free_run(long n, long from) const {
+    long cell = from > _cell_offset ? from - _cell_offset : 0;
+
+    if(cell >= _cells) return FatCell::END;
+
+    for(std::size_t i = cell / _shard_cells; i < _shard_count; ++i) {
+        Shard &shard = _shards[i];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        long found = shard.free.find_run(
+            n, cell > shard.first ? cell - shard.first : 0);
+
+        if(found != Bitmap::NPOS) return shard.first + found + _cell_offset;
+    }
+    return FatCell::END;
+}
+
+long Fat::allocate() {
+    std::size_t home = _home();
+
+    // lowest free block of the first shard from home that has one
+    for(std::size_t i = 0; i < _shard_count; ++i) {
+        Shard &shard = _shards[(home + i) % _shard_count];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        long found = shard.free.find_next();
+
+        if(found != Bitmap::NPOS) {
+            shard.free.reset(found);
+            --_free_count;
+
+            return shard.first + found + _cell_offset;
+        }
+    }
+    throw std::runtime_error("Disk size full");
+}
+
+void Fat::take(long block) {
+    Shard &shard = _shard_of(block - _cell_offset);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    long cell = block - _cell_offset - shard.first;
+
+    if(shard.free.test(cell)) {
+        shard.free.reset(cell);
+        --_free_count;
+    }
+}
+
+void Fat::release(long block) {
+    Shard &shard = _shard_of(block - _cell_offset);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    long cell = block - _cell_offset - shard.first;
+
+    if(!shard.free.test(cell)) {
+        shard.free.set(cell);
+        ++_free_count;
+    }
+}
+
+long Fat::allocate_run(long n, long &taken, long hint) {
+    long cell = hint - _cell_offset, start = Bitmap::NPOS;
+    std::size_t home = _home();
+
+    if(_free_count == 0) throw std::runtime_error("Disk size full");
+
+    if(n < 1) n = 1;
+
+    // extend from hint block if it is free
+    if(hint != FatCell::END && cell > -1 && cell < _cells) {
+        Shard &shard = _shard_of(cell);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        if(shard.free.test(cell - shard.first)) {
+            taken = _take_run(shard, cell - shard.first, n);
+            return hint;
+        }
+    }
+
+    if(_policy == Fat::SINGLE) n = 1;
+
+    // run by policy in the first shard from home that has one
+    for(std::size_t i = 0; i < _shard_count; ++i) {
+        Shard &shard = _shards[(home + i) % _shard_count];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        start = _fit_run(shard, n);
+        if(start != Bitmap::NPOS) {
+            taken = _take_run(shard, start, n);
+            return shard.first + start + _cell_offset;
+        }
+    }
+
+    // no run fits, so take the largest free run of the shard that has it,
+    // searching again if another thread took it meanwhile
+    while(_free_count > 0) {
+        std::size_t shard_index = 0;
+        long best = Bitmap::NPOS, largest = Bitmap::NPOS, largest_len = 0;
+
+        for(std::size_t i = 0; i < _shard_count; ++i) {
+            Shard &shard = _shards[(home + i) % _shard_count];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            _find_runs(shard.free, n, best, largest);
+            if(largest != Bitmap::NPOS &&
+               long(shard.free.run_length(largest, n)) > largest_len) {
+                largest_len = shard.free.run_length(largest, n);
+                shard_index = (home + i) % _shard_count;
+            }
+        }
+
+        if(largest_len == 0) break;
+
+        Shard &shard = _shards[shard_index];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        _find_runs(shard.free, n, best, largest);
+        if(largest != Bitmap::NPOS) {
+            taken = _take_run(shard, largest, n);
+            return shard.first + largest + _cell_offset;
+        }
+    }
+    throw std::runtime_error("Disk size full");
+}
+
+int Fat::policy() const { return _policy; }
+
+void Fat::set_policy(int policy) {
+    if(policy < Fat::SINGLE || policy > Fat::BEST_FIT)
+        throw std::out_of_range("ERROR Invalid allocation policy");
+
+    _policy = policy;
+}
+
+std::size_t Fat::free_extents() const {
+    std::size_t extents = 0;
+
+    _for_each_run([&extents](long, long) { ++extents; });
+
+    return extents;
+}
+
+std::size_t Fat::largest_free_extent() const {
+    long largest = 0;
+
+    _for_each_run(
+        [&largest](long, long len) { largest = std::max(largest, len); });
+
+    return largest;
+}
+
+std::size_t Fat::shards() const { return _shard_count; }
+
+void Fat::_init_shards() {
+    long words = _cells > 0 ? (_cells + Bitmap::WORD_BITS - 1) /
+                                  Bitmap::WORD_BITS
+                            : 0;
+    long shard_words = (words + SHARDS - 1) / SHARDS;
+
+    // shards of whole words, the last one takes what is left
+    _shard_cells = shard_words * Bitmap::WORD_BITS;
+    _shard_count = words > 0 ? (words + shard_words - 1) / shard_words : 0;
+    _shards.reset(new Shard[_shard_count]);
+    _free_count = 0;
+
+    for(std::size_t i = 0; i < _shard_count; ++i) {
+        Shard &shard = _shards[i];
+
+        shard.first = i * _shard_cells;
+        shard.free.resize(std::min(_shard_cells, _cells - shard.first));
+        shard.next_fit = 0;
+    }
+}
+
+Fat::Shard &Fat::_shard_of(long cell) const {
+    return _shards[cell / _shard_cells];
+}
+
+std::size_t Fat::_home() const {
+    static std::atomic<std::size_t> threads(0);
+    static thread_local std::size_t thread = threads++;
+
+    // first thread to allocate starts at shard 0, as a single thread would
+    return _shard_count > 0 ? thread % _shard_count : 0;
+}
+
+long Fat::_take_run(Shard &shard, long start, long n) {
+    long taken = shard.free.run_length(start, n);
+
+    // reserve run
+    for(long i = 0; i < taken; ++i) shard.free.reset(start + i);
+
+    shard.next_fit = start + taken;
+    _free_count -= taken;
+
+    return taken;
+}
+
+long Fat::_fit_run(Shard &shard, long n) const {
+    long start = Bitmap::NPOS, best = Bitmap::NPOS, largest = Bitmap::NPOS;
+
+    switch(_policy) {
+        case Fat::SINGLE:
+            start = shard.free.find_next();
+            break;
+        case Fat::NEXT_FIT:
+            start = shard.free.find_run(n, shard.next_fit);
+            if(start == Bitmap::NPOS) start = shard.free.find_run(n);
+            break;
+        case Fat::BEST_FIT:
+            _find_runs(shard.free, n, best, largest);
+            start = best;
+            break;
+        default:  // FIRST_FIT
+            start = shard.free.find_run(n);
+            break;
+    }
+    return start;
+}
+
+void Fat::_for_each_run(const std::function<void(long, long)> &f) const {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    long run_start = Bitmap::NPOS, run_end = Bitmap::NPOS;
+
+    // shards are locked in order, so a whole map walk never deadlocks
+    for(std::size_t i = 0; i < _shard_count; ++i)
+        locks.emplace_back(_shards[i].mutex);
+
+    for(std::size_t i = 0; i < _shard_count; ++i) {
+        const Shard &shard = _shards[i];
+        long start = 0, end = 0, size = shard.free.size();
+
+        while(end < size &&
+              (start = shard.free.find_next(end)) != Bitmap::NPOS) {
+            end = shard.free.find_next_unset(start);
+            if(end == Bitmap::NPOS) end = size;
+
+            // a run reaching the end of a shard continues in the next
+            if(run_end == shard.first + start)
+                run_end = shard.first + end;
+            else {
+                if(run_start != Bitmap::NPOS) f(run_start, run_end - run_start);
+                run_start = shard.first + start;
+                run_end = shard.first + end;
+            }
+        }
+    }
+    if(run_start != Bitmap::NPOS) f(run_start, run_end - run_start);
+}
+
+void Fat::_find_runs(const Bitmap &free, std::size_t n, long &best,
+                     long &largest) {
+    long start = 0, end = 0, size = free.size();
+    std::size_t len = 0, best_len = 0, largest_len = 0;
+
+    best = largest = Bitmap::NPOS;
+
+    while(end < size && (start = free.find_next(end)) != Bitmap::NPOS) {
+        end = free.find_next_unset(start);
+        if(end == Bitmap::NPOS) end = size;
+
+        len = end - start;
+
+        // smallest run that fits
+        if(len >= n && (best == Bitmap::NPOS || len < best_len)) {
+            best = start;
+            best_len = len;
+        }
+
+        // largest run
+        if(len > largest_len) {
+            largest = start;
+            largest_len = len;
+        }
+    }
+}
+
+FatFS::FatFS(Disk *disk)
+    : _disk(disk),
+      _mount(0),
+      _logical_blocks(0),
+      _block_offset(0),
+      _version(0),
+      _wide(false),
+      _block_size(0),
+      _format_block_size(0),
+      _cache_mb(0),
+      _lazy_sizes(false),
+      _size_updates(0),
+      _dentry_count(0),
+      _dentry_hits(0),
+      _dentry_misses(0),
+      _last_generation(0) {}
+
+FatFS::~FatFS() { close_disk(); }
 
 bool FatFS::set_disk(Disk *disk) {
     if(disk && disk->valid()) {
@@ -369,34 +846,103 @@ bool FatFS::set_disk(Disk *disk) {
 
 bool FatFS::open_disk() {
     if(_disk && _disk->valid()) {
-        char *diskfile = _disk->file();
+        // int after fat offset is the narrow block offset, or the high half
+        // of the wide fat offset which is always 0
+        _wide = ((int *)_disk->data_at(0))[META_FAT_OFFSET + 1] == 0;
 
         // read FS metadata
-        int fat_offset = *(int *)diskfile;
-        diskfile += sizeof(fat_offset);
-
-        int block_offset = *(int *)diskfile;
-        diskfile += sizeof(_block_offset);
-
-        int logical_blocks = *(int *)diskfile;
+        long fat_offset = _meta(META_FAT_OFFSET);
+        long block_offset = _meta(META_BLOCK_OFFSET);
+        long logical_blocks = _meta(META_LOGICAL_BLOCKS);
 
         if(fat_offset > 0 && block_offset > 0 && logical_blocks > 0) {
             // error checks
-            if(fat_offset > FatFS::META_SZ) return false;
-            if(logical_blocks > (int)_disk->total_blocks()) return false;
-            if(((int)_disk->total_blocks() - logical_blocks) != block_offset)
+            if(fat_offset < FatFS::LEGACY_META_SZ) return false;
+
+            // unversioned disks have no free map
+            int version = 0;
+            if(fat_offset != FatFS::LEGACY_META_SZ) {
+                version = _meta(META_VERSION);
+
+                if(version < 1 || version > FatFS::VERSION) return false;
+            }
+
+            // disks before block size version use disk blocks
+            std::size_t block_size = _disk->max_block();
+            if(version >= FatFS::BLOCK_SIZE_VERSION)
+                block_size = _meta(META_BLOCK_SIZE);
+
+            if(block_size < _disk->max_block() ||
+               block_size % _disk->max_block() != 0)
+                return false;
+
+            _block_size = block_size;
+
+            if(std::size_t(fat_offset) >= block_offset * _block_size)
                 return false;
 
+            long total_blocks = _total_blocks();
+            if(logical_blocks > total_blocks) return false;
+            if((total_blocks - logical_blocks) != block_offset) return false;
+
             _block_offset = block_offset;
             _logical_blocks = logical_blocks;
+            _version = version;
+
+            // replay logged updates before the FAT is read
+            std::size_t replayed = 0;
+            _journal.detach();
+            if(_version >= FatFS::JOURNAL_VERSION) {
+                long journal_offset = _meta(META_JOURNAL_OFFSET);
+                long journal_blocks = _meta(META_JOURNAL_BLOCKS);
+
+                if(journal_blocks < 0 ||
+                   journal_offset + journal_blocks != block_offset ||
+                   std::size_t(journal_offset) * _block_size <
+                       std::size_t(fat_offset))
+                    return false;
+
+                _journal.attach(_disk, _block_size, journal_offset,
+                                journal_blocks);
+                replayed = _journal.replay();
+            }
+
+            char *fat_address = _metadata() + fat_offset;
+            _fat = Fat(fat_address, _logical_blocks, _block_offset, _wide);
+            _clear_caches();
 
-            char *fat_address = _disk->file() + fat_offset;
-            _fat = Fat(fat_address, _logical_blocks, _block_offset);
+            bool is_opened = false;
+
+            // load free map if disk was cleanly unmounted, else scan FAT
+            if(_version > 0 && _meta(META_CLEAN) == 1 && replayed == 0) {
+                std::size_t map_offset = _meta(META_FREE_MAP_OFFSET);
+                std::size_t map_end =
+                    map_offset + Fat::map_size(logical_blocks);
+
+                if(map_offset >= std::size_t(fat_offset) &&
+                   map_end <= _block_offset * _block_size)
+                    is_opened = _fat.open(_metadata() + map_offset,
+                                          _meta(META_FREE_COUNT));
+                else
+                    is_opened = _fat.open();
+            } else
+                is_opened = _fat.open();
+
+            if(is_opened) {
+                _attach_cache();
 
-            if(_fat.open()) {
                 // root entry always at begining of block offset
                 // get root entry at block offset
-                _root = _current = DirEntry(_disk->data_at(block_offset));
+                _root = _dir_at(block_offset);
+                ++_mount;
+
+                // sizes may have unfolded deltas lost if not cleanly closed
+                if(_version > 0 && _meta(META_CLEAN) != 1)
+                    _rebuild_sizes_at(_root);
+
+                // disk is not clean until close_disk()
+                if(_version > 0) _set_meta(META_CLEAN, 0);
+                _commit();
 
                 return true;
             } else
@@ -407,42 +953,146 @@ bool FatFS::open_disk() {
         return false;
 }
 
-bool FatFS::format() {
+void FatFS::close_disk() {
+    if(valid()) {
+        _fold_sizes();
+        _commit();
+
+        // write back cached blocks before the disk is marked clean
+        _cache.unpin(_block_offset);
+        _cache.detach();
+
+        // persist free map and summary, then mark disk clean
+        if(_version > 0) {
+            std::size_t map_offset = _meta(META_FREE_MAP_OFFSET);
+            std::size_t map_end = map_offset + Fat::map_size(_logical_blocks);
+
+            _fat.store(_metadata() + map_offset);
+            _disk->mark_dirty(map_offset / _disk->max_block(),
+                              (map_end - 1) / _disk->max_block() -
+                                  map_offset / _disk->max_block() + 1);
+            _set_meta(META_FREE_COUNT, _fat.size());
+            _set_meta(META_CLEAN, 1);
+            _commit();
+
+            // shadow image home and durable, logged updates are no longer
+            // needed
+            _journal.checkpoint();
+        }
+
+        _journal.detach();
+        _fat.remove();
+        _clear_caches();
+        _root = DirEntry();
+        ++_mount;
+    }
+}
+
+bool FatFS::format(bool is_wide) {
     if(_disk && _disk->valid()) {
-        if(_disk->total_blocks() < 2)
+        // blocks are a cluster of disk blocks, default to one disk block
+        std::size_t block_size = _format_block_size;
+        if(block_size == 0) block_size = _disk->max_block();
+
+        if(block_size < _disk->max_block() ||
+           block_size % _disk->max_block() != 0)
+            throw std::invalid_argument(
+                "Block size must be a multiple of disk block size");
+
+        _block_size = block_size;
+
+        if(_total_blocks() < 2)
             throw std::length_error("Not enough disk blocks");
 
-        // calculate bytes of of FAT table
-        int initial_fat_sz = _disk->total_blocks() * FatCell::SIZE;
+        // disks too large for int sizes and block numbers must be wide
+        if(_disk->logical_bytes() >
+           (std::size_t)std::numeric_limits<int>::max())
+            is_wide = true;
+
+        if(_block_size < FileEntry::bytes(is_wide))
+            throw std::length_error("Disk block size too small for entries");
+
+        _wide = is_wide;
+
+        std::size_t meta_sz = _wide ? FatFS::WIDE_META_SZ : FatFS::META_SZ;
+        std::size_t cell_sz = _wide ? FatCell::WIDE_SIZE : FatCell::SIZE;
+
+        // calculate bytes of of FAT table and its free map
+        std::size_t initial_fat_sz = _total_blocks() * cell_sz;
+        std::size_t free_map_sz = Fat::map_size(_total_blocks());
+
+        // regions start on pages, small disks pack them to save blocks
+        std::size_t align = sizeof(int64_t);
+        if(_disk->logical_bytes() >= FatFS::ALIGN_MIN_SZ)
+            align = FatFS::PAGE_SZ;
 
-        // total bytes usage at start of disk with FatFS meta data
-        int total_meta_sz = initial_fat_sz + FatFS::META_SZ;
+        // FAT table and free map start aligned after meta data
+        std::size_t fat_offset = _align(meta_sz, align);
+        std::size_t map_offset = _align(fat_offset + initial_fat_sz, align);
+
+        // data blocks start aligned, at a multiple of block size
+        std::size_t data_align =
+            align / std::gcd(align, _block_size) * _block_size;
+
+        // journal starts aligned after free map, a sixteenth of the disk up
+        // to JOURNAL_MAX_SZ, in whole data alignments
+        long journal_offset =
+            _align(map_offset + free_map_sz, data_align) / _block_size;
+        long journal_step = data_align / _block_size;
+        long journal_blocks =
+            std::min<long>(_total_blocks() / 16,
+                           FatFS::JOURNAL_MAX_SZ / _block_size) /
+            journal_step * journal_step;
+
+        if(journal_blocks < Journal::MIN_BLOCKS) journal_blocks = 0;
 
         // get blocks offset to start data blocks in disk
-        _block_offset =
-            (total_meta_sz + _disk->max_block()) / _disk->max_block();
+        _block_offset = journal_offset + journal_blocks;
+
+        if(_block_offset + 1 > _total_blocks())
+            throw std::length_error("Not enough disk blocks");
 
         // available disk blocks for data
-        _logical_blocks = _disk->total_blocks() - _block_offset;
-
-        // write FS metadata: fat offset, logical block offset
-        // and number of logical blocks
-        char *diskfile = _disk->file();
-        int fat_offset = FatFS::META_SZ;
-        memcpy(diskfile, &fat_offset, sizeof(fat_offset));
-        diskfile += sizeof(fat_offset);
-        memcpy(diskfile, &_block_offset, sizeof(_block_offset));
-        diskfile += sizeof(_block_offset);
-        memcpy(diskfile, &_logical_blocks, sizeof(_logical_blocks));
+        _logical_blocks = _total_blocks() - _block_offset;
+        _version = FatFS::VERSION;
+
+        // write FS metadata: fat offset, logical block offset,
+        // number of logical blocks, version and free map location
+        _set_meta(META_FAT_OFFSET, fat_offset);
+        _set_meta(META_BLOCK_OFFSET, _block_offset);
+        _set_meta(META_LOGICAL_BLOCKS, _logical_blocks);
+        _set_meta(META_VERSION, _version);
+        _set_meta(META_FREE_MAP_OFFSET, map_offset);
+        _set_meta(META_BLOCK_SIZE, _block_size);
+        _set_meta(META_JOURNAL_OFFSET, journal_offset);
+        _set_meta(META_JOURNAL_BLOCKS, journal_blocks);
+
+        // empty journal, its shadow image takes the metadata written
+        _journal.attach(_disk, _block_size, journal_offset, journal_blocks);
+        _journal.format();
 
         // create FAT table in disk
-        char *fat_address = _disk->file() + FatFS::META_SZ;
-        _fat = Fat(fat_address, _logical_blocks, _block_offset);
+        char *fat_address = _metadata() + fat_offset;
+        _fat = Fat(fat_address, _logical_blocks, _block_offset, _wide);
         _fat.create();
+        _clear_caches();
+        _attach_cache();
+
+        // metadata, FAT table and free map are all rewritten
+        _disk->mark_dirty(0,
+                          _block_offset * (_block_size / _disk->max_block()));
 
         // initialize root entry
         _init_root();
 
+        // disk is mounted until close_disk()
+        _set_meta(META_FREE_COUNT, _fat.size());
+        _set_meta(META_CLEAN, 0);
+        _commit();
+
+        // FAT and free map are written whole, not logged
+        _journal.checkpoint();
+
         return true;
     } else
         return false;
@@ -453,18 +1103,31 @@ bool FatFS::valid() const {
 }
 
 void FatFS::remove_file_data(FileEntry &file) {
+    remove_file_data(_own_session(), file);
+}
+
+void FatFS::remove_file_data(const Session &session, FileEntry &file) {
+    if(session.read_only()) throw std::runtime_error("Read-only session");
+
+    LockTable::Guard lock = _lock_file(file, LockTable::EXCLUSIVE);
+
+    if(!lock.owns()) return;
+
     file.update_last_modified();
     _free_data_at(file);
+    _commit();
 }
 
 std::size_t FatFS::total_size() const {
     if(_disk)
-        return _logical_blocks * _disk->max_block();
+        return _logical_blocks * _block_size;
     else
         return 0;
 }
 
 std::size_t FatFS::size() const {
+    _flush_sizes();
+
     if(_root)
         return _root.size();
     else
@@ -473,7 +1136,7 @@ std::size_t FatFS::size() const {
 
 std::size_t FatFS::free_size() const {
     if(_disk)
-        return _fat.size() * _disk->max_block();
+        return _fat.size() * _block_size;
     else
         return 0;
 }
@@ -483,57 +1146,102 @@ bool FatFS::full() const { return _fat.size() == 0; }
 std::string FatFS::name() const { return _name; }
 
 std::string FatFS::info() const {
+    std::string journal = "none";
+
+    if(_journal.enabled()) journal = "on";
+
     return "Disk name: " + _name + '\n' + "Valid: " + std::to_string(valid()) +
-           '\n' + size_info();
+           '\n' + size_info() + '\n' + "Journal: " + journal;
 }
 
 std::string FatFS::size_info() const {
     return "Logical disk size: " + std::to_string(total_size()) + '\n' +
+           "Block size (bytes): " + std::to_string(_block_size) + '\n' +
            "Free space (bytes): " + std::to_string(free_size()) + '\n' +
            "Used space (bytes): " + std::to_string(size());
 }
 
-std::string FatFS::pwd() const {
-    std::string path;
-    DirEntry dir = _current;
+std::string FatFS::frag_info() const {
+    return "Free extents: " + std::to_string(free_extents()) + '\n' +
+           "Largest free extent (blocks): " +
+           std::to_string(largest_free_extent());
+}
 
-    if(dir) {
-        path = dir.name();
+std::string FatFS::cache_info() const {
+    std::unique_lock<std::mutex> lock(_dentry_mutex);
+    std::string info =
+        "Dentry cache entries: " + std::to_string(_dentry_count) + '\n' +
+        "Dentry cache hits: " + std::to_string(_dentry_hits) + '\n' +
+        "Dentry cache misses: " + std::to_string(_dentry_misses);
 
-        while(dir.dotdot() != FatCell::END) {
-            dir = DirEntry(_disk->data_at(dir.dotdot()));
+    lock.unlock();
+    if(_cache.enabled()) info += '\n' + _cache.info();
 
-            if(dir.name() != "/")
-                path = dir.name() + "/" + path;
-            else
-                path = dir.name() + path;
-        }
-    }
-    return path;
+    return info;
 }
 
-DirEntry FatFS::current() const { return _current; }
+std::size_t FatFS::dentry_hits() const {
+    std::lock_guard<std::mutex> lock(_dentry_mutex);
+    return _dentry_hits;
+}
 
-void FatFS::print_dirs(std::ostream &outs, std::string path,
-                       bool is_details) const {
-    using namespace style;
+std::size_t FatFS::dentry_misses() const {
+    std::lock_guard<std::mutex> lock(_dentry_mutex);
+    return _dentry_misses;
+}
 
-    struct tm *tm_info;
-    std::size_t max_name_len = 0, max_byte_len = 0;
-    DirEntry dir;
-    std::list<std::string> entries_path;
-    DirSet entries(Entry::cmp_entry_name);
+std::string FatFS::pwd() const { return pwd(_own_session()); }
 
-    // tokenize a path string to list of named entries
+std::string FatFS::pwd(const Session &session) const {
+    if(!valid()) return "";
+
+    // path was cached by change_dir() of this mount
+    return session._mount == _mount ? session._path : "/";
+}
+
+DirEntry FatFS::current() const { return current(_own_session()); }
+
+DirEntry FatFS::current(const Session &session) const {
+    return _cwd_of(session);
+}
+
+void FatFS::print_dirs(std::ostream &outs, std::string path,
+                       bool is_details) const {
+    print_dirs(_own_session(), outs, path, is_details);
+}
+
+void FatFS::print_files(std::ostream &outs, std::string path,
+                        bool is_details) const {
+    print_files(_own_session(), outs, path, is_details);
+}
+
+void FatFS::print_all(std::ostream &outs, std::string path,
+                      bool is_details) const {
+    print_all(_own_session(), outs, path, is_details);
+}
+
+void FatFS::print_dirs(const Session &session, std::ostream &outs,
+                       std::string path, bool is_details) const {
+    using namespace style;
+
+    struct tm tm_info;
+    std::size_t max_name_len = 0, max_byte_len = 0;
+    DirEntry dir;
+    LockTable::Guard lock;
+    std::list<std::string> entries_path;
+    DirSet entries(Entry::cmp_entry_name);
+
+    // tokenize a path string to list of named entries
     _tokenize_path(path, entries_path);
 
-    // find a valid end point of the path of named entries
-    dir = _parse_dir_entries(entries_path);
+    // find a valid end point of the path of named entries, held shared
+    dir = _parse_dir_entries(session, entries_path, lock);
 
     // get an ordered set of DirEntry by comparator
     _dirs_at(dir, entries);
 
-    // find max name column size
+    // fold pending sizes and find max name column size
+    if(is_details) _flush_sizes();
     if(is_details)
         _find_entries_len_details(entries, max_name_len, max_byte_len);
 
@@ -547,34 +1255,36 @@ void FatFS::print_dirs(std::ostream &outs, std::string path,
         if(is_details) {
             outs << std::right << std::setw(max_byte_len) << it->size();
 
-            tm_info = std::localtime(it->last_modified_ptr());
-            outs << ' ' << std::put_time(tm_info, "%b %d %H:%M");
+            localtime_r(it->last_modified_ptr(), &tm_info);
+            outs << ' ' << std::put_time(&tm_info, "%b %d %H:%M");
         }
         auto next = it;
         if(++next != entries.end()) outs << '\n';
     }
 }
 
-void FatFS::print_files(std::ostream &outs, std::string path,
-                        bool is_details) const {
+void FatFS::print_files(const Session &session, std::ostream &outs,
+                        std::string path, bool is_details) const {
     using namespace style;
 
-    struct tm *tm_info;
+    struct tm tm_info;
     std::size_t max_name_len = 0, max_byte_len = 0;
     DirEntry dir;
+    LockTable::Guard lock;
     std::list<std::string> entries_path;
     FileSet entries(Entry::cmp_entry_name);
 
     // tokenize a path string to list of named entries
     _tokenize_path(path, entries_path);
 
-    // find a valid end point of the path of named entries
-    dir = _parse_dir_entries(entries_path);
+    // find a valid end point of the path of named entries, held shared
+    dir = _parse_dir_entries(session, entries_path, lock);
 
     // get an ordered set of FileEntry by comparator
     _files_at(dir, entries);
 
-    // find max name column size
+    // fold pending sizes and find max name column size
+    if(is_details) _flush_sizes();
     if(is_details)
         _find_entries_len_details(entries, max_name_len, max_byte_len);
 
@@ -587,34 +1297,36 @@ void FatFS::print_files(std::ostream &outs, std::string path,
         if(is_details) {
             outs << std::right << std::setw(max_byte_len) << it->size();
 
-            tm_info = std::localtime(it->last_modified_ptr());
-            outs << ' ' << std::put_time(tm_info, "%b %d %H:%M");
+            localtime_r(it->last_modified_ptr(), &tm_info);
+            outs << ' ' << std::put_time(&tm_info, "%b %d %H:%M");
         }
         auto next = it;
         if(++next != entries.end()) outs << '\n';
     }
 }
 
-void FatFS::print_all(std::ostream &outs, std::string path,
-                      bool is_details) const {
+void FatFS::print_all(const Session &session, std::ostream &outs,
+                      std::string path, bool is_details) const {
     using namespace style;
 
-    struct tm *tm_info;
+    struct tm tm_info;
     std::size_t max_name_len = 0, max_byte_len = 0;
     DirEntry dir;
+    LockTable::Guard lock;
     std::list<std::string> path_entries;
     EntrySet entries(Entry::cmp_entry);
 
     // tokenize a path string to list of named entries
     _tokenize_path(path, path_entries);
 
-    // find a valid end point of the path of named entries
-    dir = _parse_dir_entries(path_entries);
+    // find a valid end point of the path of named entries, held shared
+    dir = _parse_dir_entries(session, path_entries, lock);
 
     // get an ordered set of Entry by comparator
     _entries_at(dir, entries);
 
-    // find max name column size
+    // fold pending sizes and find max name column size
+    if(is_details) _flush_sizes();
     if(is_details)
         _find_entries_len_details(entries, max_name_len, max_byte_len);
 
@@ -631,8 +1343,8 @@ void FatFS::print_all(std::ostream &outs, std::string path,
         if(is_details) {
             outs << std::right << std::setw(max_byte_len) << it->size();
 
-            tm_info = std::localtime(it->last_modified_ptr());
-            outs << ' ' << std::put_time(tm_info, "%b %d %H:%M");
+            localtime_r(it->last_modified_ptr(), &tm_info);
+            outs << ' ' << std::put_time(&tm_info, "%b %d %H:%M");
         }
         auto next = it;
         if(++next != entries.end()) outs << '\n';
@@ -640,21 +1352,70 @@ void FatFS::print_all(std::ostream &outs, std::string path,
 }
 
 void FatFS::remove() {
+    _cache.detach();
+    _journal.detach();
     if(_disk) _disk->remove();
     _fat.remove();
+    _clear_caches();
     _name.clear();
-    _root = _current = DirEntry();
+    _root = DirEntry();
+    ++_mount;
     _logical_blocks = 0;
     _block_offset = 0;
+    _version = 0;
+    _block_size = 0;
 }
 
 void FatFS::set_name(std::string name) { _name = name; }
 
+bool FatFS::lazy_sizes() const { return _lazy_sizes; }
+
+void FatFS::set_lazy_sizes(bool is_lazy) {
+    if(!is_lazy) flush_sizes();
+    _lazy_sizes = is_lazy;
+}
+
+void FatFS::flush_sizes() { _flush_sizes(); }
+
 DirEntry FatFS::add_dir(std::string path) {
+    return add_dir(_own_session(), path);
+}
+
+FileEntry FatFS::add_file(std::string path) {
+    return add_file(_own_session(), path);
+}
+
+bool FatFS::delete_dir(std::string path) {
+    return delete_dir(_own_session(), path);
+}
+
+bool FatFS::delete_file(std::string path) {
+    return delete_file(_own_session(), path);
+}
+
+bool FatFS::change_dir(std::string path) {
+    Session session = _own_session();
+
+    if(!change_dir(session, path)) return false;
+
+    std::lock_guard<std::mutex> lock(_session_mutex);
+    _session = session;
+
+    return true;
+}
+
+FileEntry FatFS::find_file(std::string path) const {
+    return find_file(_own_session(), path);
+}
+
+DirEntry FatFS::add_dir(const Session &session, std::string path) {
     DirEntry dir, added_dir;
+    LockTable::Guard lock;
     std::list<std::string> entries;
     std::string add_name;
 
+    if(session.read_only()) throw std::runtime_error("Read-only session");
+
     // tokenize a path string to list of named entries
     _tokenize_path(path, entries);
 
@@ -662,8 +1423,8 @@ DirEntry FatFS::add_dir(std::string path) {
     add_name = entries.back();
     entries.pop_back();
 
-    // find a valid end point of the path of named entries
-    dir = _parse_dir_entries(entries);
+    // find a valid end point of the path of named entries, held exclusive
+    dir = _parse_dir_entries(session, entries, lock, LockTable::EXCLUSIVE);
 
     try {
         if(dir) {
@@ -680,12 +1441,15 @@ DirEntry FatFS::add_dir(std::string path) {
     }
 }
 
-FileEntry FatFS::add_file(std::string path) {
+FileEntry FatFS::add_file(const Session &session, std::string path) {
     DirEntry dir;
     FileEntry added_file;
+    LockTable::Guard lock;
     std::list<std::string> entries;
     std::string add_name;
 
+    if(session.read_only()) throw std::runtime_error("Read-only session");
+
     // tokenize a path string to list of named entries
     _tokenize_path(path, entries);
 
@@ -693,8 +1457,8 @@ FileEntry FatFS::add_file(std::string path) {
     add_name = entries.back();
     entries.pop_back();
 
-    // find a valid end point of the path of named entries
-    dir = _parse_dir_entries(entries);
+    // find a valid end point of the path of named entries, held exclusive
+    dir = _parse_dir_entries(session, entries, lock, LockTable::EXCLUSIVE);
 
     try {
         if(dir) {
@@ -711,11 +1475,14 @@ FileEntry FatFS::add_file(std::string path) {
     }
 }
 
-bool FatFS::delete_dir(std::string path) {
+bool FatFS::delete_dir(const Session &session, std::string path) {
     DirEntry dir;
+    LockTable::Guard lock;
     std::list<std::string> entries;
     std::string remove_name;
 
+    if(session.read_only()) return false;
+
     // tokenize a path string to list of named entries
     _tokenize_path(path, entries);
 
@@ -723,17 +1490,20 @@ bool FatFS::delete_dir(std::string path) {
     remove_name = entries.back();
     entries.pop_back();
 
-    // find a valid end point of the path of named entries
-    dir = _parse_dir_entries(entries);
+    // find a valid end point of the path of named entries, held exclusive
+    dir = _parse_dir_entries(session, entries, lock, LockTable::EXCLUSIVE);
 
     return _delete_dir_at(dir, remove_name);
 }
 
-bool FatFS::delete_file(std::string path) {
+bool FatFS::delete_file(const Session &session, std::string path) {
     DirEntry dir;
+    LockTable::Guard lock;
     std::list<std::string> entries;
     std::string remove_name;
 
+    if(session.read_only()) return false;
+
     // tokenize a path string to list of named entries
     _tokenize_path(path, entries);
 
@@ -741,33 +1511,39 @@ bool FatFS::delete_file(std::string path) {
     remove_name = entries.back();
     entries.pop_back();
 
-    // find a valid end point of the path of named entries
-    dir = _parse_dir_entries(entries);
+    // find a valid end point of the path of named entries, held exclusive
+    dir = _parse_dir_entries(session, entries, lock, LockTable::EXCLUSIVE);
 
     return _delete_file_at(dir, remove_name);
 }
 
-bool FatFS::change_dir(std::string path) {
+bool FatFS::change_dir(Session &session, std::string path) {
     DirEntry dir;
+    LockTable::Guard lock;
     std::list<std::string> entries;
 
     // tokenize a path string to list of named entries
     _tokenize_path(path, entries);
 
-    // find a valid end point of the path of named entries
-    dir = _parse_dir_entries(entries);
+    // find a valid end point of the path of named entries, held shared
+    dir = _parse_dir_entries(session, entries, lock);
 
     if(dir) {
-        _current = dir;
-        _current.update_last_accessed();
+        // the session holds no lock once this returns, so its directory
+        // may be deleted and its block reused, which the generation tells
+        session._cwd = dir.dot();
+        session._path = _path_of(dir);
+        session._mount = _mount;
+        session._generation = _generation_of(dir.dot());
 
         return true;
     } else
         return false;
 }
 
-FileEntry FatFS::find_file(std::string path) const {
+FileEntry FatFS::find_file(const Session &session, std::string path) const {
     DirEntry dir;
+    LockTable::Guard lock;
     std::list<std::string> entries;
     std::string find_name;
 
@@ -778,8 +1554,8 @@ FileEntry FatFS::find_file(std::string path) const {
     find_name = entries.back();
     entries.pop_back();
 
-    // find a valid end point of the path of named entries
-    dir = _parse_dir_entries(entries);
+    // find a valid end point of the path of named entries, held shared
+    dir = _parse_dir_entries(session, entries, lock);
 
     return _find_file_at(dir, find_name);
 }
@@ -787,30 +1563,37 @@ FileEntry FatFS::find_file(std::string path) const {
 std::size_t FatFS::read_file_data(FileEntry &file, char *data,
                                   std::size_t size) const {
     std::size_t bytes = 0;
+    long block = FatCell::END, start = FatCell::END, count = 0;
     FatCell datacell;
-    DataEntry data_entry;
 
     if(!_disk) throw std::runtime_error("No disk or filesystem");
 
-    if(file) {
-        std::size_t max_block = _disk->max_block();
-        file.update_last_accessed();
-
-        if(file.has_data()) {
-            // get first data entry from file's data pointer
-            data_entry = _disk->data_at(file.data_head());
-            bytes = data_entry.read(data, size, max_block);
+    LockTable::Guard lock = _lock_file(file, LockTable::SHARED);
 
-            // get next data block
-            datacell = _fat.get_cell(file.data_head());
+    if(lock.owns()) {
+        std::size_t max_block = _block_size;
 
-            // read the rest of the data entry links
-            while(datacell.has_next()) {
-                data_entry = _disk->data_at(datacell.next_cell());
-                bytes += data_entry.read(data + bytes, size, max_block);
+        // data size is the length of file data, read no more than it
+        if(size > (std::size_t)file.data_size()) size = file.data_size();
 
-                // get next data block
-                datacell = _fat.get_cell(datacell.next_cell());
+        if(file.has_data()) {
+            block = file.data_head();
+
+            while(bytes < size && block != FatCell::END) {
+                start = block;
+                count = 0;
+
+                // extend run while the chain links to the next block
+                do {
+                    ++count;
+                    datacell = _fat.get_cell(block);
+                    block = datacell.has_next() ? datacell.next_cell()
+                                                : long(FatCell::END);
+                } while(block == start + count &&
+                        count * max_block < size - bytes);
+
+                bytes += _read_run(start, 0, data + bytes,
+                                   std::min(size - bytes, count * max_block));
             }
             return bytes;
         } else
@@ -821,82 +1604,73 @@ std::size_t FatFS::read_file_data(FileEntry &file, char *data,
 
 std::size_t FatFS::write_file_data(FileEntry &file, const char *data,
                                    std::size_t size) {
-    int freeindex, bytes_to_write = size, blocks = 0;
-    std::size_t bytes = 0;
-    FatCell freecell, prevcell;
+    return write_file_data(_own_session(), file, data, size);
+}
+
+std::size_t FatFS::write_file_data(const Session &session, FileEntry &file,
+                                   const char *data, std::size_t size) {
+    long blocks = 0, block = FatCell::END, last_block = FatCell::END;
+    std::size_t bytes = 0, bytes_to_write = size;
+    FatCell cell;
     DataEntry data_entry;
-    std::set<int>::iterator it;
 
+    if(session.read_only()) throw std::runtime_error("Read-only session");
     if(!_disk) throw std::runtime_error("No disk or filesystem");
 
-    if(_fat.full()) throw std::runtime_error("Disk size full");
-
-    if(file) {
-        if(size > (file.size() + _fat.size() * _disk->max_block()))
-            throw std::runtime_error("Not enough space to write data");
+    LockTable::Guard lock = _lock_file(file, LockTable::EXCLUSIVE);
 
+    if(lock.owns()) {
         std::size_t prev_file_size = file.size();
-        std::size_t max_block = _disk->max_block();
-
-        // update file entry timestamps
-        file.update_last_modified();
-
-        // free all associated data blocks before writing
-        _free_data_at(file);
-
-        // write first block of data and connect to file's data pointer
+        std::size_t max_block = _block_size;
 
-        // get a free cell to start writing
-        it = _fat.free_blocks().begin();
-        freeindex = *it;
-        _fat.free_blocks().erase(it);
-        freecell = _fat.get_cell(freeindex);
-        freecell.set_next_cell(FatCell::END);
+        // blocks needed for data, a data chain always has a first block
+        long blocks_needed = (size + max_block - 1) / max_block;
+        if(blocks_needed == 0) blocks_needed = 1;
 
-        // connect file's data pointer to freeindex
-        file.set_data_head(freeindex);
+        // only blocks past the existing chain take free space, so a same
+        // size or shrinking rewrite works on a full disk
+        long blocks_held = file.has_data() ? file.size() / max_block - 1 : 0;
+        long blocks_extra = blocks_needed - blocks_held;
 
-        // get DataEntry with freeindex
-        data_entry = _disk->data_at(freeindex);
-
-        // write first data block
-        bytes = data_entry.write(data, bytes_to_write, max_block);
-        bytes_to_write -= bytes;
-        data += bytes;
-        blocks += 1;
-
-        // write rest of data to data links
-        while(bytes_to_write > 0) {
-            // store previous cell
-            prevcell = freecell;
-
-            // get a free cell to start writing
-            it = _fat.free_blocks().begin();
-            freeindex = *it;
-            _fat.free_blocks().erase(it);
-            freecell = _fat.get_cell(freeindex);
-            freecell.set_next_cell(FatCell::END);
+        if(blocks_extra > 0) {
+            if(_fat.full()) throw std::runtime_error("Disk size full");
+            if(blocks_extra > long(_fat.size()))
+                throw std::runtime_error("Not enough space to write data");
+        }
 
-            // connect previous cell to freeindex
-            prevcell.set_next_cell(freeindex);
+        // update file entry timestamps
+        file.update_last_modified();
 
-            // get DataEntry with freeindex
-            data_entry = _disk->data_at(freeindex);
+        // overwrite existing data blocks in chain order
+        if(file.has_data()) block = file.data_head();
 
-            // write data blocks
+        while(block != FatCell::END && blocks < blocks_needed) {
+            data_entry = _data_at(block, CacheModel::DATA, true);
             bytes = data_entry.write(data, bytes_to_write, max_block);
             bytes_to_write -= bytes;
             data += bytes;
             blocks += 1;
+
+            last_block = block;
+            cell = _fat.get_cell(block);
+            block = cell.has_next() ? cell.next_cell() : long(FatCell::END);
         }
 
+        // free blocks past new data, or link new blocks for rest of data
+        if(block != FatCell::END)
+            _truncate_data_at(file, last_block);
+        else if(blocks < blocks_needed)
+            blocks += _alloc_data_at(file, last_block, data, bytes_to_write);
+
         // update file entry size for data
         file.set_data_size(size);
-        file.set_size(128 + blocks * _disk->max_block());
+        file.set_size(max_block + blocks * max_block);
+        _dirty(file.dot());
 
         // update parents size
-        _update_parents_size(DirEntry(_disk->data_at(file.dotdot())),
+        _update_parents_size(_dir_at(file.dotdot()),
                              file.size() - prev_file_size);
+        _commit();
 
         return size;
     } else
@@ -905,152 +1679,472 @@ std::size_t FatFS::write_file_data(FileEntry &file, const char *data,
 
 std::size_t FatFS::append_file_data(FileEntry &file, const char *data,
                                     std::size_t size) {
-    int freeindex, bytes_to_write = size, blocks = 0;
-    std::size_t bytes = 0;
-    FatCell nextcell, prevcell, sec_last;
+    return append_file_data(_own_session(), file, data, size);
+}
+
+std::size_t FatFS::append_file_data(const Session &session, FileEntry &file,
+                                    const char *data, std::size_t size) {
+    long last_block = FatCell::END, blocks = 0;
+    std::size_t bytes = 0, bytes_to_write = size;
     DataEntry data_entry;
-    std::set<int>::iterator it;
 
+    if(session.read_only()) throw std::runtime_error("Read-only session");
     if(!_disk) throw std::runtime_error("No disk or filesystem");
 
-    if(_fat.full()) throw std::runtime_error("Disk size full");
-
-    if(file) {
-        if(size > _fat.size() * _disk->max_block())
-            throw std::runtime_error("Not enough space to write data");
+    LockTable::Guard lock = _lock_file(file, LockTable::EXCLUSIVE);
 
+    if(lock.owns()) {
         std::size_t prev_file_size = file.size();
-        std::size_t max_block = _disk->max_block();
+        std::size_t max_block = _block_size;
+
+        // find offset
+        std::size_t append =
+            file.size() - _block_size - file.data_size();
+
+        // only data past the last block's room takes free blocks
+        long blocks_extra = 0;
+        if(size > append)
+            blocks_extra = (size - append + max_block - 1) / max_block;
+        else if(!file.has_data())
+            blocks_extra = 1;
+
+        if(blocks_extra > 0) {
+            if(_fat.full()) throw std::runtime_error("Disk size full");
+            if(blocks_extra > long(_fat.size()))
+                throw std::runtime_error("Not enough space to write data");
+        }
 
         // update file entry timestamps
         file.update_last_modified();
 
-        // find offset
-        std::size_t append =
-            file.size() - _disk->max_block() - file.data_size();
-
-        // if append is 0 size, then the last block is full
-        // so write a new data block
-        if(append == 0) {
-            // get a free cell to start writing
-            it = _fat.free_blocks().begin();
-            freeindex = *it;
-            _fat.free_blocks().erase(it);
-            nextcell = _fat.get_cell(freeindex);
-            nextcell.set_next_cell(FatCell::END);
-
-            // connect file's data pointer to freeindex
-            if(file.has_data())
-                _last_datacell_from(file).set_next_cell(freeindex);
-            else
-                file.set_data_head(freeindex);
+        if(file.has_data()) {
+            last_block = _last_datablock_from(file);
 
-            // get DataEntry with freeindex
-            data_entry = _disk->data_at(freeindex);
+            // if append is not 0 size, then the last block has room
+            if(append > 0) {
+                data_entry = _data_at(last_block, CacheModel::DATA, true);
 
-            // write first data block
-            bytes = data_entry.write(data, bytes_to_write, max_block);
-            bytes_to_write -= bytes;
-            data += bytes;
-            blocks += 1;
-        } else {
-            // get second last FatCell from file to get last index
-            sec_last = _sec_last_cell_from(file.data_head());
-
-            if(sec_last.has_next()) {
-                nextcell = _fat.get_cell(sec_last.next_cell());
-                data_entry = _disk->data_at(sec_last.next_cell());
-            } else {  // data_head is the only entry
-                nextcell = _fat.get_cell(file.data_head());
-                data_entry = _disk->data_at(file.data_head());
+                // get offset to continue writing from last non-nul char
+                std::size_t offset = _block_size - append;
+
+                // append data to this data entry
+                bytes =
+                    data_entry.append(data, bytes_to_write, offset, max_block);
+                bytes_to_write -= bytes;
+                data += bytes;
             }
+        }
 
-            // get offset to continue writing from last non-nul char
-            std::size_t offset = _disk->max_block() - append;
+        // write rest of data to new blocks, extending from last block
+        if(bytes_to_write > 0 || !file.has_data())
+            blocks = _alloc_data_at(file, last_block, data, bytes_to_write);
 
-            // append data to this data entry
-            bytes = data_entry.append(data, bytes_to_write, offset, max_block);
-            bytes_to_write -= bytes;
-            data += bytes;
+        // update file entry size for data
+        file.inc_data_size(size);
+        file.inc_size(blocks * _block_size);
+        _dirty(file.dot());
+
+        // update parents size
+        _update_parents_size(_dir_at(file.dotdot()),
+                             file.size() - prev_file_size);
+        _commit();
+
+        return size;
+    } else
+        return 0;
+}
+
+std::size_t FatFS::read_file_at(FileEntry &file, std::size_t offset,
+                                char *data, std::size_t size) const {
+    std::size_t bytes = 0, skip = 0, len = 0, i = 0, last = 0, count = 0;
+    std::vector<long> chain;
+
+    if(!_disk) throw std::runtime_error("No disk or filesystem");
+
+    LockTable::Guard lock = _lock_file(file, LockTable::SHARED);
+
+    if(lock.owns() && file.has_data() &&
+       offset < (std::size_t)file.data_size()) {
+        std::size_t max_block = _block_size;
+        std::size_t end = offset + size;
+
+        if(end > (std::size_t)file.data_size()) end = file.data_size();
+
+        // blocks of data chain from offset to end
+        std::size_t first = offset / max_block;
+        last = (end - 1) / max_block;
+        _chain_of(file, first, last, chain);
+
+        // read runs of contiguous blocks
+        for(i = 0; i <= last - first; i += count) {
+            for(count = 1; i + count <= last - first; ++count)
+                if(chain[i + count] != chain[i] + long(count)) break;
+
+            skip = offset % max_block;
+            len = std::min(count * max_block - skip, end - offset);
+
+            bytes += _read_run(chain[i], skip, data + bytes, len);
+            offset += len;
         }
+    }
+    return bytes;
+}
 
-        // write rest of data to data links
-        while(bytes_to_write > 0) {
-            // store previous cell
-            prevcell = nextcell;
+std::size_t FatFS::write_file_at(FileEntry &file, std::size_t offset,
+                                 const char *data, std::size_t size) {
+    return write_file_at(_own_session(), file, offset, data, size);
+}
 
-            // get a free cell to start writing
-            it = _fat.free_blocks().begin();
-            freeindex = *it;
-            _fat.free_blocks().erase(it);
-            nextcell = _fat.get_cell(freeindex);
-            nextcell.set_next_cell(FatCell::END);
+std::size_t FatFS::write_file_at(const Session &session, FileEntry &file,
+                                 std::size_t offset, const char *data,
+                                 std::size_t size) {
+    long blocks = 0, last_block = FatCell::END;
+    std::size_t bytes = 0, block_offset = 0, len = 0, capacity = 0;
+    std::vector<long> chain;
 
-            // connect previous cell to freeindex
-            prevcell.set_next_cell(freeindex);
+    if(session.read_only()) throw std::runtime_error("Read-only session");
+    if(!_disk) throw std::runtime_error("No disk or filesystem");
 
-            // get DataEntry with freeindex
-            data_entry = _disk->data_at(freeindex);
+    LockTable::Guard lock = _lock_file(file, LockTable::EXCLUSIVE);
 
-            // write data blocks
-            bytes = data_entry.write(data, bytes_to_write, max_block);
-            bytes_to_write -= bytes;
-            data += bytes;
-            blocks += 1;
+    if(lock.owns()) {
+        std::size_t max_block = _block_size;
+        std::size_t prev_file_size = file.size();
+        std::size_t end = offset + size;
+
+        if(offset > (std::size_t)file.data_size())
+            throw std::out_of_range("Offset past end of file");
+
+        // bytes of data blocks in file's chain
+        if(file.has_data()) capacity = file.size() - max_block;
+
+        if(end > capacity && end - capacity > _fat.size() * max_block)
+            throw std::runtime_error("Not enough space to write data");
+
+        // update file entry timestamps
+        file.update_last_modified();
+
+        // overwrite data in existing blocks
+        if(offset < capacity) {
+            std::size_t overwrite_end = std::min(end, capacity);
+            std::size_t first = offset / max_block;
+
+            _chain_of(file, first, (overwrite_end - 1) / max_block, chain);
+
+            while(offset < overwrite_end) {
+                block_offset = offset % max_block;
+                len =
+                    std::min(max_block - block_offset, overwrite_end - offset);
+
+                long block = chain[offset / max_block - first];
+
+                memcpy(_data_at(block, CacheModel::DATA, true) + block_offset,
+                       data + bytes, len);
+
+                bytes += len;
+                offset += len;
+            }
+        }
+
+        // write rest of data to new blocks, extending from last block
+        if(bytes < size || !file.has_data()) {
+            if(file.has_data()) last_block = _last_datablock_from(file);
+
+            blocks =
+                _alloc_data_at(file, last_block, data + bytes, size - bytes);
         }
 
         // update file entry size for data
-        file.inc_data_size(size);
-        file.inc_size(blocks * _disk->max_block());
+        if(end > (std::size_t)file.data_size()) file.set_data_size(end);
+        file.inc_size(blocks * max_block);
+        _dirty(file.dot());
 
         // update parents size
-        _update_parents_size(DirEntry(_disk->data_at(file.dotdot())),
+        _update_parents_size(_dir_at(file.dotdot()),
                              file.size() - prev_file_size);
+        _commit();
 
         return size;
     } else
         return 0;
 }
 
+std::size_t FatFS::file_extents(FileEntry &file) const {
+    std::size_t extents = 0;
+    long block = FatCell::END;
+    FatCell cell;
+    LockTable::Guard lock = _lock_file(file, LockTable::SHARED);
+
+    if(lock.owns() && file.has_data()) {
+        block = file.data_head();
+        cell = _fat.get_cell(block);
+        extents = 1;
+
+        // count jumps in chain
+        while(cell.has_next()) {
+            if(cell.next_cell() != block + 1) ++extents;
+
+            block = cell.next_cell();
+            cell = _fat.get_cell(block);
+        }
+    }
+    return extents;
+}
+
+std::size_t FatFS::free_extents() const { return _fat.free_extents(); }
+
+std::size_t FatFS::largest_free_extent() const {
+    return _fat.largest_free_extent();
+}
+
+std::size_t FatFS::block_size() const { return _block_size; }
+
+void FatFS::set_block_size(std::size_t size) {
+    std::size_t disk_block = _disk ? _disk->max_block()
+                                   : std::size_t(Disk::MAX_BLOCK);
+
+    // 0 is one disk block, else a cluster of whole disk blocks in range
+    if(size == 0) {
+        _format_block_size = 0;
+        return;
+    }
+
+    if(size < FatFS::MIN_BLOCK_SIZE || size > FatFS::MAX_BLOCK_SIZE)
+        throw std::out_of_range("Block size must be " +
+                                std::to_string(FatFS::MIN_BLOCK_SIZE) +
+                                " to " +
+                                std::to_string(FatFS::MAX_BLOCK_SIZE) +
+                                " bytes");
+
+    if(size % disk_block != 0)
+        throw std::invalid_argument(
+            "Block size must be a multiple of disk block size");
+
+    _format_block_size = size;
+}
+
+int FatFS::alloc_policy() const { return _fat.policy(); }
+
+void FatFS::set_alloc_policy(int policy) { _fat.set_policy(policy); }
+
+std::size_t FatFS::cache_size() const { return _cache_mb; }
+
+void FatFS::set_cache_size(std::size_t mb) {
+    _cache_mb = mb;
+
+    if(valid()) {
+        _cache.unpin(_block_offset);
+        _attach_cache();
+    }
+}
+
+const CacheModel &FatFS::cache_model() const { return _cache; }
+
+const Journal &FatFS::journal() const { return _journal; }
+
+std::string FatFS::journal_info() const { return _journal.info(); }
+
+const LockTable &FatFS::locks() const { return _locks; }
+
+void FatFS::_attach_cache() {
+    _cache.attach(_disk, _block_size, _cache_mb, _metadata());
+    _fat.set_cache(&_cache);
+
+    // root directory is read on every path lookup, keep a frame to spare
+    if(_cache.capacity() > 1) _cache.pin(_block_offset, CacheModel::DIR);
+}
+
+void FatFS::_commit() {
+    std::vector<long> released;
+
+    // data blocks are marked now, FAT and directory blocks once logged
+    if(_journal.enabled()) _cache.take_metadata();
+    _cache.commit();
+    _journal.commit();
+    _disk->commit();
+
+    // blocks freed by the update may be reused now it is logged
+    {
+        std::lock_guard<std::mutex> lock(_release_mutex);
+        auto it = _released.find(std::this_thread::get_id());
+
+        if(it != _released.end()) {
+            released.swap(it->second);
+            _released.erase(it);
+        }
+    }
+    for(long block : released) _fat.release(block);
+}
+
+void FatFS::_dirty(long block) const {
+    if(block > -1) _cache.access(block, CacheModel::DIR, true);
+}
+
+void FatFS::_clear_caches() {
+    {
+        std::lock_guard<std::mutex> lock(_size_mutex);
+        _size_deltas.clear();
+        _size_updates = 0;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_chain_mutex);
+        _chains.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock(_index_mutex);
+        _dir_index.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock(_generation_mutex);
+        _generations.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock(_release_mutex);
+        _released.clear();
+    }
+    std::lock_guard<std::mutex> lock(_dentry_mutex);
+    _dentries.clear();
+    _dentry_count = 0;
+}
+
+long FatFS::_meta(int field) const {
+    char *meta = _journal.enabled() ? _journal.image() : _disk->data_at(0);
+
+    if(_wide)
+        return ((int64_t *)meta)[field];
+    else
+        return ((int *)meta)[field];
+}
+
+void FatFS::_set_meta(int field, long value) {
+    char *meta = _journal.enabled() ? _journal.image() : _disk->data_at(0);
+    std::size_t size = _wide ? sizeof(int64_t) : sizeof(int);
+
+    if(_wide)
+        ((int64_t *)meta)[field] = value;
+    else
+        ((int *)meta)[field] = value;
+
+    Journal::record(meta + field * size, size);
+    _disk->mark_dirty(field * size / _disk->max_block());
+}
+
+char *FatFS::_data_at(long block, int cls, bool dirty) const {
+    long disk_blocks = _block_size / _disk->max_block();
+
+    if(block > -1) _cache.access(block, cls, dirty);
+
+    // entry blocks are read and written in the journal's shadow
+    if(block > -1 && cls != CacheModel::DATA && _journal.enabled())
+        return _journal.stage(block);
+
+    return block < 0 ? nullptr
+                     : _disk->data_at(block * disk_blocks, disk_blocks);
+}
+
+char *FatFS::_metadata() const {
+    std::size_t disk_block = _disk->max_block();
+    std::size_t end = _block_offset * _block_size;
+
+    if(_journal.enabled()) return _journal.image();
+
+    // the journal region is read by the journal, not loaded here
+    if(_version >= FatFS::JOURNAL_VERSION)
+        end = _meta(META_JOURNAL_OFFSET) * _block_size;
+
+    return _disk->data_at(0, (end + disk_block - 1) / disk_block);
+}
+
+long FatFS::_total_blocks() const {
+    return _disk->total_blocks() / (_block_size / _disk->max_block());
+}
+
+std::size_t FatFS::_align(std::size_t bytes, std::size_t align) {
+    return (bytes + align - 1) / align * align;
+}
+
+std::size_t FatFS::_read_run(long block, std::size_t skip, char *data,
+                             std::size_t size) const {
+    std::size_t disk_block = _disk->max_block();
+
+    // cached blocks are read in place, misses go to disk as one run
+    if(_cache.enabled()) {
+        _cache.access_run(block, (skip + size + _block_size - 1) / _block_size,
+                          CacheModel::DATA);
+        memcpy(data,
+               _disk->data_at(block * (_block_size / disk_block),
+                              (skip + size + disk_block - 1) / disk_block) +
+                   skip,
+               size);
+
+        return size;
+    }
+
+    std::size_t count = (skip + size + disk_block - 1) / disk_block;
+    std::size_t bytes = 0;
+    std::vector<char> head(skip);  // discarded bytes before data
+
+    struct iovec iov[] = {{head.data(), skip}, {data, size}};
+
+    bytes = _disk->read_blocks(block * (_block_size / disk_block), count, iov,
+                               2);
+
+    return bytes > skip ? bytes - skip : 0;
+}
+
+Entry FatFS::_entry_at(long block) const {
+    return Entry(_data_at(block, CacheModel::DIR), _wide);
+}
+
+DirEntry FatFS::_dir_at(long block) const {
+    return DirEntry(_data_at(block, CacheModel::DIR), _wide);
+}
+
+FileEntry FatFS::_file_at(long block) const {
+    FileEntry file(_data_at(block, CacheModel::DIR), _wide);
+
+    // file handles are checked against their block's generation when used
+    file.set_generation(_generation_of(block));
+    return file;
+}
+
 void FatFS::_init_root() {
     // index of root starts @ block offset
 
     if(_disk) {
         // get fatcell
-        FatCell root_cell = _fat.get_cell(_block_offset);
+        FatCell root_cell = _fat.get_cell(_block_offset, true);
 
         // set root entry at disk block of index
-        _root.set_address(_disk->data_at(_block_offset));
+        _root = _dir_at(_block_offset);
 
         // if root cell is free, then add Directory entry to block 0 on disk
         if(root_cell.free()) {
             // set root cell
             root_cell.set_next_cell(FatCell::END);
+            _dirty(_block_offset);
 
             // initialize root block
             _root.init();                        // init default values
             _root.set_name("/");                 // root name
             _root.set_dot(_block_offset);        // set start of logical block
-            _root.set_size(_disk->max_block());  // size to one disk block
+            _root.set_size(_block_size);         // size to one block
 
             // sanity check that top block is same as offset
-            auto it = _fat.free_blocks().begin();
-            if(_block_offset != *it)
+            if(_block_offset != _fat.next_free())
                 throw std::logic_error("Fat data does not match block offset");
 
-            // pop free list
-            _fat.free_blocks().erase(it);
+            // take root block from free map
+            _fat.take(_block_offset);
         }
-        _current = _root;
+        ++_mount;
     }
 }
 
 // DirEntry dir: add Entry to this directory
 // return invalid Entry if can not add
 DirEntry FatFS::_add_dir_at(DirEntry &dir, std::string name) {
-    DirEntry newdir, find_dir;
-    FileEntry find_file;
-    std::set<int>::iterator it;
+    DirEntry newdir;
 
     if(!_disk) throw std::runtime_error("No disk or filesystem");
 
@@ -1061,49 +2155,50 @@ DirEntry FatFS::_add_dir_at(DirEntry &dir, std::string name) {
                                 std::to_string(Entry::MAX_NAME - 1));
 
     if(dir) {
-        // find if file name exists
-        find_file = _find_file_at(dir, name);
+        DirIndex &index = _index_of(dir);
+
+        // check if file or dir name exists
+        if(index.blocks.count(name) == 0) {
+            // get a new index from free block map
+            long newindex = _fat.allocate();
+
+            // get a new cell from free index
+            FatCell newcell = _fat.get_cell(newindex, true);
+
+            // mark new cell's next cell pointer to END
+            // mark disk block at free index
+            newcell.set_next_cell(FatCell::END);
+
+            // free index also indicates free block in disk
+            // get directory entry at block and update values
+            newdir = _dir_at(newindex);
+            newdir.init();                        // init default values
+            newdir.set_name(name);                // set dir name
+            newdir.set_dot(newindex);             // set self index
+            newdir.set_dotdot(dir.dot());         // set parent index
+            newdir.set_size(_block_size);         // size 1 block
+            _stamp(newindex);
+            _dirty(newindex);
+
+            // update last cell pointer
+            if(dir.has_dirs())
+                _fat.get_cell(index.dir_tail, true).set_next_cell(newindex);
+            else
+                dir.set_dir_head(newindex);  // update dir ptr
 
-        if(!find_file) {
-            // check if dir name exists
-            find_dir = _find_dir_orlast_at(dir, name);
+            // update directory index, drop negative dentry of name
+            index.blocks[name] = newindex;
+            index.prev[newindex] = index.dir_tail;
+            index.dir_tail = newindex;
+            _forget_dentry(dir.dot(), name);
 
-            if(find_dir && find_dir.name() == name)
-                return newdir;
-            else {
-                // get a new index from free index list
-                it = _fat.free_blocks().begin();
-                int newindex = *it;
-                _fat.free_blocks().erase(it);
-
-                // get a new cell from free index
-                FatCell newcell = _fat.get_cell(newindex);
-
-                // mark new cell's next cell pointer to END
-                // mark disk block at free index
-                newcell.set_next_cell(FatCell::END);
-
-                // free index also indicates free block in disk
-                // get directory entry at block and update values
-                newdir = DirEntry(_disk->data_at(newindex));
-                newdir.init();                        // init default values
-                newdir.set_name(name);                // set dir name
-                newdir.set_dot(newindex);             // set self index
-                newdir.set_dotdot(dir.dot());         // set parent index
-                newdir.set_size(_disk->max_block());  // size 1 disk block
-
-                // update last cell pointer
-                if(dir.has_dirs()) {
-                    _fat.get_cell(find_dir.dot()).set_next_cell(newindex);
-                } else
-                    dir.set_dir_head(newindex);  // update dir ptr
-
-                // update dir timestamp
-                dir.update_last_modified();
-
-                // update parents size
-                _update_parents_size(dir, newdir.size());
-            }
+            // update dir timestamp
+            dir.update_last_modified();
+            _dirty(dir.dot());
+
+            // update parents size
+            _update_parents_size(dir, newdir.size());
+            _commit();
         }
     }
     return newdir;
@@ -1112,9 +2207,7 @@ DirEntry FatFS::_add_dir_at(DirEntry &dir, std::string name) {
 // DirEntry dir: add Entry to this directory
 // return invalid Entry if can not add
 FileEntry FatFS::_add_file_at(DirEntry &dir, std::string name) {
-    DirEntry find_dir;
-    FileEntry newfile, find_file;
-    std::set<int>::iterator it;
+    FileEntry newfile;
 
     if(!_disk) throw std::runtime_error("No disk or filesystem");
 
@@ -1125,49 +2218,50 @@ FileEntry FatFS::_add_file_at(DirEntry &dir, std::string name) {
                                std::to_string(Entry::MAX_NAME - 1));
 
     if(dir) {
-        // check if dir name exists
-        find_dir = _find_dir_at(dir, name);
-
-        if(!find_dir) {
-            // check if file name exists
-            find_file = _find_file_orlast_at(dir, name);
-
-            if(find_file && find_file.name() == name)
-                return newfile;
-            else {  // get a new index from free index list
-                it = _fat.free_blocks().begin();
-                int newindex = *it;
-                _fat.free_blocks().erase(it);
-
-                // get a new cell from free index
-                FatCell newcell = _fat.get_cell(newindex);
-
-                // mark new cell's cell pointer to END
-                // mark disk block at free index
-                newcell.set_next_cell(FatCell::END);
-
-                // free index also indicates free block in disk
-                // get file entry at block and update values
-                newfile = FileEntry(_disk->data_at(newindex));
-                newfile.init();                        // init default values
-                newfile.set_name(name);                // set file name
-                newfile.set_dot(newindex);             // set self index
-                newfile.set_dotdot(dir.dot());         // set parent index
-                newfile.set_size(_disk->max_block());  // size 1 disk block
-
-                // update last cell pointer
-                if(dir.has_files())
-                    _last_filecell_from(dir).set_next_cell(newindex);
-                else
-                    // update file ptr
-                    dir.set_file_head(newindex);
+        DirIndex &index = _index_of(dir);
+
+        // check if file or dir name exists
+        if(index.blocks.count(name) == 0) {
+            // get a new index from free block map
+            long newindex = _fat.allocate();
+
+            // get a new cell from free index
+            FatCell newcell = _fat.get_cell(newindex, true);
+
+            // mark new cell's cell pointer to END
+            // mark disk block at free index
+            newcell.set_next_cell(FatCell::END);
+
+            // free index also indicates free block in disk
+            // get file entry at block and update values
+            newfile = _file_at(newindex);
+            newfile.init();                        // init default values
+            newfile.set_name(name);                // set file name
+            newfile.set_dot(newindex);             // set self index
+            newfile.set_dotdot(dir.dot());         // set parent index
+            newfile.set_size(_block_size);         // size 1 block
+            _stamp(newindex);
+            newfile.set_generation(_generation_of(newindex));
+            _dirty(newindex);
+
+            // update last cell pointer
+            if(dir.has_files())
+                _fat.get_cell(index.file_tail, true).set_next_cell(newindex);
+            else
+                dir.set_file_head(newindex);  // update file ptr
 
-                // update dir timestamps
-                dir.update_last_modified();
+            // update directory index
+            index.blocks[name] = newindex;
+            index.prev[newindex] = index.file_tail;
+            index.file_tail = newindex;
 
-                // update parents size
-                _update_parents_size(dir, newfile.size());
-            }
+            // update dir timestamps
+            dir.update_last_modified();
+            _dirty(dir.dot());
+
+            // update parents size
+            _update_parents_size(dir, newfile.size());
+            _commit();
         }
     }
     return newfile;
@@ -1181,22 +2275,24 @@ void FatFS::_entries_at(DirEntry &dir, EntrySet &entries_set) const {
 
     // iterate DirEntry linked list
     if(_disk && dir && dir.has_dirs()) {
-        entries_set.emplace(_disk->data_at(dir.dir_head()));
+        entries_set.emplace(_data_at(dir.dir_head(), CacheModel::DIR), _wide);
         cell = _fat.get_cell(dir.dir_head());
 
         while(cell.has_next()) {
-            entries_set.emplace(_disk->data_at(cell.next_cell()));
+            entries_set.emplace(
+                _data_at(cell.next_cell(), CacheModel::DIR), _wide);
             cell = _fat.get_cell(cell.next_cell());
         }
     }
 
     // iterate FileEntry linked list
     if(_disk && dir && dir.has_files()) {
-        entries_set.emplace(_disk->data_at(dir.file_head()));
+        entries_set.emplace(_data_at(dir.file_head(), CacheModel::DIR), _wide);
         cell = _fat.get_cell(dir.file_head());
 
         while(cell.has_next()) {
-            entries_set.emplace(_disk->data_at(cell.next_cell()));
+            entries_set.emplace(
+                _data_at(cell.next_cell(), CacheModel::DIR), _wide);
             cell = _fat.get_cell(cell.next_cell());
         }
     }
@@ -1211,11 +2307,12 @@ void FatFS::_dirs_at(DirEntry &dir, DirSet &entries_set) const {
     entries_set.clear();
 
     if(_disk && dir && dir.has_dirs()) {
-        entries_set.emplace(_disk->data_at(dir.dir_head()));
+        entries_set.emplace(_data_at(dir.dir_head(), CacheModel::DIR), _wide);
         cell = _fat.get_cell(dir.dir_head());
 
         while(cell.has_next()) {
-            entries_set.emplace(_disk->data_at(cell.next_cell()));
+            entries_set.emplace(
+                _data_at(cell.next_cell(), CacheModel::DIR), _wide);
             cell = _fat.get_cell(cell.next_cell());
         }
     }
@@ -1230,11 +2327,12 @@ void FatFS::_files_at(DirEntry &dir, FileSet &entries_set) const {
     entries_set.clear();
 
     if(_disk && dir && dir.has_files()) {
-        entries_set.emplace(_disk->data_at(dir.file_head()));
+        entries_set.emplace(_data_at(dir.file_head(), CacheModel::DIR), _wide);
         cell = _fat.get_cell(dir.file_head());
 
         while(cell.has_next()) {
-            entries_set.emplace(_disk->data_at(cell.next_cell()));
+            entries_set.emplace(
+                _data_at(cell.next_cell(), CacheModel::DIR), _wide);
             cell = _fat.get_cell(cell.next_cell());
         }
     }
@@ -1242,35 +2340,25 @@ void FatFS::_files_at(DirEntry &dir, FileSet &entries_set) const {
 
 // dir: directory entry to start looking at
 DirEntry FatFS::_find_dir_at(DirEntry &dir, std::string name) const {
-    DirEntry subdir, found;
-    FatCell cell;
+    DirEntry found;
+    long block = FatCell::END;
 
     if(_disk && dir) {
         if(name == ".") {
             found = dir;
         } else if(name == "..") {
-            int parent_block = dir.dotdot();
+            long parent_block = dir.dotdot();
 
             if(parent_block != FatCell::END)
-                found = DirEntry(_disk->data_at(parent_block));
+                found = _dir_at(parent_block);
             else
                 found = dir;
-        } else if(dir.has_dirs()) {
-            subdir = DirEntry(_disk->data_at(dir.dir_head()));
-            cell = _fat.get_cell(dir.dir_head());
-
-            if(subdir.name() != name) {
-                while(cell.has_next()) {
-                    subdir = DirEntry(_disk->data_at(cell.next_cell()));
-                    cell = _fat.get_cell(cell.next_cell());
-
-                    if(subdir.name() == name) {
-                        found = subdir;
-                        break;
-                    }
-                }
-            } else
-                found = subdir;
+        } else {
+            block = _find_block_at(dir, name);
+
+            if(block != FatCell::END &&
+               _entry_at(block).type() == Entry::DIR)
+                found = _dir_at(block);
         }
     }
     return found;
@@ -1278,132 +2366,66 @@ DirEntry FatFS::_find_dir_at(DirEntry &dir, std::string name) const {
 
 // dir: directory entry to start looking at
 FileEntry FatFS::_find_file_at(DirEntry &dir, std::string name) const {
-    FileEntry file, found;
-    FatCell cell;
+    FileEntry found;
+    long block = FatCell::END;
 
-    if(_disk && dir && dir.has_files()) {
-        file = FileEntry(_disk->data_at(dir.file_head()));
-        cell = _fat.get_cell(dir.file_head());
-
-        if(file.name() != name) {
-            while(cell.has_next()) {
-                file = FileEntry(_disk->data_at(cell.next_cell()));
-                cell = _fat.get_cell(cell.next_cell());
+    if(_disk && dir) {
+        block = _find_block_at(dir, name);
 
-                if(file.name() == name) {
-                    found = file;
-                    break;
-                }
-            }
-        } else
-            found = file;
+        if(block != FatCell::END &&
+           _entry_at(block).type() == Entry::FILE)
+            found = _file_at(block);
     }
     return found;
 }
 
 // dir: directory entry to start looking at
-DirEntry FatFS::_find_dir_orlast_at(DirEntry &dir, std::string name) const {
-    DirEntry subdir;
-    FatCell cell;
+long FatFS::_find_block_at(DirEntry &dir, const std::string &name) const {
+    DirIndex &index = _index_of(dir);
+    auto it = index.blocks.find(name);
 
-    if(_disk && dir) {
-        if(name == ".") {
-            subdir = dir;
-        } else if(name == "..") {
-            int parent_block = dir.dotdot();
-
-            if(parent_block != FatCell::END)
-                subdir = DirEntry(_disk->data_at(parent_block));
-            else
-                subdir = dir;
-        } else if(dir.has_dirs()) {
-            subdir = DirEntry(_disk->data_at(dir.dir_head()));
-            cell = _fat.get_cell(dir.dir_head());
-
-            if(subdir.name() != name)
-                while(cell.has_next()) {
-                    subdir = DirEntry(_disk->data_at(cell.next_cell()));
-                    cell = _fat.get_cell(cell.next_cell());
-
-                    if(subdir.name() == name) break;
-                }
-        }
-    }
-    return subdir;
-}
-
-// dir: directory entry to start looking at
-FileEntry FatFS::_find_file_orlast_at(DirEntry &dir, std::string name) const {
-    FileEntry file;
-    FatCell cell;
-
-    if(_disk && dir && dir.has_files()) {
-        file = FileEntry(_disk->data_at(dir.file_head()));
-        cell = _fat.get_cell(dir.file_head());
-
-        if(file.name() != name)
-            while(cell.has_next()) {
-                file = FileEntry(_disk->data_at(cell.next_cell()));
-                cell = _fat.get_cell(cell.next_cell());
-
-                if(file.name() == name) break;
-            }
-    }
-    return file;
+    return it != index.blocks.end() ? it->second : long(FatCell::END);
 }
 
 bool FatFS::_delete_dir_at(DirEntry &dir, std::string name) {
     bool is_deleted = false;
     DirEntry subdir;
-    FatCell cell, prevcell;
+    FatCell cell;
     std::size_t prev_size = 0;
 
     if(_disk && dir && dir.has_dirs()) {
-        subdir = DirEntry(_disk->data_at(dir.dir_head()));
-        cell = _fat.get_cell(dir.dir_head());
+        long block = _find_block_at(dir, name);
+
+        if(block != FatCell::END &&
+           _entry_at(block).type() == Entry::DIR) {
+            std::vector<LockTable::Guard> locks;
+
+            // wait out every thread inside the subtree, none can enter it
+            // while dir is held exclusive
+            _lock_subtree(block, locks);
 
-        // found @ first link, popfront
-        if(subdir.name() == name) {
+            // fold pending sizes so subtree size is current
+            _fold_sizes();
+
+            subdir = _dir_at(block);
+            cell = _fat.get_cell(block, true);
             prev_size = subdir.size();
 
             dir.update_last_modified();
-            dir.set_dir_head(cell.next_cell());
+
+            // link previous cell to next cell
+            _unlink_at(dir, block, Entry::DIR);
 
             _free_cell(cell, subdir.dot());
+            _stamp(block);
             _free_dir_at(subdir);  // recursively free dir
 
             // update parents' size
             _update_parents_size(dir, -prev_size);
+            _commit();
 
             is_deleted = true;
         }
-        // found @ rest of link
-        else {
-            while(cell.has_next()) {
-                prevcell = cell;
-                subdir = DirEntry(_disk->data_at(cell.next_cell()));
-                cell = _fat.get_cell(cell.next_cell());
-
-                if(subdir.name() == name) {
-                    prev_size = subdir.size();
-
-                    dir.update_last_modified();
-
-                    // link previous cell to next cell
-                    prevcell.set_next_cell(cell.next_cell());
-
-                    _free_cell(cell, subdir.dot());
-                    _free_dir_at(subdir);  // recursively free dir
-
-                    // update parents' size
-                    _update_parents_size(dir, -prev_size);
-
-                    is_deleted = true;
-
-                    break;
-                }
-            }
-        }
     }
     return is_deleted;
 }
@@ -1411,61 +2433,96 @@ bool FatFS::_delete_dir_at(DirEntry &dir, std::string name) {
 bool FatFS::_delete_file_at(DirEntry &dir, std::string name) {
     bool is_deleted = false;
     FileEntry file;
-    FatCell cell, prevcell;
+    FatCell cell;
     std::size_t prev_size = 0;
 
     if(_disk && dir && dir.has_files()) {
-        file = FileEntry(_disk->data_at(dir.file_head()));
-        cell = _fat.get_cell(dir.file_head());
+        long block = _find_block_at(dir, name);
 
-        // found @ first link, popfront
-        if(file.name() == name) {
+        if(block != FatCell::END &&
+           _entry_at(block).type() == Entry::FILE) {
+            LockTable::Guard lock = _lock(block, LockTable::EXCLUSIVE);
+
+            file = _file_at(block);
+            cell = _fat.get_cell(block, true);
             prev_size = file.size();
 
             dir.update_last_modified();
 
-            // set directory file pointer to next cell
-            dir.set_file_head(cell.next_cell());
+            // link previous cell to next cell
+            _unlink_at(dir, block, Entry::FILE);
 
             // free cell and data blocks for this file
             _free_cell(cell, file.dot());
+            _stamp(block);
             _free_data_at(file);
 
             // update parents' size
             _update_parents_size(dir, -prev_size);
+            _commit();
 
             is_deleted = true;
         }
-        // found @ rest of link
-        else {
-            while(cell.has_next()) {
-                prevcell = cell;
-                file = FileEntry(_disk->data_at(cell.next_cell()));
-                cell = _fat.get_cell(cell.next_cell());
+    }
+    return is_deleted;
+}
+
+void FatFS::_unlink_at(DirEntry &dir, long block, bool type) {
+    DirIndex &index = _index_of(dir);
+    long prev = index.prev[block];
+    long next = _fat.get_cell(block).next_cell();
+
+    // link previous cell or directory head pointer to next cell
+    if(prev != FatCell::END)
+        _fat.get_cell(prev, true).set_next_cell(next);
+    else if(type == Entry::DIR)
+        dir.set_dir_head(next);
+    else
+        dir.set_file_head(next);
+    _dirty(dir.dot());
 
-                if(file.name() == name) {
-                    prev_size = file.size();
+    // update directory index
+    if(next != FatCell::END) index.prev[next] = prev;
 
-                    dir.update_last_modified();
+    if(type == Entry::DIR && index.dir_tail == block) index.dir_tail = prev;
+    if(type == Entry::FILE && index.file_tail == block) index.file_tail = prev;
 
-                    // link previous cell to next cell
-                    prevcell.set_next_cell(cell.next_cell());
+    index.blocks.erase(_entry_at(block).name());
+    index.prev.erase(block);
 
-                    // free cell data blocks for this file
-                    _free_cell(cell, file.dot());
-                    _free_data_at(file);
+    if(type == Entry::DIR)
+        _forget_dentry(dir.dot(), _entry_at(block).name());
+}
 
-                    // update parents' size
-                    _update_parents_size(dir, -prev_size);
+FatFS::DirIndex &FatFS::_index_of(DirEntry &dir) const {
+    {
+        std::lock_guard<std::mutex> lock(_index_mutex);
+        auto it = _dir_index.find(dir.dot());
 
-                    is_deleted = true;
+        if(it != _dir_index.end()) return it->second;
+    }
 
-                    break;
-                }
-            }
+    // build index from directory's dir and file chains, readers sharing the
+    // directory may build it at once and the first one in is kept
+    DirIndex index;
+    long heads[] = {dir.dir_head(), dir.file_head()};
+    long *tails[] = {&index.dir_tail, &index.file_tail};
+
+    for(int i = 0; i < 2; ++i) {
+        long prev = FatCell::END, block = heads[i];
+
+        while(block > FatCell::END) {
+            index.blocks[_entry_at(block).name()] = block;
+            index.prev[block] = prev;
+
+            prev = block;
+            block = _fat.get_cell(block).next_cell();
         }
+        *tails[i] = prev;
     }
-    return is_deleted;
+
+    std::lock_guard<std::mutex> lock(_index_mutex);
+    return _dir_index.emplace(dir.dot(), std::move(index)).first->second;
 }
 
 void FatFS::_free_dir_at(DirEntry &dir) {
@@ -1474,41 +2531,56 @@ void FatFS::_free_dir_at(DirEntry &dir) {
         FileEntry file;
         FatCell cell;
 
+        // drop directory index and dentries under this dir
+        {
+            std::lock_guard<std::mutex> lock(_index_mutex);
+            _dir_index.erase(dir.dot());
+        }
+        _forget_dentries(dir.dot());
+
         while(dir.has_dirs()) {
             // get sub directories
-            subdir = DirEntry(_disk->data_at(dir.dir_head()));
-            cell = _fat.get_cell(dir.dir_head());
+            subdir = _dir_at(dir.dir_head());
+            cell = _fat.get_cell(dir.dir_head(), true);
 
             // set directory dir pointer to next cell
             dir.set_dir_head(cell.next_cell());
 
             _free_cell(cell, subdir.dot());  // free cell
-            _free_dir_at(subdir);            // recursively free contents
+            _stamp(subdir.dot());
+            _free_dir_at(subdir);  // recursively free contents
         }
 
         while(dir.has_files()) {
             // get FileEntry
-            file = FileEntry(_disk->data_at(dir.file_head()));
-            cell = _fat.get_cell(dir.file_head());
+            file = _file_at(dir.file_head());
+            cell = _fat.get_cell(dir.file_head(), true);
 
             // set diretory file pointer to next cell
             dir.set_file_head(cell.next_cell());
 
             // free cell and data blocks associated with FileEntry
             _free_cell(cell, file.dot());
+            _stamp(file.dot());
             _free_data_at(file);
         }
     }
 }
 
 void FatFS::_free_data_at(FileEntry &file) {
-    int data_head = FatCell::END;
+    long data_head = FatCell::END;
     FatCell cell;
 
+    // drop cached data chain
+    if(file) {
+        std::lock_guard<std::mutex> lock(_chain_mutex);
+        _chains.erase(file.dot());
+    }
+
     while(file && file.has_data()) {
         // get cell from data pointer in FileEntry
         data_head = file.data_head();
-        cell = _fat.get_cell(data_head);
+        cell = _fat.get_cell(data_head, true);
 
         // relink file data pointer to next cell
         file.set_data_head(cell.next_cell());
@@ -1516,103 +2588,472 @@ void FatFS::_free_data_at(FileEntry &file) {
         // free cell
         _free_cell(cell, data_head);
     }
-    file.set_size(_disk->max_block());
+    file.set_data_tail(FatCell::END);
+    file.set_size(_block_size);
+    if(file) _dirty(file.dot());
+}
+
+long FatFS::_alloc_data_at(FileEntry &file, long last_block, const char *data,
+                           std::size_t size) {
+    long blocks = 0, taken = 0, start = FatCell::END, hint = FatCell::END;
+    std::size_t bytes = 0, max_block = _block_size;
+    long blocks_left = (size + max_block - 1) / max_block;
+    FatCell cell;
+    DataEntry data_entry;
+    std::vector<long> *chain = nullptr;
+
+    // a data chain always has a first block
+    if(blocks_left == 0) blocks_left = 1;
+
+    // extend cached chain only if it ends at last block, else drop it, a
+    // chain is only changed with its file held exclusive
+    {
+        std::lock_guard<std::mutex> lock(_chain_mutex);
+        auto it = _chains.find(file.dot());
+
+        if(it != _chains.end()) {
+            if((last_block == FatCell::END && it->second.empty()) ||
+               (!it->second.empty() && it->second.back() == last_block))
+                chain = &it->second;
+            else
+                _chains.erase(it);
+        }
+    }
+
+    while(blocks_left > 0) {
+        // reserve a contiguous run, extending from last block if free
+        if(last_block != FatCell::END) hint = last_block + 1;
+        start = _fat.allocate_run(blocks_left, taken, hint);
+
+        for(long block = start; block < start + taken; ++block) {
+            cell = _fat.get_cell(block, true);
+            cell.set_next_cell(FatCell::END);
+
+            // connect last cell or file's data pointer to block
+            if(last_block == FatCell::END)
+                file.set_data_head(block);
+            else
+                _fat.get_cell(last_block, true).set_next_cell(block);
+
+            // write data block
+            data_entry = _data_at(block, CacheModel::DATA, true);
+            bytes = data_entry.write(data, size, max_block);
+            size -= bytes;
+            data += bytes;
+
+            if(chain) chain->push_back(block);
+
+            last_block = block;
+        }
+
+        blocks += taken;
+        blocks_left -= taken;
+    }
+
+    // update file's data tail pointer
+    file.set_data_tail(last_block);
+
+    return blocks;
 }
 
-void FatFS::_free_cell(FatCell &cell, int cell_index) {
-    // add this cell to free list
-    _fat.free_blocks().emplace(cell_index);
+void FatFS::_truncate_data_at(FileEntry &file, long last_block) {
+    long block = FatCell::END;
+    FatCell last_cell = _fat.get_cell(last_block, true), cell;
+
+    // free all blocks after last block
+    block = last_cell.next_cell();
+
+    while(block > FatCell::END) {
+        cell = _fat.get_cell(block, true);
+
+        long next = cell.next_cell();
+        _free_cell(cell, block);
+        block = next;
+    }
+
+    // last block ends the chain
+    last_cell.set_next_cell(FatCell::END);
+    file.set_data_tail(last_block);
+
+    // drop cached chain past last block
+    std::lock_guard<std::mutex> lock(_chain_mutex);
+    auto it = _chains.find(file.dot());
+    if(it != _chains.end()) {
+        std::vector<long> &chain = it->second;
+        auto pos = std::find(chain.begin(), chain.end(), last_block);
+
+        if(pos != chain.end())
+            chain.erase(pos + 1, chain.end());
+        else
+            _chains.erase(it);
+    }
+}
 
+void FatFS::_free_cell(FatCell &cell, long cell_index) {
     // mark this cell as free
     cell.set_free();
+
+    // add this cell to free map once the update is logged
+    std::lock_guard<std::mutex> lock(_release_mutex);
+    _released[std::this_thread::get_id()].push_back(cell_index);
 }
 
 void FatFS::_update_parents_size(DirEntry dir, std::size_t size) {
+    if(_lazy_sizes && dir) {
+        bool is_due = false;
+
+        // defer to delta table, fold when enough updates are pending
+        {
+            std::lock_guard<std::mutex> lock(_size_mutex);
+            _size_deltas[dir.dot()] += size;
+            is_due = ++_size_updates >= FOLD_UPDATES;
+        }
+
+        if(is_due) _fold_sizes();
+        return;
+    }
+
     while(dir) {
         dir.inc_size(size);
-        dir = DirEntry(_disk->data_at(dir.dotdot()));
+        _dirty(dir.dot());
+        dir = _dir_at(dir.dotdot());
     }
 }
 
-FatCell FatFS::_last_dircell_from(DirEntry &dir) const {
-    return _last_cell_from(dir.dir_head());
+bool FatFS::_fold_sizes() const {
+    std::lock_guard<std::mutex> lock(_size_mutex);
+    std::unordered_map<long, std::size_t> totals;
+
+    if(_size_deltas.empty()) return false;
+
+    // sum deltas up to root in memory, then write each dir size once
+    for(const auto &delta : _size_deltas) {
+        DirEntry dir = _dir_at(delta.first);
+
+        while(dir) {
+            totals[dir.dot()] += delta.second;
+            dir = _dir_at(dir.dotdot());
+        }
+    }
+
+    for(const auto &total : totals) {
+        _dir_at(total.first).inc_size(total.second);
+        _dirty(total.first);
+    }
+
+    _size_deltas.clear();
+    _size_updates = 0;
+
+    return true;
 }
 
-FatCell FatFS::_last_filecell_from(DirEntry &dir) const {
-    return _last_cell_from(dir.file_head());
+void FatFS::_flush_sizes() const {
+    // a fold outside an update is an update of its own
+    if(_fold_sizes()) _journal.commit();
 }
 
-FatCell FatFS::_last_datacell_from(FileEntry &file) const {
-    return _last_cell_from(file.data_head());
+std::size_t FatFS::_rebuild_sizes_at(DirEntry &dir) {
+    std::size_t size = _block_size;
+    long block = dir.dir_head();
+
+    while(block > FatCell::END) {
+        DirEntry subdir = _dir_at(block);
+
+        size += _rebuild_sizes_at(subdir);
+        block = _fat.get_cell(block).next_cell();
+    }
+
+    block = dir.file_head();
+    while(block > FatCell::END) {
+        size += _file_at(block).size();
+        block = _fat.get_cell(block).next_cell();
+    }
+
+    dir.set_size(size);
+    _dirty(dir.dot());
+
+    return size;
 }
 
-FatCell FatFS::_last_cell_from(int start_cell) const {
+long FatFS::_last_block_from(long start_cell) const {
+    long block = start_cell;
     FatCell current = _fat.get_cell(start_cell);
 
-    while(current.has_next()) current = _fat.get_cell(current.next_cell());
+    while(current.has_next()) {
+        block = current.next_cell();
+        current = _fat.get_cell(block);
+    }
+    return block;
+}
 
-    return current;
+long FatFS::_last_datablock_from(FileEntry &file) const {
+    if(_version >= FatFS::TAIL_VERSION)
+        return file.data_tail();
+    else
+        return _last_block_from(file.data_head());
 }
 
-FatCell FatFS::_sec_last_cell_from(int start_cell) const {
-    FatCell current, prev;
-    current = prev = _fat.get_cell(start_cell);
+void FatFS::_chain_of(FileEntry &file, std::size_t first, std::size_t last,
+                      std::vector<long> &blocks) const {
+    std::lock_guard<std::mutex> lock(_chain_mutex);
+    std::vector<long> &chain = _chains[file.dot()];
+    FatCell cell;
 
-    while(current.has_next()) {
-        prev = current;
-        current = _fat.get_cell(current.next_cell());
+    if(chain.empty() && file.has_data()) chain.push_back(file.data_head());
+
+    // walk rest of chain from last cached block, up to last
+    if(!chain.empty()) {
+        cell = _fat.get_cell(chain.back());
+
+        while(chain.size() <= last && cell.has_next()) {
+            chain.push_back(cell.next_cell());
+            cell = _fat.get_cell(cell.next_cell());
+        }
     }
-    return prev;
+
+    // readers sharing the file extend its chain, so blocks are copied out
+    blocks.clear();
+    if(first < chain.size())
+        blocks.assign(chain.begin() + first,
+                      chain.begin() + std::min(last + 1, chain.size()));
 }
 
 void FatFS::_tokenize_path(std::string path,
                            std::list<std::string> &entries) const {
-    char *token = nullptr;
+    std::size_t start = 0, end = 0;
 
-    while(!entries.empty()) entries.pop_back();
+    entries.clear();
 
-    if(!path.empty()) {
-        char *cstr = new char[path.length() + 1]();
-        strncpy(cstr, path.c_str(), path.size());
+    if(!path.empty() && path[0] == '/') {
+        entries.emplace_back("/");
+        start = 1;
+    }
 
-        if(cstr[0] == '/') {
-            entries.emplace_back("/");
-            token = strtok(cstr + 1, "/");
-        } else
-            token = strtok(cstr, "/");
+    // split on '/' skipping empty names
+    while(start < path.size()) {
+        end = path.find('/', start);
+        if(end == std::string::npos) end = path.size();
 
-        while(token != NULL) {
-            entries.emplace_back(token);
-            token = strtok(NULL, "/");
-        }
-        delete[] cstr;
+        if(end > start) entries.emplace_back(path, start, end - start);
+
+        start = end + 1;
     }
 }
 
-DirEntry FatFS::_parse_dir_entries(std::list<std::string> &entries) const {
-    DirEntry dir = _current;
+DirEntry FatFS::_parse_dir_entries(const Session &session,
+                                   std::list<std::string> &entries,
+                                   LockTable::Guard &lock, int mode) const {
+    DirEntry dir = _cwd_of(session), next;
     std::string entry_name;
+    long parent = FatCell::END;
+    unsigned long generation = 0;
+    int step_mode = LockTable::SHARED;
+
+    lock.unlock();
+    if(!entries.empty() && entries.front() == "/") {
+        entries.pop_front();
+        dir = _root;
+    }
+
+    // the current directory may have been deleted by another thread, and
+    // its block given to a new directory
+    if(!dir) return dir;
+    lock = _lock(dir.dot(), entries.empty() ? mode : LockTable::SHARED);
+    if(!_live(dir.dot(), Entry::DIR) ||
+       _generation_of(dir.dot()) != dir.generation()) {
+        lock.unlock();
+        return DirEntry();
+    }
 
     while(!entries.empty()) {
         entry_name = entries.front();
         entries.pop_front();
 
-        if(entry_name == "/")
-            dir = _root;
-        else if(entry_name == ".") {
+        // last directory of path is held in mode, the ones above shared
+        step_mode = entries.empty() ? mode : LockTable::SHARED;
+
+        if(entry_name == ".") {
             // do nothing
-        } else if(entry_name == "..") {
-            if(dir && dir.has_parent())
-                dir = DirEntry(_disk->data_at(dir.dotdot()));
+        } else if(entry_name == "/" || entry_name == "..") {
+            parent = entry_name == "/" ? _root.dot() : dir.dotdot();
+            if(parent == FatCell::END) continue;
+
+            // parent is above dir in lock order, so dir is let go first and
+            // parent checked once locked, by the generation it had while dir
+            // held it in place
+            generation = _generation_of(parent);
+            lock.unlock();
+            dir = _dir_at(parent);
+            lock = _lock(parent, step_mode);
+
+            if(!_live(parent, Entry::DIR) ||
+               _generation_of(parent) != generation) {
+                lock.unlock();
+                return DirEntry();
+            }
         } else {
-            dir = _find_dir_at(dir, entry_name);
+            next = _lookup_dir_at(dir, entry_name);
 
-            if(!dir) break;
+            if(!next) {
+                lock.unlock();
+                return next;
+            }
+
+            // child is locked before dir lets go, so it can not be deleted
+            LockTable::Guard child = _lock(next.dot(), step_mode);
+            lock = std::move(child);
+            dir = next;
+        }
+    }
+
+    // a path ending in . or .. holds its directory shared
+    if(lock.mode() != mode) {
+        lock.unlock();
+        lock = _lock(dir.dot(), mode);
+
+        if(!_live(dir.dot(), Entry::DIR)) {
+            lock.unlock();
+            return DirEntry();
         }
     }
     return dir;
 }
 
+DirEntry FatFS::_cwd_of(const Session &session) const {
+    if(session._mount != _mount || session._cwd < 0) return _root;
+
+    DirEntry dir = _dir_at(session._cwd);
+
+    dir.set_generation(session._generation);
+    return dir;
+}
+
+std::string FatFS::_path_of(DirEntry dir) const {
+    std::string path = dir.name();
+
+    while(dir.dotdot() != FatCell::END) {
+        dir = _dir_at(dir.dotdot());
+
+        if(dir.name() != "/")
+            path = dir.name() + "/" + path;
+        else
+            path = dir.name() + path;
+    }
+    return path;
+}
+
+Session FatFS::_own_session() const {
+    std::lock_guard<std::mutex> lock(_session_mutex);
+    return _session;
+}
+
+LockTable::Guard FatFS::_lock(long block, int mode) const {
+    return LockTable::Guard(&_locks, block, mode);
+}
+
+LockTable::Guard FatFS::_lock_file(FileEntry &file, int mode) const {
+    LockTable::Guard lock;
+
+    if(!file) return lock;
+
+    // a deleted file's block may hold a new file by now, which has a new
+    // generation
+    lock = _lock(file.dot(), mode);
+    if(!_live(file.dot(), Entry::FILE) ||
+       _generation_of(file.dot()) != file.generation())
+        lock.unlock();
+
+    return lock;
+}
+
+bool FatFS::_live(long block, bool type) const {
+    FatCell cell = _fat.get_cell(block);
+    Entry entry = _entry_at(block);
+
+    return cell && cell.used() && entry.dot() == block && entry.type() == type;
+}
+
+void FatFS::_stamp(long block) {
+    std::lock_guard<std::mutex> lock(_generation_mutex);
+    _generations[block] = ++_last_generation;
+}
+
+unsigned long FatFS::_generation_of(long block) const {
+    std::lock_guard<std::mutex> lock(_generation_mutex);
+    auto it = _generations.find(block);
+
+    return it != _generations.end() ? it->second : 0;
+}
+
+void FatFS::_lock_subtree(long block,
+                          std::vector<LockTable::Guard> &locks) const {
+    DirEntry dir = _dir_at(block);
+
+    locks.push_back(_lock(block, LockTable::EXCLUSIVE));
+
+    // chains are read once dir is held, so no entry is added meanwhile
+    for(long child = dir.dir_head(); child > FatCell::END;
+        child = _fat.get_cell(child).next_cell())
+        _lock_subtree(child, locks);
+
+    for(long child = dir.file_head(); child > FatCell::END;
+        child = _fat.get_cell(child).next_cell())
+        locks.push_back(_lock(child, LockTable::EXCLUSIVE));
+}
+
+DirEntry FatFS::_lookup_dir_at(DirEntry &dir, const std::string &name) const {
+    DirEntry found;
+
+    {
+        std::lock_guard<std::mutex> lock(_dentry_mutex);
+        std::unordered_map<std::string, long> &dentries = _dentries[dir.dot()];
+        auto it = dentries.find(name);
+
+        if(it != dentries.end()) {
+            ++_dentry_hits;
+
+            // negative dentry: name is not a directory here
+            if(it->second != FatCell::END) found = _dir_at(it->second);
+            return found;
+        }
+        ++_dentry_misses;
+    }
+
+    // dir is held by the caller, so no dentry of it changes meanwhile
+    found = _find_dir_at(dir, name);
+
+    std::lock_guard<std::mutex> lock(_dentry_mutex);
+
+    // bound cache size, start over when full
+    if(_dentry_count >= MAX_DENTRIES) {
+        _dentries.clear();
+        _dentry_count = 0;
+    }
+    if(_dentries[dir.dot()]
+           .emplace(name, found ? found.dot() : long(FatCell::END))
+           .second)
+        ++_dentry_count;
+
+    return found;
+}
+
+void FatFS::_forget_dentry(long parent, const std::string &name) const {
+    std::lock_guard<std::mutex> lock(_dentry_mutex);
+    auto it = _dentries.find(parent);
+
+    if(it != _dentries.end()) _dentry_count -= it->second.erase(name);
+}
+
+void FatFS::_forget_dentries(long parent) const {
+    std::lock_guard<std::mutex> lock(_dentry_mutex);
+    auto it = _dentries.find(parent);
+
+    if(it != _dentries.end()) {
+        _dentry_count -= it->second.size();
+        _dentries.erase(it);
+    }
+}
+
 void FatFS::_find_entries_len_details(EntrySet &entries_set,
                                       std::size_t &name_len,
                                       std::size_t &byte_len) const {
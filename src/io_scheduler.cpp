@@ -0,0 +1,148 @@
+#include "../include/io_scheduler.h"
+
+namespace fs {
+
+IOScheduler::IOScheduler(Disk *disk, int policy)
+    : _disk(disk), _policy(FCFS), _up(true), _busy(false), _stop(false),
+      _served(0) {
+    if(!disk) throw std::invalid_argument("ERROR No disk for scheduler");
+
+    set_policy(policy);
+    _dispatcher = std::thread(&IOScheduler::_dispatch, this);
+}
+
+IOScheduler::~IOScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _queued.notify_one();
+    _dispatcher.join();
+}
+
+std::future<std::string> IOScheduler::read(std::size_t cyl, std::size_t sec) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _queue.emplace_back();
+    _queue.back().op = READ;
+    _queue.back().cyl = cyl;
+    _queue.back().sec = sec;
+    _queued.notify_one();
+
+    return _queue.back().read.get_future();
+}
+
+std::future<bool> IOScheduler::write(std::size_t cyl, std::size_t sec,
+                                     const std::string &data) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _queue.emplace_back();
+    _queue.back().op = WRITE;
+    _queue.back().cyl = cyl;
+    _queue.back().sec = sec;
+    _queue.back().data = data;
+    _queued.notify_one();
+
+    return _queue.back().write.get_future();
+}
+
+int IOScheduler::policy() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _policy;
+}
+
+void IOScheduler::set_policy(int p) {
+    if(p < FCFS || p > CLOOK) throw std::out_of_range("ERROR Invalid policy");
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _policy = p;
+    _up = true;
+}
+
+std::size_t IOScheduler::pending() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _queue.size();
+}
+
+std::size_t IOScheduler::served() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _served;
+}
+
+void IOScheduler::drain() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this] { return _queue.empty() && !_busy; });
+}
+
+const char *IOScheduler::policy_name(int p) {
+    static const char *names[] = {"FCFS", "SSTF", "SCAN", "CLOOK"};
+
+    return p < FCFS || p > CLOOK ? "UNKNOWN" : names[p];
+}
+
+void IOScheduler::_dispatch() {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while(true) {
+        _queued.wait(lock, [this] { return _stop || !_queue.empty(); });
+
+        if(_queue.empty()) break;  // stopping with nothing left to serve
+
+        std::list<Request>::iterator it = _next(_disk->head());
+        Request request = std::move(*it);
+        _queue.erase(it);
+        _busy = true;
+
+        // serve without the lock so callers keep queueing
+        lock.unlock();
+        if(request.op == READ)
+            request.read.set_value(_disk->read_at(request.cyl, request.sec));
+        else
+            request.write.set_value(
+                _disk->write_at(request.data.c_str(), request.cyl,
+                                request.sec, request.data.size()));
+        lock.lock();
+
+        _busy = false;
+        ++_served;
+        _idle.notify_all();
+    }
+}
+
+std::list<IOScheduler::Request>::iterator IOScheduler::_next(
+    std::size_t head) {
+    std::list<Request>::iterator best = _queue.begin(), it;
+    std::size_t best_dist = 0, dist = 0;
+    bool found = false;
+
+    if(_policy == FCFS) return best;
+
+    // SCAN and CLOOK look ahead of the head, SSTF in both directions
+    for(int pass = 0; pass < 2 && !found; ++pass) {
+        for(it = _queue.begin(); it != _queue.end(); ++it) {
+            bool ahead = _up ? it->cyl >= head : it->cyl <= head;
+
+            if(_policy == SSTF)
+                dist = it->cyl > head ? it->cyl - head : head - it->cyl;
+            else if(_policy == CLOOK && pass == 1)
+                dist = it->cyl;  // wrapped, lowest cylinder first
+            else if(ahead)
+                dist = _up ? it->cyl - head : head - it->cyl;
+            else
+                continue;
+
+            if(!found || dist < best_dist) {
+                best = it;
+                best_dist = dist;
+                found = true;
+            }
+        }
+
+        // nothing ahead: SCAN reverses, CLOOK wraps to the lowest cylinder
+        if(!found && _policy == SCAN) _up = !_up;
+    }
+
+    return best;
+}
+
+}  // namespace fs
@@ -0,0 +1,489 @@
+#include "../include/journal.h"
+
+namespace fs {
+
+thread_local std::vector<std::pair<const char *, std::size_t>>
+    Journal::_records;
+std::atomic<int> Journal::_shadows(0);
+
+Journal::Journal()
+    : _disk(nullptr),
+      _block_size(0),
+      _disk_blocks(0),
+      _start(0),
+      _blocks(0),
+      _head(1),
+      _sequence(1),
+      _open_batch(1),
+      _done_batch(0),
+      _writing(false),
+      _commits(0),
+      _batches(0),
+      _logged(0),
+      _checkpoints(0),
+      _replayed(0) {}
+
+void Journal::attach(Disk *disk, std::size_t block_size, long start,
+                     std::size_t blocks) {
+    detach();
+
+    _disk = disk;
+    _block_size = block_size;
+    _disk_blocks = disk && block_size ? block_size / disk->max_block() : 0;
+    _start = start;
+    _blocks = disk && blocks >= MIN_BLOCKS && _per_record() > 0 ? blocks : 0;
+    _head = 1;
+    _sequence = 1;
+}
+
+void Journal::detach() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::lock_guard<std::mutex> stage_lock(_stage_mutex);
+
+    if(!_image.empty()) --_shadows;
+    _image = std::vector<char>();
+    _staged.clear();
+    _staged_at.clear();
+    _pending = Batch();
+    _blocks = 0;
+}
+
+bool Journal::enabled() const { return _blocks > 0; }
+
+long Journal::start() const { return _start; }
+
+std::size_t Journal::blocks() const { return _blocks; }
+
+void Journal::format() {
+    std::vector<char> super(_block_size);
+    uint64_t *fields = (uint64_t *)super.data();
+    struct iovec iov = {super.data(), _block_size};
+
+    if(!enabled()) return;
+
+    // a reformatted journal continues past any sequence left in its blocks
+    _disk->read_blocks(_start * _disk_blocks, _disk_blocks, &iov, 1);
+    _sequence = fields[0] == MAGIC ? fields[1] + _blocks : 1;
+    _reset();
+    _load_image();
+}
+
+std::size_t Journal::replay() {
+    std::vector<char> header(_block_size);
+    Batch staged;
+    std::size_t applied = 0, pos = 1, per = _per_record();
+    uint64_t *fields = (uint64_t *)header.data();
+    struct iovec iov = {header.data(), _block_size};
+
+    if(!enabled()) return 0;
+
+    // a journal never formatted starts empty
+    _disk->read_blocks(_start * _disk_blocks, _disk_blocks, &iov, 1);
+    if(fields[0] != MAGIC) {
+        format();
+        return 0;
+    }
+    uint64_t first = _sequence = fields[1];
+
+    while(pos < _blocks) {
+        _disk->read_blocks((_start + pos) * _disk_blocks, _disk_blocks, &iov,
+                           1);
+
+        uint64_t count = fields[2], last = fields[3], sum = fields[4];
+        uint64_t *ranges = fields + HEADER_FIELDS;
+        std::size_t bytes = 0, data_blocks = 0;
+        bool is_valid = fields[0] == RECORD_MAGIC &&
+                        fields[1] == _sequence && count <= per;
+
+        // ranges lie inside their home block on the disk
+        for(std::size_t i = 0; i < count && is_valid; ++i) {
+            long block = long(ranges[i * RANGE_FIELDS]);
+            std::size_t offset = ranges[i * RANGE_FIELDS + 1] >> 32;
+            std::size_t len = ranges[i * RANGE_FIELDS + 1] & 0xffffffff;
+
+            is_valid = block > -1 &&
+                       (block + 1) * _disk_blocks <= _disk->total_blocks() &&
+                       offset + len <= _block_size;
+            bytes += len;
+        }
+        data_blocks = (bytes + _block_size - 1) / _block_size;
+        if(!is_valid || pos + 1 + data_blocks > _blocks) break;
+
+        // range bytes follow the record block, checked with the record
+        std::size_t at = staged.data.size();
+        staged.data.resize(at + data_blocks * _block_size);
+        if(data_blocks > 0) {
+            struct iovec data = {staged.data.data() + at,
+                                 data_blocks * _block_size};
+            _disk->read_blocks((_start + pos + 1) * _disk_blocks,
+                               data_blocks * _disk_blocks, &data, 1);
+        }
+
+        fields[4] = 0;
+        uint64_t hash = _checksum(0, header.data(), _block_size);
+        hash = _checksum(hash, staged.data.data() + at,
+                         data_blocks * _block_size);
+        if(hash != sum) break;
+
+        for(std::size_t i = 0; i < count; ++i) {
+            std::size_t len = ranges[i * RANGE_FIELDS + 1] & 0xffffffff;
+
+            staged.ranges.push_back({long(ranges[i * RANGE_FIELDS]),
+                                     ranges[i * RANGE_FIELDS + 1] >> 32, len,
+                                     at});
+            at += len;
+        }
+
+        pos += 1 + data_blocks;
+        ++_sequence;
+
+        // a batch applies once its last record is read
+        if(last) {
+            _home(staged);
+            staged.ranges.clear();
+            staged.data.clear();
+            ++applied;
+        }
+    }
+
+    // applied blocks are durable before the journal is emptied, and records
+    // left past the last batch can not match the sequences that follow
+    if(applied > 0) _disk->flush();
+    _sequence = first + _blocks;
+    _reset();
+    _load_image();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _replayed += applied;
+
+    return applied;
+}
+
+char *Journal::image() { return _image.empty() ? nullptr : _image.data(); }
+
+char *Journal::stage(long block) {
+    std::lock_guard<std::mutex> lock(_stage_mutex);
+
+    if(!enabled() || block < 0) return nullptr;
+    if(block < _start) return _image.data() + block * _block_size;
+
+    // staged blocks stay at one address while attached, as entries point
+    // into them
+    auto it = _staged.find(block);
+    if(it != _staged.end()) return it->second.get();
+
+    const char *home = _disk->data_at(block * _disk_blocks, _disk_blocks);
+    if(!home) return nullptr;
+
+    char *data = new char[_block_size];
+    memcpy(data, home, _block_size);
+    _staged[block].reset(data);
+    _staged_at[data] = block;
+
+    return data;
+}
+
+void Journal::record(const void *address, std::size_t len) {
+    if(_shadows.load(std::memory_order_relaxed) > 0 && address && len > 0)
+        _records.emplace_back((const char *)address, len);
+}
+
+void Journal::commit() {
+    std::vector<std::pair<const char *, std::size_t>> records;
+
+    records.swap(_records);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    std::size_t captured = _pending.ranges.size();
+
+    if(!enabled() || records.empty()) return;
+
+    // copy this update's bytes now, later commits of a range replace them
+    _capture(records);
+    if(_pending.ranges.size() == captured) return;
+    ++_commits;
+
+    std::size_t ticket = _open_batch;
+
+    // first caller to find no writer writes every commit joined so far
+    while(_done_batch < ticket) {
+        if(_writing) {
+            _written.wait(lock);
+            continue;
+        }
+
+        Batch batch;
+        std::size_t batch_number = _open_batch++;
+
+        std::swap(batch, _pending);
+        _writing = true;
+        lock.unlock();
+
+        _write(batch);
+
+        lock.lock();
+        _writing = false;
+        _done_batch = batch_number;
+        ++_batches;
+        _logged += batch.ranges.size();
+        _written.notify_all();
+    }
+}
+
+void Journal::checkpoint() {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if(!enabled()) return;
+
+    _written.wait(lock, [this] { return !_writing; });
+    _writing = true;
+    lock.unlock();
+
+    // header, FAT and free map are copied whole, directory blocks only
+    // ever reach home through their logged ranges
+    struct iovec iov = {_image.data(), _image.size()};
+    _disk->write_blocks(0, _start * _disk_blocks, &iov, 1);
+    _disk->flush();
+    _reset();
+
+    lock.lock();
+    _writing = false;
+    ++_checkpoints;
+    _written.notify_all();
+}
+
+std::size_t Journal::commits() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _commits;
+}
+
+std::size_t Journal::batches() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _batches;
+}
+
+std::size_t Journal::logged() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _logged;
+}
+
+std::size_t Journal::checkpoints() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _checkpoints;
+}
+
+std::size_t Journal::replayed() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _replayed;
+}
+
+std::string Journal::info() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    return "Journal blocks: " + std::to_string(_blocks) +
+           "\nJournal commits: " + std::to_string(_commits) +
+           "\nJournal batches: " + std::to_string(_batches) +
+           "\nJournal logged ranges: " + std::to_string(_logged) +
+           "\nJournal checkpoints: " + std::to_string(_checkpoints) +
+           "\nJournal replayed batches: " + std::to_string(_replayed);
+}
+
+void Journal::_capture(
+    std::vector<std::pair<const char *, std::size_t>> &records) {
+    std::vector<Range> ranges;
+    std::lock_guard<std::mutex> lock(_stage_mutex);
+    const char *image = _image.data();
+
+    // find the shadow block of each range, splitting image ranges at blocks
+    for(const auto &record : records) {
+        const char *from = record.first, *end = record.first + record.second;
+
+        if(from >= image && end <= image + _image.size()) {
+            while(from < end) {
+                std::size_t offset = (from - image) % _block_size;
+                std::size_t len =
+                    std::min<std::size_t>(end - from, _block_size - offset);
+
+                ranges.push_back(
+                    {long((from - image) / _block_size), offset, len, 0});
+                from += len;
+            }
+            continue;
+        }
+
+        auto it = _staged_at.upper_bound(from);
+        if(it == _staged_at.begin()) continue;
+        --it;
+        if(end <= it->first + _block_size)
+            ranges.push_back(
+                {it->second, std::size_t(from - it->first), record.second, 0});
+    }
+
+    // fields written next to each other log as one range
+    std::sort(ranges.begin(), ranges.end(),
+              [](const Range &a, const Range &b) {
+                  return a.block < b.block ||
+                         (a.block == b.block && a.offset < b.offset);
+              });
+
+    for(std::size_t i = 0; i < ranges.size(); ++i) {
+        Range range = ranges[i];
+        const char *shadow =
+            range.block < _start ? image + range.block * _block_size
+                                 : _staged[range.block].get();
+
+        while(i + 1 < ranges.size() && ranges[i + 1].block == range.block &&
+              ranges[i + 1].offset <= range.offset + range.len) {
+            range.len = std::max(range.len, ranges[i + 1].offset +
+                                                ranges[i + 1].len -
+                                                range.offset);
+            ++i;
+        }
+
+        range.at = _pending.data.size();
+        _pending.data.insert(_pending.data.end(), shadow + range.offset,
+                             shadow + range.offset + range.len);
+        _pending.ranges.push_back(range);
+    }
+}
+
+void Journal::_write(const Batch &batch) {
+    std::size_t per = _per_record(), needed = 0;
+    std::vector<std::pair<std::size_t, std::size_t>> records;  // ranges
+
+    if(batch.ranges.empty()) return;
+
+    // each record lists up to per ranges, their bytes in the blocks after it
+    for(std::size_t i = 0; i < batch.ranges.size(); i += per) {
+        std::size_t end = std::min(i + per, batch.ranges.size());
+        const Range &last = batch.ranges[end - 1];
+        std::size_t bytes = last.at + last.len - batch.ranges[i].at;
+
+        records.emplace_back(i, end);
+        needed += 1 + (bytes + _block_size - 1) / _block_size;
+    }
+
+    // too large for the journal, write home blocks through instead
+    if(needed > _blocks - 1) {
+        _home(batch);
+        _disk->flush();
+        return;
+    }
+
+    // full journal, make home blocks durable and start over
+    if(_head + needed > _blocks) {
+        _disk->flush();
+        _reset();
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++_checkpoints;
+    }
+
+    std::vector<char> log(needed * _block_size);
+    char *record = log.data();
+
+    for(std::size_t r = 0; r < records.size(); ++r) {
+        uint64_t *fields = (uint64_t *)record;
+        uint64_t *ranges = fields + HEADER_FIELDS;
+        char *data = record + _block_size;
+        const Range &first = batch.ranges[records[r].first];
+        const Range &last = batch.ranges[records[r].second - 1];
+        std::size_t bytes = last.at + last.len - first.at;
+        std::size_t count = records[r].second - records[r].first;
+
+        for(std::size_t i = 0; i < count; ++i) {
+            const Range &range = batch.ranges[records[r].first + i];
+
+            ranges[i * RANGE_FIELDS] = range.block;
+            ranges[i * RANGE_FIELDS + 1] =
+                uint64_t(range.offset) << 32 | range.len;
+        }
+        memcpy(data, batch.data.data() + first.at, bytes);
+        bytes = (bytes + _block_size - 1) / _block_size * _block_size;
+
+        fields[0] = RECORD_MAGIC;
+        fields[1] = _sequence++;
+        fields[2] = count;
+        fields[3] = r + 1 == records.size();
+        fields[4] = 0;
+        fields[4] =
+            _checksum(_checksum(0, record, _block_size), data, bytes);
+
+        record = data + bytes;
+    }
+
+    struct iovec iov = {log.data(), log.size()};
+    _disk->write_blocks((_start + _head) * _disk_blocks,
+                        needed * _disk_blocks, &iov, 1);
+    _flush(_head, needed);
+    _head += needed;
+
+    // logged, so home blocks may now take the ranges
+    _home(batch);
+}
+
+void Journal::_home(const Batch &batch) {
+    std::size_t disk_block = _disk->max_block();
+
+    for(const Range &range : batch.ranges) {
+        char *home = _disk->data_at(range.block * _disk_blocks, _disk_blocks);
+
+        if(!home) continue;
+        memcpy(home + range.offset, batch.data.data() + range.at, range.len);
+        std::size_t first = range.offset / disk_block;
+
+        _disk->mark_dirty(range.block * _disk_blocks + first,
+                          (range.offset + range.len - 1) / disk_block -
+                              first + 1);
+    }
+}
+
+void Journal::_load_image() {
+    std::lock_guard<std::mutex> lock(_stage_mutex);
+    struct iovec iov;
+
+    if(_image.empty()) ++_shadows;
+    _image.assign(_start * _block_size, 0);
+    iov = {_image.data(), _image.size()};
+    _disk->read_blocks(0, _start * _disk_blocks, &iov, 1);
+}
+
+void Journal::_reset() {
+    std::vector<char> super(_block_size);
+    uint64_t *fields = (uint64_t *)super.data();
+    struct iovec iov = {super.data(), _block_size};
+
+    // records before the new sequence no longer replay
+    fields[0] = MAGIC;
+    fields[1] = _sequence;
+
+    _disk->write_blocks(_start * _disk_blocks, _disk_blocks, &iov, 1);
+    _flush(0, 1);
+    _head = 1;
+}
+
+void Journal::_flush(std::size_t block, std::size_t count) {
+    _disk->flush((_start + block) * _disk_blocks, count * _disk_blocks);
+}
+
+std::size_t Journal::_per_record() const {
+    std::size_t header = HEADER_FIELDS * sizeof(uint64_t);
+
+    return _block_size > header
+               ? (_block_size - header) / (RANGE_FIELDS * sizeof(uint64_t))
+               : 0;
+}
+
+uint64_t Journal::_checksum(uint64_t hash, const char *data,
+                            std::size_t len) {
+    // FNV-1a, continued from hash
+    if(hash == 0) hash = 0xcbf29ce484222325;
+
+    for(std::size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+}  // namespace fs
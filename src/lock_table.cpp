@@ -0,0 +1,97 @@
+#include "../include/lock_table.h"
+
+namespace fs {
+
+LockTable::Guard::Guard() : _table(nullptr), _key(0), _mode(SHARED) {}
+
+LockTable::Guard::Guard(LockTable *table, long key, int mode)
+    : _table(table), _key(key), _mode(mode) {
+    _table->lock(key, mode);
+}
+
+LockTable::Guard::Guard(Guard &&other)
+    : _table(other._table), _key(other._key), _mode(other._mode) {
+    other._table = nullptr;
+}
+
+LockTable::Guard &LockTable::Guard::operator=(Guard &&other) {
+    if(this != &other) {
+        unlock();
+
+        _table = other._table;
+        _key = other._key;
+        _mode = other._mode;
+        other._table = nullptr;
+    }
+    return *this;
+}
+
+LockTable::Guard::~Guard() { unlock(); }
+
+bool LockTable::Guard::owns() const { return _table != nullptr; }
+
+long LockTable::Guard::key() const { return _key; }
+
+int LockTable::Guard::mode() const { return _mode; }
+
+void LockTable::Guard::unlock() {
+    if(_table) _table->unlock(_key, _mode);
+    _table = nullptr;
+}
+
+LockTable::LockTable() : _contended(0) {}
+
+void LockTable::lock(long key, int mode) {
+    Node *node = nullptr;
+    bool is_locked = false;
+
+    // node is counted before it is waited on, so it outlives the wait
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        node = &_nodes[key];
+        ++node->refs;
+    }
+
+    if(mode == EXCLUSIVE)
+        is_locked = node->lock.try_lock();
+    else
+        is_locked = node->lock.try_lock_shared();
+
+    if(!is_locked) {
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            ++_contended;
+        }
+
+        if(mode == EXCLUSIVE)
+            node->lock.lock();
+        else
+            node->lock.lock_shared();
+    }
+}
+
+void LockTable::unlock(long key, int mode) {
+    std::lock_guard<std::mutex> guard(_mutex);
+    auto it = _nodes.find(key);
+
+    if(it == _nodes.end()) return;
+
+    if(mode == EXCLUSIVE)
+        it->second.lock.unlock();
+    else
+        it->second.lock.unlock_shared();
+
+    if(--it->second.refs == 0) _nodes.erase(it);
+}
+
+std::size_t LockTable::size() const {
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _nodes.size();
+}
+
+std::size_t LockTable::contended() const {
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _contended;
+}
+
+}  // namespace fs
@@ -0,0 +1,79 @@
+#include "../include/mount.h"
+
+namespace fs {
+
+Mount::Mount(std::string name, int cylinders, int sectors)
+    : name(name),
+      disk(name, cylinders, sectors),
+      refs(0),
+      is_opened(false) {}
+
+MountTable::MountTable(const Options &options) : _options(options) {}
+
+MountTable::~MountTable() {
+    // mounts still held at exit are closed clean
+    for(auto &mount : _mounts) mount.second->fatfs.close_disk();
+}
+
+Mount *MountTable::acquire(const std::string &name) {
+    Mount *mount = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::unique_ptr<Mount> &slot = _mounts[name];
+
+        if(!slot) {
+            slot.reset(new Mount(name, _options.cylinders, _options.sectors));
+            slot->disk.set_track_time(_options.track_time);
+            slot->disk.set_backend(_options.backend);
+            slot->disk.set_durability(_options.durability);
+            slot->fatfs.set_cache_size(_options.cache_mb);
+        }
+        mount = slot.get();
+        ++mount->refs;
+    }
+
+    // first connection opens an existing image, the others wait for it
+    std::lock_guard<std::shared_mutex> lock(mount->mutex);
+
+    if(!mount->is_opened) {
+        mount->is_opened = true;
+
+        try {
+            if(mount->disk.open(name)) {
+                mount->fatfs.set_disk(&mount->disk);
+                mount->fatfs.open_disk();
+            }
+        } catch(const std::exception &e) {
+            mount->error = e.what();
+        }
+    }
+
+    return mount;
+}
+
+void MountTable::release(Mount *mount) {
+    std::unique_ptr<Mount> last;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _mounts.find(mount->name);
+
+        if(it == _mounts.end() || it->second.get() != mount) return;
+        if(--mount->refs > 0) return;
+
+        last = std::move(it->second);
+        _mounts.erase(it);
+    }
+
+    // no connection can reach the mount, persist free map and mark disk
+    // clean for next mount
+    last->fatfs.close_disk();
+}
+
+std::size_t MountTable::size() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _mounts.size();
+}
+
+}  // namespace fs
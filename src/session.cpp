@@ -0,0 +1,30 @@
+#include "../include/session.h"
+
+namespace fs {
+
+Session::Session(int access) : _cwd(-1), _path("/"), _mount(0), _generation(0) {
+    set_access(access);
+}
+
+long Session::cwd() const { return _cwd; }
+
+const std::string &Session::path() const { return _path; }
+
+unsigned long Session::mount() const { return _mount; }
+
+int Session::access() const { return _access; }
+
+void Session::set_access(int access) {
+    _access = access == READ_ONLY ? READ_ONLY : READ_WRITE;
+}
+
+bool Session::read_only() const { return _access == READ_ONLY; }
+
+void Session::reset() {
+    _cwd = -1;
+    _path = "/";
+    _mount = 0;
+    _generation = 0;
+}
+
+}  // namespace fs
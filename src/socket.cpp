@@ -134,17 +134,21 @@ void recv_msg(int sockfd, std::string &msg) {
 
     try {
         // read first message to determine message size
-        bytes = recv(sockfd, (char *)&msg_size, sizeof(msg_size), 0);
+        bytes = recv(sockfd, (char *)&msg_size, sizeof(msg_size), MSG_WAITALL);
         throw_socket_io(bytes);
 
         if(msg_size > 0) {
+            msg.reserve(msg_size);
+
             // keep reading from socket until msg_sze is reached
+            // read no more than the rest of this message, data may be binary
             while(bytes > 0 && totalbytes < msg_size) {
-                bytes = recv(sockfd, buf, BUFLEN - 1, 0);
+                bytes = recv(sockfd, buf,
+                             std::min<ssize_t>(BUFLEN, msg_size - totalbytes),
+                             0);
                 throw_socket_io(bytes);
 
-                buf[bytes] = '\0';
-                msg += buf;
+                msg.append(buf, bytes);
 
                 totalbytes += bytes;
             }
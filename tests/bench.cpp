@@ -0,0 +1,926 @@
+#include <algorithm>     // sort()
+#include <cstdlib>       // rand(), srand(), rand_r()
+#include <cstring>       // memset()
+#include <functional>    // std::function
+#include <iomanip>       // setw()
+#include <iostream>      // stream
+#include <mutex>         // std::mutex
+#include <shared_mutex>  // std::shared_mutex
+#include <sstream>       // ostringstream
+#include <string>        // std::string
+#include <thread>        // std::thread
+#include <vector>        // std::vector
+#include "../include/fat.h"
+#include "../include/io_scheduler.h"
+#include "../include/mount.h"
+#include "../include/timer.h"
+
+// BENCHMARKS
+// allocation policies: fragmentation and sequential read after churn, with
+// simulated seek distance and disk time of the reads
+void bench_alloc();
+
+// path resolution: deep path lookups through dentry cache
+void bench_dentry();
+
+// disk creation time by image size and provisioning, up to max_mb
+void bench_create(std::size_t max_mb);
+
+// block size: data chain length and throughput of a large file
+void bench_blocks();
+
+// disk access: per sector reads against one vectored read of a run
+void bench_vector();
+
+// disk scheduling: throughput and latency of random reads and writes from
+// concurrent clients, as disk_client_rand sends them, by policy, in
+// simulated time of a virtual clock
+void bench_sched();
+
+// cache model: simulated hit rates by block class and disk time of skewed
+// lookups and reads, by cache size
+void bench_cache();
+
+// disk backends: create, random block writes, first reads, sync and open
+void bench_backend();
+
+// durability: file writes with flushes by mode, flush latency and bytes
+void bench_durability();
+
+// journal: metadata commits from concurrent threads, commits sharing each
+// journal flush by group commit
+void bench_journal();
+
+// mount: connect and disconnect of a client opening its own Disk and FatFS
+// against one shared through the mount table
+void bench_mount();
+
+// concurrency: file create, write, read and delete from threads each in its
+// own directory of one FatFS, with entry locks against one global lock
+void bench_stress();
+
+// sessions: clients of one FatFS each in its own working directory, with a
+// Session per client against changing the filesystem's current directory
+// under an exclusive lock, and commits the journal logs per flush
+void bench_session();
+
+int main(int argc, char *argv[]) {
+    std::string which = "all";
+
+    if(argc > 1) which = argv[1];
+
+    if(which == "all" || which == "alloc") bench_alloc();
+    if(which == "all" || which == "dentry") bench_dentry();
+    if(which == "all" || which == "create")
+        bench_create(argc > 2 ? std::stoul(argv[2]) : 8192);
+    if(which == "all" || which == "blocks") bench_blocks();
+    if(which == "all" || which == "vector") bench_vector();
+    if(which == "all" || which == "sched") bench_sched();
+    if(which == "all" || which == "cache") bench_cache();
+    if(which == "all" || which == "backend") bench_backend();
+    if(which == "all" || which == "durability") bench_durability();
+    if(which == "all" || which == "journal") bench_journal();
+    if(which == "all" || which == "mount") bench_mount();
+    if(which == "all" || which == "stress") bench_stress();
+    if(which == "all" || which == "session") bench_session();
+
+    return 0;
+}
+
+void bench_alloc() {
+    const int FILES = 32, OPS = 4000, READS = 20, SEED = 4440;
+    const char *policies[] = {"SINGLE", "FIRST_FIT", "NEXT_FIT", "BEST_FIT"};
+    std::string data(4096, 'x');
+    std::vector<char> buf;
+
+    std::cout << "\nAllocation policy after " << OPS << " ops on " << FILES
+              << " files" << std::endl;
+    std::cout << std::left << std::setw(12) << "policy" << std::right
+              << std::setw(14) << "file extents" << std::setw(14)
+              << "free extents" << std::setw(14) << "largest free"
+              << std::setw(12) << "read MB/s" << std::setw(12) << "seek cyl"
+              << std::setw(12) << "sim ms" << std::endl;
+
+    for(int policy = fs::Fat::SINGLE; policy <= fs::Fat::BEST_FIT; ++policy) {
+        fs::Disk disk("bench-alloc", 64, 512);
+        fs::FatFS fatfs;
+        std::vector<std::string> names;
+        std::size_t extents = 0, bytes = 0;
+        timer::ChronoTimer timer;
+
+        disk.create();
+        fatfs.set_disk(&disk);
+        fatfs.format();
+        fatfs.set_alloc_policy(policy);
+
+        for(int i = 0; i < FILES; ++i) {
+            names.push_back("file" + std::to_string(i));
+            fatfs.add_file(names.back());
+        }
+
+        // churn: interleaved appends, rewrites and recreates
+        srand(SEED);
+        for(int i = 0; i < OPS; ++i) {
+            const std::string &name = names[rand() % FILES];
+            fs::FileEntry file = fatfs.find_file(name);
+            int op = rand() % 10;
+
+            if(op < 6)
+                fatfs.append_file_data(file, data.c_str(), rand() % 512 + 1);
+            else if(op < 8)
+                fatfs.write_file_data(file, data.c_str(), rand() % 4096);
+            else {
+                fatfs.delete_file(name);
+                fatfs.add_file(name);
+            }
+        }
+
+        for(const std::string &name : names) {
+            fs::FileEntry file = fatfs.find_file(name);
+            extents += fatfs.file_extents(file);
+        }
+
+        // sequential read of all files
+        disk.reset_timing();
+        timer.start();
+        for(int r = 0; r < READS; ++r)
+            for(const std::string &name : names) {
+                fs::FileEntry file = fatfs.find_file(name);
+
+                buf.resize(file.data_size() + 1);
+                bytes += fatfs.read_file_data(file, buf.data(),
+                                              file.data_size());
+            }
+        timer.stop();
+
+        std::cout << std::left << std::setw(12) << policies[policy]
+                  << std::right << std::setw(14) << std::fixed
+                  << std::setprecision(2) << (double)extents / FILES
+                  << std::setw(14) << fatfs.free_extents() << std::setw(14)
+                  << fatfs.largest_free_extent() << std::setw(12)
+                  << bytes / timer.seconds() / (1 << 20) << std::setw(12)
+                  << disk.timing().cylinders << std::setw(12)
+                  << disk.timing().total() / 1000.0 << std::endl;
+
+        fatfs.remove();
+    }
+}
+
+void bench_dentry() {
+    const int DEPTH = 16, WIDTH = 32, LOOKUPS = 20000;
+    fs::Disk disk("bench-dentry", 1024, 128);
+    fs::FatFS fatfs;
+    std::string path;
+    std::size_t found = 0;
+    timer::ChronoTimer timer;
+
+    // lookups pay directory reads in simulated time only
+    disk.set_virtual_clock(true);
+    disk.create();
+    fatfs.set_disk(&disk);
+    fatfs.format();
+
+    // deep path with siblings at every level
+    for(int d = 0; d < DEPTH; ++d) {
+        for(int w = 0; w < WIDTH; ++w)
+            fatfs.add_dir(path + "/dir" + std::to_string(w));
+        path += "/dir" + std::to_string(WIDTH - 1);
+    }
+    fatfs.add_file(path + "/file");
+
+    timer.start();
+    for(int i = 0; i < LOOKUPS; ++i) {
+        found += bool(fatfs.find_file(path + "/file"));
+        found += bool(fatfs.find_file(path + "/missing/file"));
+    }
+    timer.stop();
+
+    std::cout << "\nPath resolution, depth " << DEPTH << ", " << found
+              << " found of " << 2 * LOOKUPS << " lookups" << std::endl;
+    std::cout << std::fixed << std::setprecision(2)
+              << 2 * LOOKUPS / timer.seconds() << " lookups/s" << std::endl;
+    std::cout << fatfs.cache_info() << std::endl;
+
+    fatfs.remove();
+}
+
+void bench_create(std::size_t max_mb) {
+    const int SECTORS = 1024;
+    const char *modes[] = {"sparse", "prealloc", "prefault"};
+    std::vector<std::size_t> sizes;
+
+    // sizes grow 8x from 1 MB and end at max_mb itself
+    for(std::size_t mb = 1; mb < max_mb; mb *= 8) sizes.push_back(mb);
+    sizes.push_back(max_mb);
+
+    std::cout << "\nDisk creation time (ms)" << std::endl;
+    std::cout << std::left << std::setw(12) << "size MB" << std::right;
+    for(const char *mode : modes) std::cout << std::setw(12) << mode;
+    std::cout << std::endl;
+
+    for(std::size_t mb : sizes) {
+        int cylinders = (mb << 20) / (SECTORS * fs::Disk::MAX_BLOCK);
+
+        std::cout << std::left << std::setw(12) << mb << std::right;
+
+        for(int mode = 0; mode < 3; ++mode) {
+            fs::Disk disk("bench-create", cylinders, SECTORS);
+            timer::ChronoTimer timer;
+
+            disk.set_provision(mode == 0 ? fs::Disk::SPARSE
+                                         : fs::Disk::PREALLOCATE);
+            disk.set_prefault(mode == 2);
+
+            try {
+                timer.start();
+                disk.create();
+                timer.stop();
+
+                std::cout << std::setw(12) << std::fixed
+                          << std::setprecision(2) << timer.seconds() * 1000;
+            } catch(const std::exception &e) {
+                std::cout << std::setw(12) << "failed";
+            }
+            disk.remove();
+        }
+        std::cout << std::endl;
+    }
+}
+
+void bench_blocks() {
+    const std::size_t FILE_SZ = 8 << 20, CHUNK = 64 << 10;
+    const std::size_t sizes[] = {0, 512, 4096, 16384, 65536};
+    std::string data(CHUNK, 'x');
+    std::vector<char> buf(FILE_SZ);
+
+    std::cout << "\nBlock size with " << (FILE_SZ >> 20) << " MB file"
+              << std::endl;
+    std::cout << std::left << std::setw(12) << "block" << std::right
+              << std::setw(14) << "chain blocks" << std::setw(12)
+              << "write MB/s" << std::setw(12) << "read MB/s" << std::endl;
+
+    for(std::size_t size : sizes) {
+        fs::Disk disk("bench-blocks", 256, 1024);  // 32 MB
+        fs::FatFS fatfs;
+        fs::FileEntry file;
+        double write_time = 0, read_time = 0;
+        timer::ChronoTimer timer;
+
+        disk.create();
+        fatfs.set_disk(&disk);
+        fatfs.set_block_size(size);
+        fatfs.format();
+        file = fatfs.add_file("file");
+
+        timer.start();
+        for(std::size_t bytes = 0; bytes < FILE_SZ; bytes += CHUNK)
+            fatfs.append_file_data(file, data.c_str(), CHUNK);
+        timer.stop();
+        write_time = timer.seconds();
+
+        timer.start();
+        fatfs.read_file_data(file, buf.data(), FILE_SZ);
+        timer.stop();
+        read_time = timer.seconds();
+
+        // 0 formats one disk block
+        size = fatfs.block_size();
+        std::cout << std::left << std::setw(12) << size << std::right
+                  << std::setw(14) << (FILE_SZ + size - 1) / size
+                  << std::setw(12) << std::fixed << std::setprecision(2)
+                  << FILE_SZ / write_time / (1 << 20) << std::setw(12)
+                  << FILE_SZ / read_time / (1 << 20) << std::endl;
+
+        fatfs.remove();
+    }
+}
+
+void bench_vector() {
+    const std::size_t SECTORS = 64;
+    const std::size_t runs[] = {1, 8, 64, 512};
+    fs::Disk disk("bench-vector", 16, SECTORS);
+    std::vector<char> buf(16 * SECTORS * fs::Disk::MAX_BLOCK);
+    timer::ChronoTimer timer;
+
+    disk.create();
+
+    std::cout << "\nDisk reads of a run of blocks (ms)" << std::endl;
+    std::cout << std::left << std::setw(12) << "blocks" << std::right
+              << std::setw(12) << "read_at" << std::setw(14) << "read_blocks"
+              << std::endl;
+
+    for(std::size_t run : runs) {
+        double at_time = 0, blocks_time = 0;
+        struct iovec iov = {buf.data(), run * fs::Disk::MAX_BLOCK};
+
+        // one call per sector, each a seek and a copy to a new string
+        timer.start();
+        for(std::size_t i = 0; i < run; ++i) {
+            std::string data = disk.read_at(i / SECTORS, i % SECTORS);
+            memcpy(buf.data() + i * fs::Disk::MAX_BLOCK, data.c_str() + 1,
+                   fs::Disk::MAX_BLOCK);
+        }
+        timer.stop();
+        at_time = timer.seconds();
+
+        // one seek and a transfer into the caller buffer
+        timer.start();
+        disk.read_blocks(0, run, &iov, 1);
+        timer.stop();
+        blocks_time = timer.seconds();
+
+        std::cout << std::left << std::setw(12) << run << std::right
+                  << std::fixed << std::setprecision(2) << std::setw(12)
+                  << at_time * 1000 << std::setw(14) << blocks_time * 1000
+                  << std::endl;
+    }
+
+    disk.remove();
+}
+
+void bench_sched() {
+    const int CLIENTS = 8, OPS = 2000, CYLINDERS = 100, SECTORS = 32;
+
+    std::cout << "\nDisk scheduling of " << CLIENTS << " clients x " << OPS
+              << " random requests, simulated time" << std::endl;
+    std::cout << std::left << std::setw(12) << "policy" << std::right
+              << std::setw(12) << "ops/s" << std::setw(12) << "p50 us"
+              << std::setw(12) << "p99 us" << std::setw(12) << "max us"
+              << std::setw(12) << "seek cyl" << std::setw(12) << "wall ms"
+              << std::endl;
+
+    for(int policy = fs::IOScheduler::FCFS; policy <= fs::IOScheduler::CLOOK;
+        ++policy) {
+        fs::Disk disk("bench-sched", CYLINDERS, SECTORS);
+        std::vector<std::vector<double>> latencies(CLIENTS);
+        std::vector<double> all;
+        std::vector<std::thread> clients;
+        timer::ChronoTimer timer;
+
+        disk.create();
+        disk.set_virtual_clock(true);
+
+        {
+            fs::IOScheduler scheduler(&disk, policy);
+
+            timer.start();
+            for(int c = 0; c < CLIENTS; ++c)
+                clients.emplace_back([&, c] {
+                    unsigned int seed = c;
+                    std::string data(fs::Disk::MAX_BLOCK, 'x');
+                    std::size_t start = 0;
+
+                    // each client waits for a request before the next
+                    for(int i = 0; i < OPS; ++i) {
+                        int cyl = rand_r(&seed) % CYLINDERS;
+                        int sec = rand_r(&seed) % SECTORS;
+
+                        start = disk.clock();
+                        if(rand_r(&seed) % 2)
+                            scheduler.write(cyl, sec, data).get();
+                        else
+                            scheduler.read(cyl, sec).get();
+
+                        latencies[c].push_back(disk.clock() - start);
+                    }
+                });
+            for(std::thread &client : clients) client.join();
+            timer.stop();
+        }
+
+        for(const std::vector<double> &l : latencies)
+            all.insert(all.end(), l.begin(), l.end());
+        std::sort(all.begin(), all.end());
+
+        std::cout << std::left << std::setw(12)
+                  << fs::IOScheduler::policy_name(policy) << std::right
+                  << std::fixed << std::setprecision(0) << std::setw(12)
+                  << all.size() / (disk.clock() / 1e6) << std::setw(12)
+                  << all[all.size() / 2] << std::setw(12)
+                  << all[all.size() * 99 / 100] << std::setw(12) << all.back()
+                  << std::setw(12) << disk.timing().cylinders << std::setw(12)
+                  << timer.seconds() * 1000 << std::endl;
+
+        disk.remove();
+    }
+}
+
+void bench_cache() {
+    const int DIRS = 8, FILES = 32, READS = 4000, HOT = 16, SEED = 4440;
+    const std::size_t FILE_SZ = 32 << 10;
+    const std::size_t sizes[] = {0, 1, 4, 16};
+    std::string data(FILE_SZ, 'x');
+    std::vector<char> buf(FILE_SZ);
+
+    std::cout << "\nCache model (simulated) on " << READS
+              << " lookups and reads of " << DIRS * FILES << " files, " << HOT
+              << " hot" << std::endl;
+    std::cout << std::left << std::setw(12) << "cache MB" << std::right
+              << std::setw(12) << "FAT hit%" << std::setw(12) << "dir hit%"
+              << std::setw(12) << "data hit%" << std::setw(12) << "disk MB"
+              << std::setw(12) << "sim ms" << std::endl;
+
+    for(std::size_t size : sizes) {
+        fs::Disk disk("bench-cache", 256, 1024);  // 32 MB
+        fs::FatFS fatfs;
+        std::vector<std::string> paths;
+        const fs::CacheModel &cache = fatfs.cache_model();
+
+        disk.create();
+        disk.set_virtual_clock(true);
+        fatfs.set_disk(&disk);
+        fatfs.set_block_size(4096);
+        fatfs.format();
+
+        for(int d = 0; d < DIRS; ++d) {
+            std::string dir = "/dir" + std::to_string(d);
+
+            fatfs.add_dir(dir);
+            for(int f = 0; f < FILES; ++f) {
+                paths.push_back(dir + "/file" + std::to_string(f));
+                fs::FileEntry file = fatfs.add_file(paths.back());
+                fatfs.write_file_data(file, data.c_str(), FILE_SZ);
+            }
+        }
+
+        // mostly hot files, the rest a scan over all files
+        fatfs.set_cache_size(size);
+        disk.reset_timing();
+        srand(SEED);
+        for(int i = 0; i < READS; ++i) {
+            int n = rand() % 10 ? rand() % HOT : i % paths.size();
+            fs::FileEntry file = fatfs.find_file(paths[n]);
+
+            fatfs.read_file_data(file, buf.data(), FILE_SZ);
+        }
+
+        std::cout << std::left << std::setw(12) << size << std::right;
+        for(int cls = fs::CacheModel::FAT; cls < fs::CacheModel::CLASSES;
+            ++cls) {
+            std::size_t total = cache.hits(cls) + cache.misses(cls);
+
+            std::cout << std::setw(12) << std::fixed << std::setprecision(1)
+                      << (total ? 100.0 * cache.hits(cls) / total : 0);
+        }
+        std::cout << std::setw(12) << std::setprecision(2)
+                  << disk.timing().blocks * fs::Disk::MAX_BLOCK /
+                         double(1 << 20)
+                  << std::setw(12) << disk.timing().total() / 1000.0
+                  << std::endl;
+
+        fatfs.remove();
+    }
+}
+
+void bench_backend() {
+    const std::size_t CYLINDERS = 256, SECTORS = 1024, RUN = 32;
+    const int WRITES = 4000, SEED = 4440;
+    const std::size_t BYTES = CYLINDERS * SECTORS * fs::Disk::MAX_BLOCK;
+    std::vector<char> buf(BYTES);
+    timer::ChronoTimer timer;
+
+    std::cout << "\nDisk backend on " << (BYTES >> 20) << " MB, " << WRITES
+              << " random writes of " << RUN << " blocks" << std::endl;
+    std::cout << std::left << std::setw(12) << "backend" << std::right
+              << std::setw(12) << "create ms" << std::setw(12) << "write MB/s"
+              << std::setw(12) << "read MB/s" << std::setw(12) << "sync ms"
+              << std::setw(12) << "open ms" << std::setw(12) << "cold MB/s"
+              << std::endl;
+
+    for(int backend = fs::Disk::MMAP; backend <= fs::Disk::DIRECT;
+        ++backend) {
+        double create_time = 0, write_time = 0, read_time = 0, sync_time = 0;
+        struct iovec iov = {buf.data(), RUN * fs::Disk::MAX_BLOCK};
+
+        try {
+            fs::Disk disk("bench-backend", CYLINDERS, SECTORS);
+
+            disk.set_backend(backend);
+            disk.set_virtual_clock(true);
+
+            timer.start();
+            disk.create();
+            timer.stop();
+            create_time = timer.seconds();
+
+            srand(SEED);
+            timer.start();
+            for(int i = 0; i < WRITES; ++i)
+                disk.write_blocks(rand() % (disk.total_blocks() - RUN), RUN,
+                                  &iov, 1);
+            timer.stop();
+            write_time = timer.seconds();
+
+            // first read of every block, page faults on a mapping
+            iov = {buf.data(), BYTES};
+            timer.start();
+            disk.read_blocks(0, disk.total_blocks(), &iov, 1);
+            timer.stop();
+            read_time = timer.seconds();
+
+            timer.start();
+            disk.sync();
+            timer.stop();
+            sync_time = timer.seconds();
+        } catch(const std::exception &e) {
+            std::cout << std::left << std::setw(12)
+                      << fs::Disk::backend_name(backend) << e.what()
+                      << std::endl;
+            ::remove("bench-backend.disk");
+            continue;
+        }
+
+        fs::Disk disk("bench-backend");
+        double open_time = 0;
+
+        disk.set_backend(backend);
+        disk.set_virtual_clock(true);
+
+        timer.start();
+        disk.open("bench-backend");
+        timer.stop();
+        open_time = timer.seconds();
+
+        // random runs after open, read from the file on first access
+        iov = {buf.data(), RUN * fs::Disk::MAX_BLOCK};
+        srand(SEED + 1);
+        timer.start();
+        for(int i = 0; i < WRITES; ++i)
+            disk.read_blocks(rand() % (disk.total_blocks() - RUN), RUN, &iov,
+                             1);
+        timer.stop();
+
+        std::cout << std::left << std::setw(12)
+                  << fs::Disk::backend_name(backend) << std::right
+                  << std::fixed << std::setprecision(2) << std::setw(12)
+                  << create_time * 1000 << std::setw(12)
+                  << WRITES * RUN * fs::Disk::MAX_BLOCK / write_time /
+                         (1 << 20)
+                  << std::setw(12) << BYTES / read_time / (1 << 20)
+                  << std::setw(12) << sync_time * 1000 << std::setw(12)
+                  << open_time * 1000 << std::setw(12)
+                  << WRITES * RUN * fs::Disk::MAX_BLOCK / timer.seconds() /
+                         (1 << 20)
+                  << std::endl;
+
+        disk.remove();
+    }
+}
+
+void bench_durability() {
+    const int FILES = 2000, INTERVAL = 2;
+    std::string data(4096, 'x');
+    timer::ChronoTimer timer;
+
+    std::cout << "\nDurability of " << FILES << " file creates and 4 KB "
+              << "writes, flush interval " << INTERVAL << " ms" << std::endl;
+    std::cout << std::left << std::setw(12) << "mode" << std::right
+              << std::setw(12) << "ops/s" << std::setw(12) << "flushes"
+              << std::setw(12) << "flushed KB" << std::setw(12) << "mean us"
+              << std::setw(12) << "max us" << std::setw(12) << "sync ms"
+              << std::endl;
+
+    for(int mode = fs::Disk::NONE; mode <= fs::Disk::SYNC; ++mode) {
+        fs::Disk disk("bench-durability", 256, 1024);  // 32 MB
+        fs::FatFS fatfs;
+        fs::Disk::Writeback writeback;
+        double write_time = 0;
+
+        disk.set_virtual_clock(true);
+        disk.set_flush_interval(INTERVAL);
+        disk.set_durability(mode);
+        disk.create();
+        fatfs.set_disk(&disk);
+        fatfs.set_block_size(4096);
+        fatfs.format();
+        disk.sync();
+        disk.reset_writeback();
+
+        timer.start();
+        for(int i = 0; i < FILES; ++i) {
+            fs::FileEntry file = fatfs.add_file("file" + std::to_string(i));
+            fatfs.write_file_data(file, data.c_str(), data.size());
+        }
+        timer.stop();
+        write_time = timer.seconds();
+        writeback = disk.writeback();
+
+        // what is left for an explicit sync at the end
+        timer.start();
+        fatfs.close_disk();
+        disk.sync();
+        timer.stop();
+
+        std::cout << std::left << std::setw(12)
+                  << fs::Disk::durability_name(mode) << std::right
+                  << std::fixed << std::setprecision(0) << std::setw(12)
+                  << FILES / write_time << std::setw(12) << writeback.flushes
+                  << std::setw(12) << writeback.bytes / 1024.0
+                  << std::setw(12)
+                  << (writeback.flushes ? writeback.time / writeback.flushes
+                                        : 0)
+                  << std::setw(12) << writeback.max_time << std::setw(12)
+                  << std::setprecision(2) << timer.seconds() * 1000
+                  << std::endl;
+
+        disk.remove();
+    }
+}
+
+void bench_journal() {
+    const std::size_t BLOCK = 4096, JOURNAL_BLOCKS = 256, RANGES = 4;
+    const std::size_t RANGE = 64;
+    const int COMMITS = 2000, MAX_THREADS = 16;
+    timer::ChronoTimer timer;
+
+    std::cout << "\nJournal group commit, " << COMMITS << " commits of "
+              << RANGES << " ranges of " << RANGE << " bytes per thread"
+              << std::endl;
+    std::cout << std::left << std::setw(12) << "threads" << std::right
+              << std::setw(12) << "commits/s" << std::setw(12) << "batches"
+              << std::setw(12) << "per batch" << std::setw(12) << "ckpts"
+              << std::endl;
+
+    for(int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        fs::Disk disk("bench-journal", 64, 1024);  // 8 MB
+        fs::Journal journal;
+        std::vector<std::thread> workers;
+
+        // pwrite and fsync make each journal flush pay the file system
+        disk.set_backend(fs::Disk::PREAD);
+        disk.set_virtual_clock(true);
+        disk.create();
+        journal.attach(&disk, BLOCK, MAX_THREADS, JOURNAL_BLOCKS);
+        journal.format();
+
+        timer.start();
+        for(int t = 0; t < threads; ++t)
+            workers.emplace_back([&journal, t] {
+                char *block = journal.image() + t * BLOCK;
+
+                // each thread updates ranges of its own shadow block
+                for(int i = 0; i < COMMITS; ++i) {
+                    for(std::size_t r = 0; r < RANGES; ++r) {
+                        memset(block + r * 2 * RANGE, i, RANGE);
+                        fs::Journal::record(block + r * 2 * RANGE, RANGE);
+                    }
+                    journal.commit();
+                }
+            });
+        for(std::thread &worker : workers) worker.join();
+        timer.stop();
+
+        std::cout << std::left << std::setw(12) << threads << std::right
+                  << std::fixed << std::setprecision(0) << std::setw(12)
+                  << journal.commits() / timer.seconds() << std::setw(12)
+                  << journal.batches() << std::setw(12)
+                  << std::setprecision(2)
+                  << double(journal.commits()) / journal.batches()
+                  << std::setw(12) << journal.checkpoints() << std::endl;
+
+        journal.detach();
+        disk.remove();
+    }
+}
+
+void bench_mount() {
+    const int CYLINDERS = 256, SECTORS = 1024, CONNECTS = 200;
+    fs::MountTable mounts({CYLINDERS, SECTORS, 0, 0, fs::Disk::MMAP,
+                           fs::Disk::NONE});
+    timer::ChronoTimer timer;
+    double own_time = 0;
+
+    {
+        fs::Disk disk("bench-mount", CYLINDERS, SECTORS);  // 32 MB
+        fs::FatFS fatfs;
+
+        disk.create();
+        fatfs.set_disk(&disk);
+        fatfs.format();
+        fatfs.close_disk();
+    }
+
+    std::cout << "\nMount of a " << (CYLINDERS * SECTORS >> 13)
+              << " MB image, " << CONNECTS << " connects" << std::endl;
+    std::cout << std::left << std::setw(12) << "mount" << std::right
+              << std::setw(12) << "connect us" << std::endl;
+
+    // every connection maps the file and reads the free map
+    timer.start();
+    for(int i = 0; i < CONNECTS; ++i) {
+        fs::Disk disk("bench-mount");
+        fs::FatFS fatfs;
+
+        disk.open("bench-mount");
+        fatfs.set_disk(&disk);
+        fatfs.open_disk();
+        fatfs.close_disk();
+    }
+    timer.stop();
+    own_time = timer.seconds();
+
+    // a connection stays, the others only count references
+    fs::Mount *held = mounts.acquire("bench-mount");
+
+    timer.start();
+    for(int i = 0; i < CONNECTS; ++i)
+        mounts.release(mounts.acquire("bench-mount"));
+    timer.stop();
+
+    std::cout << std::left << std::setw(12) << "own" << std::right
+              << std::fixed << std::setprecision(2) << std::setw(12)
+              << own_time * 1e6 / CONNECTS << std::endl;
+    std::cout << std::left << std::setw(12) << "shared" << std::right
+              << std::setw(12) << timer.seconds() * 1e6 / CONNECTS
+              << std::endl;
+
+    std::lock_guard<std::shared_mutex> lock(held->mutex);
+    held->fatfs.remove();
+}
+
+void bench_stress() {
+    const std::size_t BLOCK = 4096, FILE_SZ = 4 * BLOCK;
+    const int ROUNDS = 100, OPS = 4, MAX_THREADS = 32;
+    timer::ChronoTimer timer;
+    std::string data(FILE_SZ, 's');
+
+    std::cout << "\nConcurrent clients, " << ROUNDS
+              << " rounds of file create, write, read and delete per thread"
+              << std::endl;
+    std::cout << std::left << std::setw(12) << "threads" << std::right
+              << std::setw(14) << "entry ops/s" << std::setw(14)
+              << "global ops/s" << std::setw(12) << "speedup"
+              << std::setw(12) << "lock waits" << std::endl;
+
+    for(int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double rate[2] = {0, 0};
+        std::size_t waits = 0;
+
+        // with entry locks only, then every call under one mutex
+        for(int is_global = 0; is_global < 2; ++is_global) {
+            fs::Disk disk("bench-stress", 256, 1024);  // 32 MB
+            fs::FatFS fatfs;
+            std::mutex global;
+            std::vector<std::thread> workers;
+
+            // pwrite and fsync make each journal commit pay the file system
+            disk.set_backend(fs::Disk::PREAD);
+            disk.set_virtual_clock(true);
+            disk.create();
+            fatfs.set_disk(&disk);
+            fatfs.set_block_size(BLOCK);
+            fatfs.format();
+
+            timer.start();
+            for(int t = 0; t < threads; ++t)
+                workers.emplace_back([&, t] {
+                    std::string dir = "/t" + std::to_string(t);
+                    std::vector<char> buf(FILE_SZ);
+                    auto call = [&](const std::function<void()> &op) {
+                        std::unique_lock<std::mutex> lock(global,
+                                                          std::defer_lock);
+
+                        if(is_global) lock.lock();
+                        op();
+                    };
+
+                    call([&] { fatfs.add_dir(dir); });
+                    for(int i = 0; i < ROUNDS; ++i) {
+                        std::string path = dir + "/f" + std::to_string(i);
+                        fs::FileEntry file;
+
+                        call([&] { file = fatfs.add_file(path); });
+                        call([&] {
+                            fatfs.write_file_data(file, data.c_str(), FILE_SZ);
+                        });
+                        call([&] {
+                            fatfs.read_file_data(file, buf.data(), FILE_SZ);
+                        });
+                        call([&] { fatfs.delete_file(path); });
+                    }
+                    call([&] { fatfs.delete_dir(dir); });
+                });
+            for(std::thread &worker : workers) worker.join();
+            timer.stop();
+
+            rate[is_global] = threads * ROUNDS * OPS / timer.seconds();
+            if(!is_global) waits = fatfs.locks().contended();
+
+            fatfs.remove();
+        }
+
+        std::cout << std::left << std::setw(12) << threads << std::right
+                  << std::fixed << std::setprecision(0) << std::setw(14)
+                  << rate[0] << std::setw(14) << rate[1] << std::setw(12)
+                  << std::setprecision(2) << rate[0] / rate[1]
+                  << std::setw(12) << waits << std::endl;
+    }
+}
+
+void bench_session() {
+    const int ROUNDS = 20, OPS = 5, THREADS = 8, MAX_CLIENTS = 4096;
+    timer::ChronoTimer timer;
+    std::string data(512, 'c');
+
+    std::cout << "\nClients in their own directory, " << ROUNDS
+              << " rounds of relative file create, write, find, list and "
+                 "delete per client, "
+              << THREADS << " threads" << std::endl;
+    std::cout << std::left << std::setw(12) << "clients" << std::right
+              << std::setw(14) << "session ops/s" << std::setw(14)
+              << "cwd ops/s" << std::setw(12) << "speedup" << std::setw(18)
+              << "commits/flush" << std::endl;
+
+    for(int clients = 1; clients <= MAX_CLIENTS; clients *= 4) {
+        double rate[2] = {0, 0}, per_batch[2] = {0, 0};
+
+        // a Session per client, then one current directory changed to the
+        // client's under an exclusive lock, as connections did before
+        for(int is_cwd = 0; is_cwd < 2; ++is_cwd) {
+            fs::Disk disk("bench-session", 256, 1024);  // 32 MB
+            fs::FatFS fatfs;
+            std::shared_mutex mutex;
+            std::string cwd = "/";
+            std::vector<fs::Session> sessions(clients);
+            std::vector<std::thread> workers;
+            int threads = std::min(clients, THREADS);
+
+            // directory reads are paid in simulated time only
+            disk.set_virtual_clock(true);
+            disk.create();
+            fatfs.set_disk(&disk);
+            fatfs.format();
+
+            for(int c = 0; c < clients; ++c) {
+                std::string dir = "/c" + std::to_string(c);
+
+                fatfs.add_dir(dir);
+                fatfs.change_dir(sessions[c], dir);
+            }
+
+            timer.start();
+            for(int t = 0; t < threads; ++t)
+                workers.emplace_back([&, t] {
+                    std::ostringstream oss;
+
+                    for(int i = 0; i < ROUNDS; ++i)
+                        for(int c = t; c < clients; c += threads) {
+                            fs::Session &session = sessions[c];
+                            std::shared_lock<std::shared_mutex> shared(
+                                mutex, std::defer_lock);
+                            std::unique_lock<std::shared_mutex> exclusive(
+                                mutex, std::defer_lock);
+
+                            if(is_cwd) {
+                                exclusive.lock();
+                                if(cwd != session.path()) {
+                                    fatfs.change_dir(session.path());
+                                    cwd = session.path();
+                                }
+                            } else
+                                shared.lock();
+
+                            fs::FileEntry file =
+                                is_cwd ? fatfs.add_file("f")
+                                       : fatfs.add_file(session, "f");
+
+                            if(is_cwd)
+                                fatfs.write_file_data(file, data.c_str(),
+                                                      data.size());
+                            else
+                                fatfs.write_file_data(session, file,
+                                                      data.c_str(),
+                                                      data.size());
+                            if(is_cwd) {
+                                fatfs.find_file("f");
+                                fatfs.print_all(oss, ".");
+                                fatfs.delete_file("f");
+                            } else {
+                                fatfs.find_file(session, "f");
+                                fatfs.print_all(session, oss, ".");
+                                fatfs.delete_file(session, "f");
+                            }
+                            oss.str("");
+                        }
+                });
+            for(std::thread &worker : workers) worker.join();
+            timer.stop();
+
+            rate[is_cwd] = double(clients) * ROUNDS * OPS / timer.seconds();
+
+            // one flush per journal batch, shared by the commits joining it
+            per_batch[is_cwd] = double(fatfs.journal().commits()) /
+                                std::max<std::size_t>(
+                                    fatfs.journal().batches(), 1);
+
+            fatfs.remove();
+        }
+
+        std::cout << std::left << std::setw(12) << clients << std::right
+                  << std::fixed << std::setprecision(0) << std::setw(14)
+                  << rate[0] << std::setw(14) << rate[1] << std::setw(12)
+                  << std::setprecision(2) << rate[0] / rate[1]
+                  << std::setw(9) << per_batch[0] << std::setw(9)
+                  << per_batch[1] << std::endl;
+    }
+}
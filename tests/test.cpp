@@ -5,13 +5,16 @@
 #include <sys/types.h>  // unix types
 #include <unistd.h>
 #include <unistd.h>  // open(), read(), write(), usleep()
+#include <atomic>    // std::atomic
 #include <cstring>   // strncpy()
+#include <fstream>   // file copy
 #include <iomanip>
 #include <iostream>
 #include <map>
 #include <sstream>
 #include <stdexcept>  // std::exception
 #include <string>     // std::string
+#include <thread>     // std::thread
 #include <vector>
 #include "../include/fat.h"
 
@@ -106,6 +109,65 @@ int main() {
 
     delete[] buff;
 
+    data = "WORLD";
+    std::cout << "\nWriting at offset 6: " << data << std::endl;
+    fatfs.write_file_at(fentry, 6, data.c_str(), data.size());
+
+    buff = new char[fentry.data_size() + 1];
+    bytes = fatfs.read_file_at(fentry, 0, buff, fentry.data_size());
+    buff[bytes] = '\0';
+    std::cout << buff << std::endl;
+
+    delete[] buff;
+
+    data = std::string("bin\0ary\0", 8);
+    std::cout << "\nWriting binary data of " << data.size() << " bytes"
+              << std::endl;
+    fatfs.write_file_data(fentry, data.c_str(), data.size());
+
+    buff = new char[fentry.data_size()];
+    bytes = fatfs.read_file_data(fentry, buff, fentry.data_size());
+    std::cout << "Read " << bytes << " bytes, "
+              << (std::string(buff, bytes) == data ? "match" : "mismatch")
+              << std::endl;
+
+    delete[] buff;
+
+    // a read-only session can read the file but every data write throws and
+    // leaves the file as it was
+    std::cout << "\nWriting data in a read-only session" << std::endl;
+    fs::Session reader(fs::Session::READ_ONLY);
+    int rejected = 0;
+
+    try {
+        fatfs.write_file_data(reader, fentry, "ro", 2);
+    } catch(const std::exception &e) {
+        ++rejected;
+    }
+    try {
+        fatfs.append_file_data(reader, fentry, "ro", 2);
+    } catch(const std::exception &e) {
+        ++rejected;
+    }
+    try {
+        fatfs.write_file_at(reader, fentry, 0, "ro", 2);
+    } catch(const std::exception &e) {
+        ++rejected;
+    }
+    try {
+        fatfs.remove_file_data(reader, fentry);
+    } catch(const std::exception &e) {
+        ++rejected;
+    }
+
+    buff = new char[fentry.data_size()];
+    bytes = fatfs.read_file_data(fentry, buff, fentry.data_size());
+    bool is_guarded = rejected == 4 && std::string(buff, bytes) == data;
+    std::cout << "Rejected " << rejected << " of 4 writes, data "
+              << (is_guarded ? "unchanged" : "changed") << std::endl;
+
+    delete[] buff;
+
     path = "/";
     std::cout << "\nChanging directory with path: " << path << std::endl;
     fatfs.change_dir(path);
@@ -115,5 +177,619 @@ int main() {
 
     fatfs.remove();
 
-    return 0;
+    // updates are logged and, with PREAD, their home blocks never reach
+    // the file, as when a crash comes before a checkpoint. An MMAP image
+    // holds home blocks with only logged bytes. Opening either image again
+    // replays the updates
+    bool is_replayed = true;
+    std::size_t free_size = 0;
+
+    for(int backend : {fs::Disk::PREAD, fs::Disk::MMAP}) {
+        bool is_match = false;
+
+        std::cout << "\nReplaying journal after a crash on "
+                  << fs::Disk::backend_name(backend) << std::endl;
+        {
+            fs::Disk live("testjournal", 100, 10);
+            fs::FatFS journaled;
+
+            live.set_backend(backend);
+            live.create();
+            journaled.set_disk(&live);
+            journaled.format();
+            live.flush();
+
+            journaled.add_dir("/logged");
+            fentry = journaled.add_file("/logged/file");
+            journaled.write_file_data(fentry, data.c_str(), data.size());
+            free_size = journaled.free_size();
+
+            std::ifstream image("testjournal.disk", std::ios::binary);
+            std::ofstream crash("testcrash.disk", std::ios::binary);
+            crash << image.rdbuf();
+            crash.close();
+
+            journaled.remove();
+        }
+        {
+            fs::Disk crashed("testcrash");
+            fs::FatFS replayed;
+
+            crashed.set_backend(backend);
+            crashed.open("testcrash");
+            replayed.set_disk(&crashed);
+
+            if(replayed.open_disk()) {
+                fentry = replayed.find_file("/logged/file");
+                is_match = replayed.journal().replayed() > 0 && fentry &&
+                           (std::size_t)fentry.data_size() == data.size() &&
+                           replayed.free_size() == free_size;
+                std::cout << replayed.journal_info() << std::endl;
+            }
+            std::cout << "Replayed FAT and entries "
+                      << (is_match ? "match" : "mismatch") << std::endl;
+
+            replayed.remove();
+            crashed.remove();
+        }
+        is_replayed = is_replayed && is_match;
+    }
+
+    // threads create, write and delete files while the image is copied, so
+    // the copy cuts updates of several threads at once. No home block is
+    // flushed before the journal fills, so replay alone must give a FAT that
+    // matches the entries
+    const int THREADS = 4, OPS = 64;
+    bool is_consistent = false;
+
+    std::cout << "\nReplaying journal after a crash mid update" << std::endl;
+    {
+        fs::Disk live("testjournal", 400, 256);
+        fs::FatFS journaled;
+        std::vector<std::thread> workers;
+        std::atomic<int> done(0);
+
+        live.set_backend(fs::Disk::PREAD);
+        live.create();
+        journaled.set_disk(&live);
+        journaled.format();
+        live.flush();
+
+        for(int t = 0; t < THREADS; ++t) {
+            journaled.add_dir("/t" + std::to_string(t));
+            workers.emplace_back([&journaled, &done, t] {
+                std::string dir = "/t" + std::to_string(t) + "/file";
+                std::string data(300, char('a' + t));
+
+                for(int i = 0; i < OPS; ++i) {
+                    std::string path = dir + std::to_string(i % 8);
+                    fs::FileEntry file = journaled.find_file(path);
+
+                    if(file) {
+                        journaled.delete_file(path);
+                    } else {
+                        file = journaled.add_file(path);
+                        journaled.write_file_data(file, data.c_str(),
+                                                  data.size());
+                    }
+                    if(i == OPS / 2) ++done;
+                }
+            });
+        }
+
+        // copy once every thread is half way through its updates
+        while(done < THREADS) std::this_thread::yield();
+
+        std::ifstream image("testjournal.disk", std::ios::binary);
+        std::ofstream crash("testcrash.disk", std::ios::binary);
+        crash << image.rdbuf();
+        crash.close();
+
+        for(std::thread &worker : workers) worker.join();
+        std::cout << "Checkpoints before crash: "
+                  << journaled.journal().checkpoints() << std::endl;
+        journaled.remove();
+    }
+    {
+        fs::Disk crashed("testcrash");
+        fs::FatFS replayed;
+        int files = 0;
+
+        crashed.set_backend(fs::Disk::PREAD);
+        crashed.open("testcrash");
+        replayed.set_disk(&crashed);
+
+        if(replayed.open_disk()) {
+            // every file found is empty, its write cut off, or has its
+            // whole chain; data blocks are not logged, so their bytes may
+            // not have reached the file
+            is_consistent = replayed.free_size() + replayed.size() ==
+                            replayed.total_size();
+            for(int t = 0; t < THREADS; ++t)
+                for(int i = 0; i < 8; ++i) {
+                    fentry = replayed.find_file("/t" + std::to_string(t) +
+                                                "/file" + std::to_string(i));
+                    if(!fentry) continue;
+
+                    std::vector<char> read(301);
+                    std::size_t bytes = replayed.read_file_data(
+                        fentry, read.data(), read.size());
+                    is_consistent =
+                        is_consistent &&
+                        (fentry.data_size() == 0 || bytes == 300);
+                    ++files;
+                }
+        }
+        std::cout << "Replayed " << files << " files, FAT and entries "
+                  << (is_consistent ? "match" : "mismatch") << std::endl;
+
+        replayed.remove();
+        crashed.remove();
+    }
+
+    // a clean unmount stores the free map, which the next open loads. A
+    // copy of the image marked unclean rebuilds it from the FAT instead, so
+    // both mounts must count the same free blocks and allocate the same ones
+    bool is_mapped = false;
+
+    std::cout << "\nLoading free map after a clean unmount" << std::endl;
+    {
+        fs::Disk disk("testmap", 100, 10);
+        fs::FatFS fatfs;
+
+        disk.create();
+        fatfs.set_disk(&disk);
+        fatfs.format();
+
+        std::string data(300, 'm');
+        for(int i = 0; i < 24; ++i) {
+            fentry = fatfs.add_file("/file" + std::to_string(i));
+            fatfs.write_file_data(fentry, data.c_str(), data.size());
+        }
+        for(int i = 0; i < 24; i += 3)
+            fatfs.delete_file("/file" + std::to_string(i));
+        fatfs.close_disk();
+    }
+    {
+        std::ifstream image("testmap.disk", std::ios::binary);
+        std::ofstream copy("testscan.disk", std::ios::binary);
+        copy << image.rdbuf();
+        copy.close();
+
+        // clear the clean flag of the copy's narrow metadata
+        std::fstream scan("testscan.disk",
+                          std::ios::in | std::ios::out | std::ios::binary);
+        int unclean = 0;
+        scan.seekp(fs::Disk::HEADER_SZ + fs::FatFS::META_CLEAN * sizeof(int));
+        scan.write((const char *)&unclean, sizeof(unclean));
+    }
+    {
+        fs::Disk loaded_disk("testmap"), scanned_disk("testscan");
+        fs::FatFS loaded, scanned;
+        std::string data(1000, 'n');
+
+        loaded_disk.open("testmap");
+        scanned_disk.open("testscan");
+        loaded.set_disk(&loaded_disk);
+        scanned.set_disk(&scanned_disk);
+
+        if(loaded.open_disk() && scanned.open_disk()) {
+            is_mapped =
+                loaded.free_size() == scanned.free_size() &&
+                loaded.free_extents() == scanned.free_extents() &&
+                loaded.largest_free_extent() == scanned.largest_free_extent();
+
+            fs::FileEntry loaded_file = loaded.add_file("/new");
+            fs::FileEntry scanned_file = scanned.add_file("/new");
+            loaded.write_file_data(loaded_file, data.c_str(), data.size());
+            scanned.write_file_data(scanned_file, data.c_str(), data.size());
+
+            is_mapped = is_mapped &&
+                        loaded_file.data_head() == scanned_file.data_head() &&
+                        loaded.file_extents(loaded_file) ==
+                            scanned.file_extents(scanned_file) &&
+                        loaded.free_size() == scanned.free_size();
+        }
+        std::cout << "Loaded and rebuilt free maps "
+                  << (is_mapped ? "match" : "mismatch") << std::endl;
+
+        loaded.remove();
+        scanned.remove();
+    }
+
+    // lazy size deltas still in memory are lost when the disk is not
+    // closed, so an image copied before any fold is opened unclean and its
+    // directory sizes are rebuilt to what the live filesystem folds to
+    bool is_sized = false;
+    std::vector<std::size_t> live_sizes, rebuilt_sizes;
+    const char *dirs[] = {"/", "/a", "/a/b", "/c"};
+
+    std::cout << "\nRebuilding lazy sizes after a remount without close"
+              << std::endl;
+    {
+        fs::Disk disk("testsizes", 100, 10);
+        fs::FatFS fatfs;
+        fs::Session session;
+        std::string data(700, 's');
+
+        disk.create();
+        fatfs.set_disk(&disk);
+        fatfs.set_lazy_sizes(true);
+        fatfs.format();
+
+        fatfs.add_dir("/a");
+        fatfs.add_dir("/a/b");
+        fatfs.add_dir("/c");
+        for(std::string path : {"/a/f", "/a/b/f", "/a/b/g", "/c/f"}) {
+            fentry = fatfs.add_file(path);
+            fatfs.write_file_data(fentry, data.c_str(), data.size());
+        }
+        fentry = fatfs.find_file("/a/b/g");
+        fatfs.append_file_data(fentry, data.c_str(), data.size());
+        fatfs.delete_file("/c/f");
+
+        std::ifstream image("testsizes.disk", std::ios::binary);
+        std::ofstream copy("testremount.disk", std::ios::binary);
+        copy << image.rdbuf();
+        copy.close();
+
+        fatfs.flush_sizes();
+        for(const char *dir : dirs) {
+            fatfs.change_dir(session, dir);
+            live_sizes.push_back(fatfs.current(session).size());
+        }
+        fatfs.remove();
+    }
+    {
+        fs::Disk disk("testremount");
+        fs::FatFS fatfs;
+        fs::Session session;
+
+        disk.open("testremount");
+        fatfs.set_disk(&disk);
+
+        if(fatfs.open_disk()) {
+            for(const char *dir : dirs) {
+                fatfs.change_dir(session, dir);
+                rebuilt_sizes.push_back(fatfs.current(session).size());
+            }
+            is_sized = rebuilt_sizes == live_sizes;
+        }
+        std::cout << "Directory sizes of /, /a, /a/b and /c "
+                  << (is_sized ? "match" : "mismatch") << std::endl;
+
+        fatfs.remove();
+    }
+
+    // an unversioned narrow image as written before versioned layouts: a
+    // v1 disk header, 3 int metadata fields, an int FAT and narrow entries.
+    // It mounts with one disk block per block and takes new files
+    bool is_narrow = false;
+    const std::size_t CYL = 10, SEC = 32, BLOCK = fs::Disk::MAX_BLOCK;
+    const long TOTAL = CYL * SEC, OFFSET = 10, LOGICAL = TOTAL - OFFSET;
+
+    std::cout << "\nOpening an unversioned narrow image" << std::endl;
+    {
+        std::vector<char> image(fs::Disk::LEGACY_HEADER_SZ + TOTAL * BLOCK);
+        std::size_t geometry[] = {CYL, SEC, BLOCK};
+        char *blocks = image.data() + fs::Disk::LEGACY_HEADER_SZ;
+        int meta[] = {fs::FatFS::LEGACY_META_SZ, int(OFFSET), int(LOGICAL)};
+        int *fat = (int *)(blocks + fs::FatFS::LEGACY_META_SZ);
+
+        memcpy(image.data(), geometry, sizeof(geometry));
+        memcpy(blocks, meta, sizeof(meta));
+
+        // root, its file and the file's data block are the first 3 blocks
+        for(long i = 0; i < LOGICAL; ++i)
+            fat[i] = i < 3 ? fs::FatCell::END : fs::FatCell::FREE;
+
+        fs::DirEntry root(blocks + OFFSET * BLOCK);
+        root.init();
+        root.set_name("/");
+        root.set_dot(OFFSET);
+        root.set_size(3 * BLOCK);
+        root.set_file_head(OFFSET + 1);
+
+        fs::FileEntry file(blocks + (OFFSET + 1) * BLOCK);
+        file.init();
+        file.set_name("old");
+        file.set_dot(OFFSET + 1);
+        file.set_dotdot(OFFSET);
+        file.set_size(2 * BLOCK);
+        file.set_data_head(OFFSET + 2);
+        file.set_data_size(6);
+        memcpy(blocks + (OFFSET + 2) * BLOCK, "legacy", 6);
+
+        std::ofstream out("testnarrow.disk", std::ios::binary);
+        out.write(image.data(), image.size());
+    }
+    {
+        fs::Disk disk("testnarrow");
+        fs::FatFS fatfs;
+
+        disk.open("testnarrow");
+        fatfs.set_disk(&disk);
+
+        if(fatfs.open_disk()) {
+            char read[16] = {0};
+            fentry = fatfs.find_file("/old");
+
+            is_narrow = !fatfs.current().wide() && fentry &&
+                        fatfs.read_file_data(fentry, read, 16) == 6 &&
+                        std::string(read) == "legacy" &&
+                        fatfs.block_size() == BLOCK &&
+                        fatfs.total_size() == LOGICAL * BLOCK &&
+                        fatfs.free_size() == (LOGICAL - 3) * BLOCK;
+
+            fentry = fatfs.add_file("/new");
+            fatfs.write_file_data(fentry, "narrow", 6);
+            fatfs.close_disk();
+        }
+    }
+    {
+        fs::Disk disk("testnarrow");
+        fs::FatFS fatfs;
+        char read[16] = {0};
+
+        disk.open("testnarrow");
+        fatfs.set_disk(&disk);
+
+        is_narrow = is_narrow && fatfs.open_disk() && fatfs.find_file("/old");
+        if(is_narrow) {
+            fentry = fatfs.find_file("/new");
+            is_narrow = fentry &&
+                        fatfs.read_file_data(fentry, read, 16) == 6 &&
+                        std::string(read) == "narrow" &&
+                        fatfs.free_size() + fatfs.size() ==
+                            fatfs.total_size();
+        }
+        std::cout << "Narrow geometry and files "
+                  << (is_narrow ? "match" : "mismatch") << std::endl;
+
+        fatfs.remove();
+    }
+
+    // a terabyte sparse image is formatted wide, as its size does not fit
+    // an int, and only the blocks written take space in the file
+    bool is_large = false;
+    const std::size_t LARGE_BLOCK = fs::FatFS::MAX_BLOCK_SIZE;
+    const std::size_t LARGE_BYTES = std::size_t(1) << 40;
+    std::string large_data(3 * LARGE_BLOCK + 1, 'L');
+
+    std::cout << "\nOpening a terabyte sparse image" << std::endl;
+    {
+        fs::Disk disk("testlarge", 1 << 14, 1 << 10);
+        fs::FatFS fatfs;
+
+        disk.set_block_size(LARGE_BLOCK);
+        disk.set_provision(fs::Disk::SPARSE);
+        disk.set_virtual_clock(true);
+        disk.create();
+        fatfs.set_disk(&disk);
+        fatfs.set_block_size(LARGE_BLOCK);
+        fatfs.format();
+
+        fatfs.add_dir("/big");
+        fentry = fatfs.add_file("/big/file");
+        fatfs.write_file_data(fentry, large_data.c_str(), large_data.size());
+        fatfs.close_disk();
+    }
+    {
+        fs::Disk disk("testlarge");
+        fs::FatFS fatfs;
+        struct stat st;
+
+        disk.set_virtual_clock(true);
+        disk.open("testlarge");
+        fatfs.set_disk(&disk);
+
+        if(fatfs.open_disk() && stat("testlarge.disk", &st) == 0) {
+            std::vector<char> read(large_data.size() + 1);
+            fentry = fatfs.find_file("/big/file");
+
+            is_large =
+                disk.logical_bytes() == LARGE_BYTES &&
+                fatfs.current().wide() && fentry && fentry.wide() &&
+                fatfs.read_file_data(fentry, read.data(), read.size()) ==
+                    large_data.size() &&
+                std::string(read.data(), large_data.size()) == large_data &&
+                fatfs.free_size() + fatfs.size() == fatfs.total_size() &&
+                std::size_t(st.st_blocks) * 512 < LARGE_BYTES / 1024;
+        }
+        std::cout << "Wide geometry and files "
+                  << (is_large ? "match" : "mismatch") << std::endl;
+
+        fatfs.remove();
+    }
+
+    // the same filesystem behind a hand-written v1 disk header of 3 size_t
+    // fields, with blocks right after it. Disk detects the version by the
+    // missing magic and keeps the image v1 when it is written
+    bool is_legacy = false;
+    std::string legacy_data = "v1 header";
+
+    std::cout << "\nOpening a v1 disk header image" << std::endl;
+    {
+        fs::Disk disk("testv2", 100, 10);
+        fs::FatFS fatfs;
+
+        disk.create();
+        fatfs.set_disk(&disk);
+        fatfs.format();
+
+        fatfs.add_dir("/d");
+        fentry = fatfs.add_file("/d/file");
+        fatfs.write_file_data(fentry, legacy_data.c_str(), legacy_data.size());
+        fatfs.close_disk();
+    }
+    {
+        std::ifstream image("testv2.disk", std::ios::binary);
+        std::ofstream legacy("testv1.disk", std::ios::binary);
+        std::size_t geometry[] = {100, 10, fs::Disk::MAX_BLOCK};
+
+        image.seekg(fs::Disk::HEADER_SZ);
+        legacy.write((const char *)geometry, sizeof(geometry));
+        legacy << image.rdbuf();
+        legacy.close();
+
+        fs::Disk v2("testv2");
+        v2.open("testv2");
+        v2.remove();
+    }
+    for(int mount = 0; mount < 2; ++mount) {
+        fs::Disk disk("testv1");
+        fs::FatFS fatfs;
+        struct stat st;
+        char read[16] = {0};
+
+        disk.open("testv1");
+        fatfs.set_disk(&disk);
+
+        is_legacy = disk.version() == 1 && disk.cylinder() == 100 &&
+                    disk.sector() == 10 &&
+                    disk.max_block() == fs::Disk::MAX_BLOCK &&
+                    fatfs.open_disk();
+        if(is_legacy) {
+            fentry = fatfs.find_file("/d/file");
+            is_legacy = fentry &&
+                        fatfs.read_file_data(fentry, read, 16) ==
+                            legacy_data.size() &&
+                        std::string(read) == legacy_data;
+
+            // first mount adds a file, the second finds it
+            if(mount == 0)
+                fentry = fatfs.add_file("/d/added");
+            else
+                fentry = fatfs.find_file("/d/added");
+            is_legacy = is_legacy && fentry;
+        }
+        fatfs.close_disk();
+        disk.sync();
+
+        is_legacy = is_legacy && stat("testv1.disk", &st) == 0 &&
+                    std::size_t(st.st_size) ==
+                        fs::Disk::LEGACY_HEADER_SZ + disk.logical_bytes();
+        if(!is_legacy || mount == 1) {
+            std::cout << "v1 geometry and files "
+                      << (is_legacy ? "match" : "mismatch") << std::endl;
+            fatfs.remove();
+            break;
+        }
+    }
+
+    // a handle of a deleted file is stale even once its block holds a new
+    // file, so reads and writes through it do nothing
+    bool is_stale = false;
+
+    std::cout << "\nUsing a file handle after delete and re-create"
+              << std::endl;
+    {
+        fs::Disk disk("teststale", 100, 10);
+        fs::FatFS fatfs;
+        char read[16] = {0};
+
+        disk.create();
+        fatfs.set_disk(&disk);
+        fatfs.format();
+
+        fatfs.add_dir("/s");
+        fs::FileEntry old_file = fatfs.add_file("/s/file");
+        fatfs.write_file_data(old_file, "old", 3);
+        fatfs.delete_file("/s/file");
+        fs::FileEntry new_file = fatfs.add_file("/s/file");
+        fatfs.write_file_data(new_file, "new", 3);
+
+        is_stale =
+            new_file.dot() == old_file.dot() &&
+            fatfs.write_file_data(old_file, "stale", 5) == 0 &&
+            fatfs.append_file_data(old_file, "stale", 5) == 0 &&
+            fatfs.write_file_at(old_file, 0, "stale", 5) == 0 &&
+            fatfs.read_file_data(old_file, read, 16) == 0 &&
+            fatfs.read_file_data(new_file, read, 16) == 3 &&
+            std::string(read) == "new";
+
+        fatfs.remove_file_data(old_file);
+        fentry = fatfs.find_file("/s/file");
+        is_stale = is_stale && fentry && fentry.data_size() == 3;
+        std::cout << "Stale handle "
+                  << (is_stale ? "rejected" : "accepted") << std::endl;
+
+        fatfs.remove();
+    }
+
+    // threads add, write, append and delete files in their own directories
+    // and in a shared one. Afterwards the FAT scanned on an unclean open,
+    // the sizes rebuilt from entries and the live free count must agree
+    const int WORKERS = 8, WORKER_OPS = 256;
+    bool is_concurrent = false;
+    std::size_t live_free = 0;
+
+    std::cout << "\nChecking the FAT after concurrent updates" << std::endl;
+    {
+        fs::Disk disk("testconcurrent", 400, 256);
+        fs::FatFS fatfs;
+        std::vector<std::thread> workers;
+
+        disk.create();
+        fatfs.set_disk(&disk);
+        fatfs.format();
+
+        fatfs.add_dir("/shared");
+        for(int t = 0; t < WORKERS; ++t) {
+            fatfs.add_dir("/w" + std::to_string(t));
+            workers.emplace_back([&fatfs, t] {
+                std::string data(300, char('a' + t));
+
+                for(int i = 0; i < WORKER_OPS; ++i) {
+                    std::string path =
+                        i % 2 ? "/w" + std::to_string(t) + "/file" +
+                                    std::to_string(i % 16)
+                              : "/shared/t" + std::to_string(t) + "_" +
+                                    std::to_string(i % 4);
+                    fs::FileEntry file = fatfs.find_file(path);
+
+                    if(!file) {
+                        file = fatfs.add_file(path);
+                        fatfs.write_file_data(file, data.c_str(), data.size());
+                    } else if(i % 3 == 0)
+                        fatfs.delete_file(path);
+                    else
+                        fatfs.append_file_data(file, data.c_str(), i % 200);
+                }
+            });
+        }
+        for(std::thread &worker : workers) worker.join();
+
+        live_free = fatfs.free_size();
+        is_concurrent = live_free + fatfs.size() == fatfs.total_size();
+        fatfs.close_disk();
+    }
+    {
+        std::fstream image("testconcurrent.disk",
+                           std::ios::in | std::ios::out | std::ios::binary);
+        int unclean = 0;
+        image.seekp(fs::Disk::HEADER_SZ + fs::FatFS::META_CLEAN * sizeof(int));
+        image.write((const char *)&unclean, sizeof(unclean));
+    }
+    {
+        fs::Disk disk("testconcurrent");
+        fs::FatFS fatfs;
+
+        disk.open("testconcurrent");
+        fatfs.set_disk(&disk);
+
+        is_concurrent = is_concurrent && fatfs.open_disk() &&
+                        fatfs.free_size() == live_free &&
+                        fatfs.free_size() + fatfs.size() == fatfs.total_size();
+        std::cout << "Scanned FAT and rebuilt sizes "
+                  << (is_concurrent ? "match" : "mismatch") << std::endl;
+
+        fatfs.remove();
+    }
+
+    return is_guarded && is_replayed && is_consistent && is_mapped &&
+                   is_sized && is_narrow && is_large && is_legacy &&
+                   is_stale && is_concurrent
+               ? 0
+               : 1;
 }